@@ -0,0 +1,565 @@
+// SPDX-License-Identifier: Beerware
+
+/*
+ * Microbenchmarks, built and run by "make bench". Linked with instr.c compiled
+ * with the assembler.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "images.h"
+#include "instr.h"
+#include "key.h"
+#include "sharand.h"
+#include "tim.h"
+#include "wtptp-internal.h"
+
+#ifndef MOX_IMAGER_VERSION
+#define MOX_IMAGER_VERSION "unknown"
+#endif
+
+#define BENCH_SAMPLES	7
+
+struct bench {
+	const char *name;
+	void (*setup)(void);
+	void (*run)(void);
+	/* bytes processed by one run, for throughput */
+	size_t bytes;
+
+	/* results */
+	u64 iters;
+	double median, min;
+};
+
+static volatile u32 sink;
+
+/* deterministic data, so that runs are comparable */
+static u32 rnd_state = 0x6d6f7821;
+
+static u32 rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void *rnd_buf(size_t size)
+{
+	u8 *buf = xmalloc(size);
+	size_t i;
+
+	for (i = 0; i < size; ++i)
+		buf[i] = rnd();
+
+	return buf;
+}
+
+/* image_hash() */
+
+#define HASH_BUF_SIZE	(8 << 20)
+
+static void *hash_buf;
+
+static void hash_setup(void)
+{
+	if (!hash_buf)
+		hash_buf = rnd_buf(HASH_BUF_SIZE);
+}
+
+static void hash_sha256(void)
+{
+	u32 out[16];
+
+	image_hash(HASH_SHA256, hash_buf, HASH_BUF_SIZE, out, -1U);
+	sink += out[0];
+}
+
+static void hash_sha512(void)
+{
+	u32 out[16];
+
+	image_hash(HASH_SHA512, hash_buf, HASH_BUF_SIZE, out, -1U);
+	sink += out[0];
+}
+
+/* tim_rehash() / tim_parse() on TIMH + TIMN with WTMI and OBMI */
+
+#define SET_WTMI_SIZE	(96 << 10)
+#define SET_OBMI_SIZE	(1536 << 10)
+
+static image_t set_timh, set_timn, *set_wtmi, *set_obmi;
+
+/* trusted image set, as built by --create-trusted-image for SPI */
+static void set_setup(void)
+{
+	struct tim_builder b;
+	signkey_t *key;
+
+	if (set_wtmi)
+		return;
+
+	set_wtmi = image_new(rnd_buf(SET_WTMI_SIZE), SET_WTMI_SIZE, WTMI_ID);
+	set_obmi = image_new(rnd_buf(SET_OBMI_SIZE), SET_OBMI_SIZE, OBMI_ID);
+
+	sharand_seed("Turris Mox", 10, "bench", 5);
+	key = sharand_generate_key();
+
+	tim_builder_minimal(&b, 1, TIMH_ID, 0);
+	tim_builder_set_boot(&b, BOOTFS_SPINOR);
+	tim_builder_imap_set(&b, name2id("CSKT"), 0x1000, 0);
+	tim_builder_add_key(&b, name2id("CSK0"), key);
+	tim_builder_finish(&b, &set_timh);
+	tim_sign(&set_timh, key);
+
+	tim_builder_minimal(&b, 1, TIMN_ID, 0);
+	tim_builder_set_boot(&b, BOOTFS_SPINOR);
+	tim_builder_add_image(&b, set_wtmi, TIMN_ID, 0x1fff0000, 0x4000, 0, 1);
+	tim_builder_add_image(&b, set_obmi, WTMI_ID, 0x64100000, 0x20000, 0, 1);
+	tim_builder_finish(&b, &set_timn);
+	tim_sign(&set_timn, key);
+
+	free_signkey(key);
+}
+
+static void set_rehash(void)
+{
+	/* forget digests cached in the images */
+	set_wtmi->hashalg = 0;
+	set_obmi->hashalg = 0;
+
+	tim_rehash(&set_timh);
+	tim_rehash(&set_timn);
+}
+
+static void set_parse(void)
+{
+	set_wtmi->hashalg = 0;
+	set_obmi->hashalg = 0;
+
+	tim_set_quiet(1);
+	tim_parse(&set_timh, NULL, 0, NULL);
+	tim_parse(&set_timn, NULL, 0, NULL);
+	tim_check_key_chain(&set_timh, &set_timn);
+	tim_set_quiet(0);
+}
+
+/* assemble() / disassemble() on the GPP sources */
+
+#define GPP_MAX	16
+
+static char *gpp_src[GPP_MAX];
+static size_t gpp_srclen[GPP_MAX];
+static u32 *gpp_code[GPP_MAX];
+static int gpp_codelen[GPP_MAX];
+static int ngpp;
+
+static void gpp_setup(void)
+{
+	glob_t g;
+	size_t i;
+
+	if (ngpp)
+		return;
+
+	if (glob("gpp/*.gpp.pre", 0, NULL, &g) || !g.gl_pathc)
+		die("No preprocessed GPP sources found, run make first");
+
+	for (i = 0; i < g.gl_pathc && ngpp < GPP_MAX; ++i) {
+		FILE *fp = fopen(g.gl_pathv[i], "r");
+
+		if (!fp)
+			die("Cannot open %s: %m", g.gl_pathv[i]);
+
+		gpp_srclen[ngpp] = getdelim(&gpp_src[ngpp], &(size_t){ 0 },
+					    '\0', fp);
+		fclose(fp);
+
+		fp = fmemopen(gpp_src[ngpp], gpp_srclen[ngpp], "r");
+		gpp_codelen[ngpp] = assemble(&gpp_code[ngpp], fp,
+					     g.gl_pathv[i]);
+		fclose(fp);
+
+		++ngpp;
+	}
+
+	globfree(&g);
+}
+
+static size_t gpp_src_bytes(void)
+{
+	size_t i, res = 0;
+
+	gpp_setup();
+	for (i = 0; i < ngpp; ++i)
+		res += gpp_srclen[i];
+
+	return res;
+}
+
+static void gpp_assemble(void)
+{
+	u32 *code;
+	FILE *fp;
+	int i;
+
+	for (i = 0; i < ngpp; ++i) {
+		/* assemble() modifies the lines it reads, so use a copy */
+		char *src = xstrndup(gpp_src[i], gpp_srclen[i]);
+
+		fp = fmemopen(src, gpp_srclen[i], "r");
+		sink += assemble(&code, fp, "bench");
+		fclose(fp);
+		free(code);
+		free(src);
+	}
+}
+
+static void gpp_disassemble(void)
+{
+	int i;
+
+	for (i = 0; i < ngpp; ++i)
+		sink += disassemble(NULL, gpp_code[i], gpp_codelen[i]);
+}
+
+static void gpp_format_all(void)
+{
+	static char buf[GPP_FORMAT_MAX + 8];
+	gpp_insn_t insn;
+	size_t pos;
+	int i;
+
+	for (i = 0; i < ngpp; ++i)
+		for (pos = 0; pos < gpp_codelen[i];) {
+			pos += gpp_decode(&insn, gpp_code[i] + pos,
+					  gpp_codelen[i] - pos, pos);
+			sink += gpp_format(buf, "\t", &insn);
+		}
+}
+
+/* compute_best_uart_params() for all baudrates the tool can be asked for */
+
+static void uart_params(void)
+{
+	static const u32 bauds[] = {
+		9600, 19200, 38400, 57600, 115200, 230400, 460800, 500000,
+		576000, 921600, 1000000, 1152000, 1500000, 2000000, 2500000,
+		3000000, 3500000, 4000000, 4500000, 5000000, 5500000, 6000000,
+	};
+	u32 div, m;
+	int i;
+
+	/* TBG at 1.2 GHz, as on Armada 3720 boards with 25 MHz crystal */
+	for (i = 0; i < sizeof(bauds) / sizeof(bauds[0]); ++i)
+		if (!compute_best_uart_params(1200000000, bauds[i], &div, &m))
+			sink += div + m;
+}
+
+/* eccread() from an in-memory transport */
+
+#define ECC_SIZE	4096
+
+static u8 *ecc_stream;
+static size_t ecc_pos;
+
+static ssize_t mem_read(transport_t *t, void *buf, size_t len)
+{
+	if (len > 8 * ECC_SIZE - ecc_pos)
+		len = 8 * ECC_SIZE - ecc_pos;
+
+	memcpy(buf, ecc_stream + ecc_pos, len);
+	ecc_pos += len;
+
+	return len;
+}
+
+static transport_t mem_transport = {
+	.name = "memory",
+	.read = mem_read,
+};
+
+static void ecc_setup(void)
+{
+	int i, j;
+
+	if (ecc_stream)
+		return;
+
+	/* every bit is sent as a byte, with one random bit flipped in some */
+	ecc_stream = xmalloc(8 * ECC_SIZE);
+	for (i = 0; i < ECC_SIZE; ++i) {
+		u8 c = rnd();
+
+		for (j = 0; j < 8; ++j) {
+			u8 b = (c >> j) & 1 ? 0x7f : 0x00;
+
+			if (!(rnd() & 7))
+				b ^= 1 << (rnd() % 7);
+			ecc_stream[8 * i + j] = b;
+		}
+	}
+
+	/* always readable, data come from the buffer */
+	mem_transport.fd = open("/dev/zero", O_RDONLY);
+	if (mem_transport.fd < 0)
+		die("Cannot open /dev/zero: %m");
+}
+
+static void ecc_read(void)
+{
+	static u8 out[ECC_SIZE];
+
+	wtp_set_transport(&mem_transport);
+	ecc_pos = 0;
+	eccread(out, ECC_SIZE);
+	wtp_set_transport(NULL);
+	sink += out[ECC_SIZE - 1];
+}
+
+/* terminal_input_process() on keyboard input with escape sequences */
+
+#define TERM_SIZE	(1 << 20)
+
+static char *term_in, *term_out;
+
+static void term_setup(void)
+{
+	size_t i;
+
+	if (term_in)
+		return;
+
+	term_in = xmalloc(TERM_SIZE);
+	term_out = xmalloc(sizeof(((struct terminal_input *) 0)->pending) +
+			   4096);
+
+	for (i = 0; i < TERM_SIZE; ++i) {
+		u32 r = rnd();
+
+		/* pasted text, with a backspace key every 256 bytes or so */
+		if (!(r & 0xff) && i + 4 < TERM_SIZE) {
+			memcpy(term_in + i, "\33[3~", 4);
+			i += 3;
+		} else {
+			term_in[i] = 0x20 + (r >> 8) % 0x5f;
+		}
+	}
+}
+
+static void term_scan(void)
+{
+	struct terminal_input ti = {
+		.quit = "\34c",
+		.quitlen = 2,
+		.kbs = "\33[3~",
+		.kbslen = 4,
+	};
+	size_t i;
+
+	for (i = 0; i < TERM_SIZE; i += 4096)
+		sink += terminal_input_process(&ti, term_in + i, 4096,
+					       term_out);
+}
+
+static struct bench benches[] = {
+	{ "image_hash/sha256-8MiB", hash_setup, hash_sha256, HASH_BUF_SIZE },
+	{ "image_hash/sha512-8MiB", hash_setup, hash_sha512, HASH_BUF_SIZE },
+	{ "tim_rehash/timh+timn", set_setup, set_rehash,
+	  SET_WTMI_SIZE + SET_OBMI_SIZE },
+	{ "tim_parse/timh+timn", set_setup, set_parse,
+	  SET_WTMI_SIZE + SET_OBMI_SIZE },
+	{ "gpp/assemble", gpp_setup, gpp_assemble },
+	{ "gpp/disassemble", gpp_setup, gpp_disassemble },
+	{ "gpp/format", gpp_setup, gpp_format_all },
+	{ "uart/best_params-all-bauds", NULL, uart_params },
+	{ "uart/eccread-4KiB", ecc_setup, ecc_read, ECC_SIZE },
+	{ "terminal/input-scan-1MiB", term_setup, term_scan, TERM_SIZE },
+};
+
+#define NBENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Find number of iterations taking at least the sample time, then take
+ * BENCH_SAMPLES samples and report median and minimum time per run.
+ */
+static void bench_run(struct bench *b, double sample_time)
+{
+	double t, samples[BENCH_SAMPLES];
+	u64 i, iters = 1;
+	int s;
+
+	if (b->setup)
+		b->setup();
+
+	while (1) {
+		t = now();
+		for (i = 0; i < iters; ++i)
+			b->run();
+		t = now() - t;
+
+		if (t >= sample_time)
+			break;
+
+		iters = t > sample_time / 100 ? iters * sample_time / t + 1 :
+						iters * 10;
+	}
+
+	for (s = 0; s < BENCH_SAMPLES; ++s) {
+		t = now();
+		for (i = 0; i < iters; ++i)
+			b->run();
+		samples[s] = (now() - t) / iters;
+	}
+
+	qsort(samples, BENCH_SAMPLES, sizeof(double), cmp_double);
+
+	b->iters = iters;
+	b->median = samples[BENCH_SAMPLES / 2];
+	b->min = samples[0];
+}
+
+static void print_table(struct bench **run, int nrun)
+{
+	int i;
+
+	printf("%-30s %10s %14s %14s %12s\n", "benchmark", "iterations",
+	       "median ns/op", "min ns/op", "MB/s");
+
+	for (i = 0; i < nrun; ++i) {
+		struct bench *b = run[i];
+
+		printf("%-30s %10llu %14.0f %14.0f ", b->name, b->iters,
+		       b->median * 1e9, b->min * 1e9);
+		if (b->bytes)
+			printf("%12.1f\n", b->bytes / b->median / 1e6);
+		else
+			printf("%12s\n", "-");
+	}
+}
+
+static void write_json(const char *path, struct bench **run, int nrun)
+{
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		die("Cannot open %s: %m", path);
+
+	fprintf(fp, "{\n  \"version\": \"%s\",\n  \"time\": %lld,\n"
+		"  \"samples\": %d,\n  \"benchmarks\": [\n",
+		MOX_IMAGER_VERSION, (long long) time(NULL), BENCH_SAMPLES);
+
+	for (i = 0; i < nrun; ++i) {
+		struct bench *b = run[i];
+
+		fprintf(fp, "    { \"name\": \"%s\", \"iterations\": %llu, "
+			"\"median_ns\": %.1f, \"min_ns\": %.1f, "
+			"\"bytes\": %zu }%s\n", b->name, b->iters,
+			b->median * 1e9, b->min * 1e9, b->bytes,
+			i + 1 < nrun ? "," : "");
+	}
+
+	fprintf(fp, "  ]\n}\n");
+
+	if (fclose(fp))
+		die("Cannot write %s: %m", path);
+}
+
+static void help(void)
+{
+	fprintf(stdout,
+		"Usage: mox-imager-bench [OPTION]... [BENCHMARK-PREFIX]...\n\n"
+		"  -j, --json=FILE     also write results as JSON to FILE\n"
+		"  -t, --time=SECONDS  time of one sample (default 0.1)\n"
+		"  -l, --list          list benchmarks and exit\n"
+		"  -h, --help          show this help and exit\n"
+		"\n");
+	exit(EXIT_SUCCESS);
+}
+
+static const struct option long_options[] = {
+	{ "json",	required_argument,	0,	'j' },
+	{ "time",	required_argument,	0,	't' },
+	{ "list",	no_argument,		0,	'l' },
+	{ "help",	no_argument,		0,	'h' },
+	{ 0,		0,			0,	0 },
+};
+
+int main(int argc, char **argv)
+{
+	struct bench *run[NBENCHES];
+	const char *json = NULL;
+	double sample_time = 0.1;
+	int i, j, nrun = 0;
+	char *end;
+
+	while (1) {
+		int c = getopt_long(argc, argv, "j:t:lh", long_options, NULL);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'j':
+			json = optarg;
+			break;
+		case 't':
+			sample_time = strtod(optarg, &end);
+			if (*end || sample_time <= 0)
+				die("Invalid sample time \"%s\"", optarg);
+			break;
+		case 'l':
+			for (i = 0; i < NBENCHES; ++i)
+				printf("%s\n", benches[i].name);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			help();
+			break;
+		default:
+			die("Try 'mox-imager-bench --help' for more information");
+		}
+	}
+
+	for (i = 0; i < NBENCHES; ++i) {
+		int selected = optind == argc;
+
+		for (j = optind; j < argc; ++j)
+			if (!strncmp(benches[i].name, argv[j], strlen(argv[j])))
+				selected = 1;
+
+		if (selected)
+			run[nrun++] = &benches[i];
+	}
+
+	if (!nrun)
+		die("No benchmark matches");
+
+	for (i = 0; i < nrun; ++i) {
+		if (run[i]->run == gpp_assemble && !run[i]->bytes)
+			run[i]->bytes = gpp_src_bytes();
+
+		fprintf(stderr, "Running %s\n", run[i]->name);
+		bench_run(run[i], sample_time);
+	}
+
+	print_table(run, nrun);
+
+	if (json)
+		write_json(json, run, nrun);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: Beerware
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+
+static const char *cache_dir;
+static u8 self_digest[32];
+static unsigned int tmp_counter;
+
+static void digest_fd(EVP_MD_CTX *ctx, int fd, const char *path)
+{
+	u8 buf[65536];
+	ssize_t rd;
+
+	while ((rd = read(fd, buf, sizeof(buf))) != 0) {
+		if (rd < 0 && errno == EINTR)
+			continue;
+		else if (rd < 0)
+			die("Cannot read %s: %m", path);
+
+		EVP_DigestUpdate(ctx, buf, rd);
+	}
+}
+
+void cache_open(const char *dir)
+{
+	EVP_MD_CTX *ctx;
+	struct stat st;
+	int fd;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		die("Cannot create cache directory %s: %m", dir);
+
+	if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+		die("%s is not a directory", dir);
+
+	/* any change of the tool (version, GPP code, ...) invalidates entries */
+	fd = open("/proc/self/exe", O_RDONLY);
+	if (fd < 0)
+		die("Cannot open /proc/self/exe: %m");
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		die("Cannot initialize SHA-256");
+	digest_fd(ctx, fd, "/proc/self/exe");
+	EVP_DigestFinal_ex(ctx, self_digest, NULL);
+	EVP_MD_CTX_free(ctx);
+
+	close(fd);
+
+	cache_dir = dir;
+}
+
+int cache_enabled(void)
+{
+	return cache_dir != NULL;
+}
+
+void cache_key_init(cache_key_t *k, const char *kind)
+{
+	k->ctx = EVP_MD_CTX_new();
+	if (!k->ctx || !EVP_DigestInit_ex(k->ctx, EVP_sha256(), NULL))
+		die("Cannot initialize SHA-256");
+
+	k->name[0] = '\0';
+	cache_key_add(k, self_digest, sizeof(self_digest));
+	cache_key_add(k, kind, strlen(kind) + 1);
+}
+
+void cache_key_add(cache_key_t *k, const void *buf, size_t len)
+{
+	EVP_DigestUpdate(k->ctx, buf, len);
+}
+
+void cache_key_add_u32(cache_key_t *k, u32 val)
+{
+	val = htole32(val);
+	cache_key_add(k, &val, sizeof(val));
+}
+
+void cache_key_add_file(cache_key_t *k, const char *path)
+{
+	EVP_MD_CTX *ctx;
+	u8 digest[32];
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die("Cannot open %s: %m", path);
+
+	/* digest of the content, so that file boundaries are part of the key */
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+		die("Cannot initialize SHA-256");
+	digest_fd(ctx, fd, path);
+	EVP_DigestFinal_ex(ctx, digest, NULL);
+	EVP_MD_CTX_free(ctx);
+
+	close(fd);
+
+	cache_key_add(k, digest, sizeof(digest));
+}
+
+void cache_key_add_signkey(cache_key_t *k, const signkey_t *key)
+{
+	if (!key) {
+		cache_key_add_u32(k, 0);
+		return;
+	}
+
+	cache_key_add_u32(k, 1);
+	cache_key_add(k, key->x, sizeof(key->x));
+	cache_key_add(k, key->y, sizeof(key->y));
+}
+
+static void cache_key_final(cache_key_t *k)
+{
+	u8 digest[32];
+	int i;
+
+	if (k->name[0])
+		return;
+
+	EVP_DigestFinal_ex(k->ctx, digest, NULL);
+	EVP_MD_CTX_free(k->ctx);
+	k->ctx = NULL;
+
+	for (i = 0; i < 32; ++i)
+		sprintf(&k->name[2 * i], "%02x", digest[i]);
+}
+
+static char *entry_path(const cache_key_t *k)
+{
+	char *path;
+
+	path = xmalloc(strlen(cache_dir) + sizeof(k->name) + 6);
+	sprintf(path, "%s/%s.bin", cache_dir, k->name);
+
+	return path;
+}
+
+char *cache_get_path(cache_key_t *k)
+{
+	char *path;
+
+	cache_key_final(k);
+
+	path = entry_path(k);
+	if (access(path, R_OK)) {
+		free(path);
+		return NULL;
+	}
+
+	return path;
+}
+
+void *cache_get(cache_key_t *k, size_t *size)
+{
+	struct stat st;
+	char *path;
+	void *data;
+	int fd;
+
+	cache_key_final(k);
+
+	path = entry_path(k);
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+		    0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+
+	return data;
+}
+
+/*
+ * Errors when storing are not fatal, the output was already produced. The
+ * rename is atomic, so concurrent jobs producing the same entry only race on
+ * which of the (equivalent) files stays.
+ */
+void cache_put(const cache_key_t *k, const void *buf, size_t size)
+{
+	char *path, *tmp;
+	ssize_t wr;
+	int fd, ok;
+
+	path = entry_path(k);
+	tmp = xmalloc(strlen(path) + 32);
+	sprintf(tmp, "%s.%d.%u.tmp", path, getpid(),
+		__atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create cache entry %s: %m\n", tmp);
+		goto out;
+	}
+
+	while (size) {
+		wr = write(fd, buf, size);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		else if (wr <= 0)
+			break;
+
+		buf += wr;
+		size -= wr;
+	}
+
+	ok = !size && !fsync(fd);
+	if (close(fd) < 0)
+		ok = 0;
+
+	if (!ok || rename(tmp, path) < 0) {
+		fprintf(stderr, "Cannot write cache entry %s: %m\n", path);
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(path);
+}
+
+void cache_put_file(const cache_key_t *k, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		die("Cannot open %s: %m", path);
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		die("Cannot mmap %s: %m", path);
+
+	close(fd);
+
+	cache_put(k, data, st.st_size);
+	munmap(data, st.st_size);
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <openssl/evp.h>
+#include "key.h"
+#include "utils.h"
+
+/*
+ * Cache of generated images. An entry is named by the SHA-256 of everything
+ * the output depends on: the mox-imager binary itself, the kind of output,
+ * input contents, signing key fingerprint and options. Entries are written to
+ * a temporary file and renamed, so parallel jobs sharing the directory never
+ * see a partial entry.
+ */
+typedef struct {
+	EVP_MD_CTX *ctx;
+	char name[65];
+} cache_key_t;
+
+extern void cache_open(const char *dir);
+extern int cache_enabled(void);
+
+extern void cache_key_init(cache_key_t *k, const char *kind);
+extern void cache_key_add(cache_key_t *k, const void *buf, size_t len);
+extern void cache_key_add_u32(cache_key_t *k, u32 val);
+extern void cache_key_add_file(cache_key_t *k, const char *path);
+extern void cache_key_add_signkey(cache_key_t *k, const signkey_t *key);
+
+/* finish the key and return the path of the entry (to be freed) or NULL */
+extern char *cache_get_path(cache_key_t *k);
+/* finish the key and return the entry mmapped (private copy) or NULL */
+extern void *cache_get(cache_key_t *k, size_t *size);
+extern void cache_put(const cache_key_t *k, const void *buf, size_t size);
+extern void cache_put_file(const cache_key_t *k, const char *path);
+
+#endif /* _CACHE_H_ */
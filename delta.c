@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: Beerware
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <endian.h>
+#include "delta.h"
+#include "images.h"
+#include "tim.h"
+#include "utils.h"
+
+#define MAX_REGIONS	64
+#define MAX_TIM_CHAIN	4
+
+static void *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die("Cannot open %s: %m", path);
+
+	if (fstat(fd, &st) < 0)
+		die("Cannot stat %s: %m", path);
+
+	if (!S_ISREG(st.st_mode))
+		die("%s is not a regular file", path);
+
+	*size = st.st_size;
+	if (!st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		die("Cannot mmap %s: %m", path);
+
+	close(fd);
+
+	return data;
+}
+
+static int add_region(struct flash_region *regions, int n, u32 id, u32 start,
+		      u32 size)
+{
+	if (n == MAX_REGIONS || !size)
+		return n;
+
+	strcpy(regions[n].name, id2name(id));
+	regions[n].start = start;
+	regions[n].end = start + size;
+
+	return n + 1;
+}
+
+/*
+ * Add regions of images described by the TIM at address addr of the flash
+ * image, and recursively of the TIM referenced by the CSKT image map. chain
+ * holds addresses of the depth TIMs referencing this one.
+ */
+static int tim_regions(const u8 *data, size_t size, u32 addr,
+		       struct flash_region *regions, int n, u32 *chain,
+		       int depth)
+{
+	timhdr_t *timhdr;
+	image_t tim;
+	u32 cskt;
+	int i;
+
+	for (i = 0; i < depth; ++i)
+		if (chain[i] == addr)
+			die("TIM at 0x%08x references itself through CSKT",
+			    addr);
+
+	if (depth == MAX_TIM_CHAIN)
+		die("Too many TIMs chained through CSKT");
+
+	chain[depth] = addr;
+
+	if (addr > size || size - addr < sizeof(timhdr_t) ||
+	    (memcmp(data + addr + 4, "HMIT", 4) &&
+	     memcmp(data + addr + 4, "NMIT", 4)))
+		return n;
+
+	timhdr = (void *) (data + addr);
+	if (tim_size(timhdr) > size - addr)
+		return n;
+
+	tim.id = le32toh(timhdr->identifier);
+	tim.size = tim_size(timhdr);
+	tim.data = (void *) timhdr;
+
+	n = add_region(regions, n, tim.id, addr, tim.size);
+
+	for (i = 0; i < tim_nimages(timhdr); ++i) {
+		imginfo_t *img = tim_image(timhdr, i);
+		u32 entry = le32toh(img->flashentryaddr);
+
+		if (le32toh(img->id) == tim.id || entry >= size)
+			continue;
+
+		n = add_region(regions, n, le32toh(img->id), entry,
+			       le32toh(img->size));
+	}
+
+	cskt = tim_imap_pkg_addr(&tim, name2id("CSKT"));
+	if (cskt != -1U)
+		n = tim_regions(data, size, cskt, regions, n, chain, depth + 1);
+
+	return n;
+}
+
+static void region_names(char *buf, u32 start, u32 end,
+			 const struct flash_region *regions, int n)
+{
+	int i, j;
+
+	buf[0] = '\0';
+
+	for (i = 0; i < n; ++i) {
+		if (regions[i].end <= start || regions[i].start >= end)
+			continue;
+
+		/* skip names already listed */
+		for (j = 0; j < i; ++j)
+			if (!strcmp(regions[i].name, regions[j].name) &&
+			    regions[j].end > start && regions[j].start < end)
+				break;
+		if (j < i)
+			continue;
+
+		if (buf[0])
+			strcat(buf, ",");
+		strcat(buf, regions[i].name);
+	}
+
+	if (!buf[0])
+		strcpy(buf, "-");
+}
+
+static int block_differs(const u8 *old, size_t oldsize, const u8 *new,
+			 u32 start, u32 end)
+{
+	/* content not present in the old image is considered different */
+	if (end > oldsize)
+		return 1;
+
+	return memcmp(old + start, new + start, end - start) != 0;
+}
+
+static void write_all(int fd, const void *buf, size_t size, const char *path)
+{
+	ssize_t wr;
+
+	while (size) {
+		wr = write(fd, buf, size);
+		if (wr < 0)
+			die("Cannot write to %s: %m", path);
+
+		buf += wr;
+		size -= wr;
+	}
+}
+
+/*
+ * Compute which erase blocks of the new flash image differ from the old one,
+ * print an update plan, and optionally write a patch file containing only the
+ * blocks that need to be reflashed.
+ */
+void flash_delta(const char *oldpath, const char *newpath, const char *output,
+		 u32 blocksize, const struct flash_region *layout, int nlayout)
+{
+	struct flash_region regions[MAX_REGIONS];
+	u32 chain[MAX_TIM_CHAIN];
+	delta_range_t *ranges;
+	delta_hdr_t hdr;
+	u32 hash[16];
+	size_t oldsize, newsize;
+	u32 off, nblocks, nchanged, nranges, i;
+	u8 *old, *new;
+	int n, fd;
+
+	if (!blocksize || (blocksize & (blocksize - 1)))
+		die("Erase block size must be a power of 2");
+
+	old = map_file(oldpath, &oldsize);
+	new = map_file(newpath, &newsize);
+
+	if (newsize > 0xffffffffU)
+		die("%s is too large", newpath);
+
+	n = tim_regions(new, newsize, 0, regions, 0, chain, 0);
+	for (i = 0; i < (u32) nlayout && n < MAX_REGIONS; ++i)
+		regions[n++] = layout[i];
+
+	nblocks = (newsize + blocksize - 1) / blocksize;
+	ranges = xmalloc((nblocks + 1) * sizeof(*ranges));
+	nranges = nchanged = 0;
+
+	for (off = 0; off < newsize; off += blocksize) {
+		u32 end = off + blocksize;
+
+		if (!block_differs(old, oldsize, new, off,
+				   end > newsize ? newsize : end))
+			continue;
+
+		++nchanged;
+
+		/* the last range is padded to a whole erase block */
+		if (nranges && ranges[nranges - 1].offset +
+			       ranges[nranges - 1].size == off)
+			ranges[nranges - 1].size += blocksize;
+		else
+			ranges[nranges++] = (delta_range_t){ off, blocksize };
+	}
+
+	printf("Erase block size %u KiB, %u of %u blocks differ (%u KiB of %zu KiB)\n",
+	       blocksize / 1024, nchanged, nblocks,
+	       nchanged * (blocksize / 1024), (newsize + 1023) / 1024);
+
+	for (i = 0; i < nranges; ++i) {
+		char names[MAX_REGIONS * 5];
+
+		region_names(names, ranges[i].offset,
+			     ranges[i].offset + ranges[i].size, regions, n);
+		printf("  update 0x%08x-0x%08x (%u blocks) %s\n",
+		       ranges[i].offset, ranges[i].offset + ranges[i].size,
+		       ranges[i].size / blocksize, names);
+	}
+
+	printf("\n");
+
+	if (output) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = htole32(DELTA_MAGIC);
+		hdr.version = htole32(1);
+		hdr.blocksize = htole32(blocksize);
+		hdr.imagesize = htole32(newsize);
+		hdr.nranges = htole32(nranges);
+		image_hash(HASH_SHA256, new, newsize, hash, -1U);
+		memcpy(hdr.sha256, hash, sizeof(hdr.sha256));
+
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			die("Cannot open %s for writing: %m", output);
+
+		write_all(fd, &hdr, sizeof(hdr), output);
+
+		for (i = 0; i < nranges; ++i) {
+			u32 len = ranges[i].size;
+			delta_range_t r;
+
+			r.offset = htole32(ranges[i].offset);
+			r.size = htole32(ranges[i].size);
+			write_all(fd, &r, sizeof(r), output);
+
+			/* the block past the end of the image is left erased */
+			if (ranges[i].offset + len > newsize)
+				len = newsize - ranges[i].offset;
+			write_all(fd, new + ranges[i].offset, len, output);
+			if (len < ranges[i].size) {
+				u8 *pad = xmalloc(ranges[i].size - len);
+
+				memset(pad, 0xff, ranges[i].size - len);
+				write_all(fd, pad, ranges[i].size - len,
+					  output);
+				free(pad);
+			}
+		}
+
+		close(fd);
+		printf("Saved delta to %s\n\n", output);
+	}
+
+	free(ranges);
+	if (old)
+		munmap(old, oldsize);
+	if (new)
+		munmap(new, newsize);
+}
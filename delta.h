@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "utils.h"
+
+/*
+ * Delta patch file format (all fields little endian):
+ *   delta_hdr_t
+ *   nranges times:
+ *     delta_range_t
+ *     size bytes of new flash content for this range
+ *
+ * Ranges are aligned to erase blocks, sorted and non-overlapping. The last
+ * erase block of the image is padded with 0xff bytes (erased flash). After all
+ * ranges are written, the first imagesize bytes of flash must have SHA-256
+ * digest equal to sha256.
+ */
+#define DELTA_MAGIC	name2id("MOXD")
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 blocksize;
+	u32 imagesize;
+	u32 nranges;
+	u32 sha256[8];
+} delta_hdr_t;
+
+typedef struct {
+	u32 offset;
+	u32 size;
+} delta_range_t;
+
+struct flash_region {
+	char name[5];
+	u32 start;
+	u32 end;
+};
+
+extern void flash_delta(const char *oldpath, const char *newpath,
+			const char *output, u32 blocksize,
+			const struct flash_region *layout, int nlayout);
+
+#endif /* _DELTA_H_ */
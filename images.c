@@ -3,6 +3,7 @@
  * 2018 by Marek Behun <marek.behun@nic.cz>
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,27 +11,196 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <linux/fs.h>
 #include <openssl/sha.h>
 #include <endian.h>
 #include "tim.h"
+#include "unpack.h"
 #include "utils.h"
 #include "wtptp.h"
 
-static image_t images[32];
+/*
+ * Images known to the current thread, together with the ids of images a TIM
+ * refers to that were not found in its file yet, and the files mmapped for
+ * them. Threads use the global table unless they switch to a private one.
+ */
+struct image_table {
+	image_t images[32];
+	u32 wait_ids[32];
+	struct {
+		void *data;
+		size_t size;
+		int allocated;
+		unpack_t *unpack;
+		int fd;
+	} maps[32];
+	int nmaps;
+};
+
+static struct image_table global_table;
+static __thread struct image_table *table = &global_table;
+
+struct image_table *image_table_new(void)
+{
+	struct image_table *t;
+
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+
+	return t;
+}
+
+void image_table_use(struct image_table *t)
+{
+	table = t ? : &global_table;
+}
+
+static void unmap(void *data, size_t size, int allocated, unpack_t *unpack,
+		  int fd)
+{
+	if (fd >= 0)
+		close(fd);
+
+	if (unpack)
+		unpack_free(unpack);
+	else if (allocated)
+		free(data);
+	else
+		munmap(data, size);
+}
+
+void image_table_free(struct image_table *t)
+{
+	struct image_table *prev = table;
+	int i;
+
+	table = t;
+	image_delete_all();
+	for (i = 0; i < t->nmaps; ++i)
+		unmap(t->maps[i].data, t->maps[i].size, t->maps[i].allocated,
+		      t->maps[i].unpack, t->maps[i].fd);
+	table = prev == t ? &global_table : prev;
+
+	free(t);
+}
+
+u32 image_waiting(void)
+{
+	int i;
+
+	for (i = 0; i < 32; ++i)
+		if (table->wait_ids[i])
+			return table->wait_ids[i];
+
+	return 0;
+}
 
 image_t *image_find(u32 id)
 {
 	int i;
 
 	for (i = 0; i < 32; ++i) {
-		if (images[i].id == id)
-			return images + i;
+		if (table->images[i].id == id)
+			return table->images + i;
 	}
 
 	die("Cannot find image %s (%08x)", id2name(id), id);
 }
 
+/*
+ * If enabled, files which are mmapped (regular uncompressed files) are kept
+ * open, so that images can be sent from them with sendfile().
+ */
+static int keep_files;
+
+void image_keep_files(int keep)
+{
+	keep_files = keep;
+}
+
+/*
+ * Returns the file descriptor of the file image data are mapped from, and the
+ * offset of the data in it, or -1 if image is not mapped from a kept file.
+ */
+int image_file(const image_t *img, off_t *offset)
+{
+	int i;
+
+	for (i = 0; i < table->nmaps; ++i) {
+		u8 *data = table->maps[i].data;
+
+		if (table->maps[i].fd < 0 || img->data < data ||
+		    img->data + img->size > data + table->maps[i].size)
+			continue;
+
+		*offset = img->data - data;
+		return table->maps[i].fd;
+	}
+
+	return -1;
+}
+
+/*
+ * Read all images into memory and lock them there, so that sending them does
+ * not wait for page faults. Images still being decompressed are written to
+ * memory by the decompressing thread.
+ */
+void image_prefault_all(void)
+{
+	image_t *images = table->images;
+	int i;
+
+	for (i = 0; i < 32; ++i) {
+		if (!images[i].id || images[i].unpack)
+			continue;
+
+		if (mlock(images[i].data, images[i].size) < 0)
+			die("Cannot lock image %s in memory: %m",
+			    id2name(images[i].id));
+	}
+}
+
+/*
+ * Images from compressed input may be used before all of it is decompressed,
+ * if the caller waits for the data it needs with image_wait(). Otherwise the
+ * input is decompressed completely when loaded.
+ */
+static int allow_partial;
+
+/* compressed input being loaded by this thread, if used partially */
+static __thread unpack_t *loading;
+
+void image_allow_partial(int allow)
+{
+	allow_partial = allow;
+}
+
+static size_t unpack_offset(const image_t *img)
+{
+	return img->data - (u8 *) unpack_data(img->unpack);
+}
+
+/* wait till the first end bytes of image are available */
+void image_wait(const image_t *img, u32 end)
+{
+	if (img->unpack)
+		unpack_wait(img->unpack, unpack_offset(img) + end);
+}
+
+/* wait till data of the file being loaded are available up to end */
+static void need(const void *data, size_t data_size, size_t end)
+{
+	if (!loading)
+		return;
+
+	if (end > data_size)
+		end = data_size;
+
+	unpack_wait(loading, (u8 *) data - (u8 *) unpack_data(loading) + end);
+}
+
 void image_hash(u32 alg, void *buf, size_t size, void *out, u32 hashaddr)
 {
 	static const u32 zeros[16];
@@ -68,8 +238,42 @@ void image_hash(u32 alg, void *buf, size_t size, void *out, u32 hashaddr)
 	}
 }
 
+/*
+ * Compute the digest of the whole image and remember it, so that subsequent
+ * image_digest() calls (e.g. when rehashing several TIMs referring to the same
+ * image) do not need to hash the image again.
+ */
+void image_precompute_hash(image_t *img, u32 alg)
+{
+	if (img->hashalg == alg && img->hashsize == img->size)
+		return;
+
+	if (!img->unpack ||
+	    !unpack_get_digest(img->unpack, unpack_offset(img), img->size, alg,
+			       img->hash)) {
+		image_wait(img, img->size);
+		image_hash(alg, img->data, img->size, img->hash, -1U);
+	}
+
+	img->hashalg = alg;
+	img->hashsize = img->size;
+}
+
+void image_digest(const image_t *img, u32 alg, void *out)
+{
+	if (img->hashalg == alg && img->hashsize == img->size) {
+		memcpy(out, img->hash, 64);
+	} else if (!img->unpack ||
+		   !unpack_get_digest(img->unpack, unpack_offset(img),
+				      img->size, alg, out)) {
+		image_wait(img, img->size);
+		image_hash(alg, img->data, img->size, out, -1U);
+	}
+}
+
 image_t *image_new(void *data, u32 size, u32 id)
 {
+	image_t *images = table->images;
 	int i;
 
 	if (!is_id_valid(id))
@@ -86,6 +290,7 @@ image_t *image_new(void *data, u32 size, u32 id)
 	if (i == 32)
 		die("Too many images");
 
+	memset(&images[i], 0, sizeof(images[i]));
 	images[i].id = id;
 	images[i].data = data;
 	images[i].size = size;
@@ -95,6 +300,7 @@ image_t *image_new(void *data, u32 size, u32 id)
 
 void image_delete_all(void)
 {
+	image_t *images = table->images;
 	int i;
 
 	for (i = 0; i < 32; ++i) {
@@ -102,14 +308,16 @@ void image_delete_all(void)
 			if (images[i].id == TIMH_ID || images[i].id == TIMN_ID)
 				free(images[i].data);
 
-		images[i].id = images[i].size = 0;
-		images[i].data = NULL;
+		memset(&images[i], 0, sizeof(images[i]));
 	}
 }
 
 static int do_load(void *data, size_t data_size, u32 hdr_addr)
 {
-	static u32 wait_ids[32];
+	u32 *wait_ids = table->wait_ids;
+
+	/* TIMs are much smaller */
+	need(data, data_size, hdr_addr + 65536);
 
 	if (!memcmp(data + hdr_addr + 4, "HMIT", 4) ||
 	    !memcmp(data + hdr_addr + 4, "NMIT", 4)) {
@@ -128,6 +336,11 @@ static int do_load(void *data, size_t data_size, u32 hdr_addr)
 		tim = image_new(timdata, timsize, le32toh(timhdr->identifier));
 		timhdr = timdata;
 
+		/* TIMN may be awaited by TIMH loaded from another file */
+		for (j = 0; j < 32; ++j)
+			if (wait_ids[j] == tim->id)
+				wait_ids[j] = 0;
+
 		f = 0;
 		for (i = 0; i < tim_nimages(timhdr); ++i) {
 			imginfo_t *img = tim_image(timhdr, i);
@@ -192,9 +405,6 @@ static int do_load(void *data, size_t data_size, u32 hdr_addr)
 		if (do_rehash)
 			tim_rehash(tim);
 
-		if (!f && !hdr_addr)
-			munmap(data, data_size);
-
 		return f;
 	} else {
 		u32 id;
@@ -228,30 +438,276 @@ static int do_load(void *data, size_t data_size, u32 hdr_addr)
 	}
 }
 
+/*
+ * Hash algorithm a loaded TIM checks the whole image with, 0 if none. With
+ * any set, images in untrusted TIMs may get hashed when the TIM is rebuilt.
+ */
+static u32 wanted_hashalg(const image_t *img, int any)
+{
+	image_t *images = table->images;
+	int i, j;
+
+	for (i = 0; i < 32; ++i) {
+		timhdr_t *timhdr;
+
+		if (images[i].id != TIMH_ID && images[i].id != TIMN_ID)
+			continue;
+
+		timhdr = (timhdr_t *) images[i].data;
+		for (j = 0; j < tim_nimages(timhdr); ++j) {
+			imginfo_t *info = tim_image(timhdr, j);
+			u32 alg;
+
+			if (!info)
+				break;
+
+			if (le32toh(info->id) != img->id)
+				continue;
+
+			if (le32toh(info->sizetohash) < img->size &&
+			    !(any && !timhdr->trusted))
+				continue;
+
+			alg = le32toh(info->hashalg);
+			if (alg == HASH_SHA256 || alg == HASH_SHA512)
+				return alg;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hash the images found in a newly loaded file while its pages are read in for
+ * the first time (sequentially, the file is advised so), instead of in another
+ * pass when the TIM is checked. Images no loaded TIM refers to yet are hashed
+ * when needed, as before. Images from compressed input which is still being
+ * decompressed are hashed by the decompressing thread as the data come.
+ */
+static void hash_on_load(const void *data, size_t size, unpack_t *unpack)
+{
+	image_t *images = table->images;
+	int i;
+
+	for (i = 0; i < 32; ++i) {
+		image_t *img = &images[i];
+		u32 alg;
+
+		if (!img->id || img->id == TIMH_ID || img->id == TIMN_ID ||
+		    img->data < (u8 *) data || img->data >= (u8 *) data + size)
+			continue;
+
+		alg = wanted_hashalg(img, !!unpack);
+
+		if (unpack) {
+			img->unpack = unpack;
+			if (alg)
+				unpack_digest(unpack, unpack_offset(img),
+					      img->size, alg);
+		} else if (alg) {
+			image_precompute_hash(img, alg);
+		}
+	}
+}
+
+static int is_tim(const void *data, size_t size)
+{
+	return size >= 8 && (!memcmp(data + 4, "HMIT", 4) ||
+			     !memcmp(data + 4, "NMIT", 4));
+}
+
+/*
+ * Members of a tar archive (e.g. of uart-images) are loaded as if given as
+ * separate files, TIMs first, so that images without id are assigned to ids
+ * the TIMs wait for.
+ */
+static int load_tar(u8 *data, size_t size, const char *path)
+{
+	int pass, f = 0;
+	size_t pos;
+
+	for (pass = 0; pass < 2; ++pass) {
+		for (pos = 0; pos + 512 <= size && data[pos];) {
+			u8 *hdr = data + pos, *member = hdr + 512;
+			char octal[13];
+			size_t msize;
+			char *end;
+
+			memcpy(octal, hdr + 124, 12);
+			octal[12] = '\0';
+			msize = strtoull(octal, &end, 8);
+			if (end == octal || pos + 512 + msize > size)
+				die("Invalid tar archive %s", path);
+
+			/* regular files only */
+			if ((hdr[156] == '0' || !hdr[156]) && msize >= 8 &&
+			    is_tim(member, msize) == !pass)
+				f += do_load(member, msize, 0);
+
+			pos += 512 + ((msize + 511) & ~(size_t) 511);
+		}
+	}
+
+	return f;
+}
+
+/*
+ * Read input which cannot be mmapped (stdin, pipe, character or block device)
+ * into memory, growing the buffer as needed.
+ */
+/* no boot image is larger than the 16 MiB SPI NOR flash of the board */
+#define MAX_STREAM_SIZE	(16 << 20)
+
+/*
+ * Read whole pipe / character device, or the start of a block device (which
+ * may be a whole disk with the boot images at its beginning).
+ */
+static void *read_stream(int fd, const struct stat *st, const char *path,
+			 size_t *sizep)
+{
+	size_t size = 0, alloc = 1 << 20, max = MAX_STREAM_SIZE;
+	u64 devsize;
+	ssize_t rd;
+	u8 *data;
+
+	if (S_ISBLK(st->st_mode) && !ioctl(fd, BLKGETSIZE64, &devsize) &&
+	    devsize) {
+		if (devsize < max)
+			max = devsize;
+		alloc = max;
+	}
+
+	data = xmalloc(alloc);
+
+	while (size < max) {
+		if (size == alloc) {
+			alloc *= 2;
+			data = xrealloc(data, alloc);
+		}
+
+		rd = read(fd, data + size, alloc - size);
+		if (rd < 0 && errno == EINTR)
+			continue;
+		else if (rd < 0)
+			die("Cannot read %s: %m", path);
+		else if (!rd)
+			break;
+
+		size += rd;
+	}
+
+	/* anything more than that in a stream cannot be a boot image */
+	if (size == max && !S_ISBLK(st->st_mode)) {
+		u8 c;
+
+		do
+			rd = read(fd, &c, 1);
+		while (rd < 0 && errno == EINTR);
+
+		if (rd > 0)
+			die("%s is too large (more than %zu bytes)", path, max);
+	}
+
+	*sizep = size;
+
+	return data;
+}
+
+/* path "-" is standard input, compressed files and tar archives are unpacked */
 void image_load(const char *path)
 {
-	int fd;
+	unpack_t *unpack = NULL;
+	const char *format;
+	int fd, i, f, allocated, keep_fd = 0;
 	struct stat st;
+	size_t size;
 	void *data;
 
-	fd = open(path, O_RDONLY);
-	if (fd < 0)
-		die("Cannot open %s: %m", path);
+	if (!strcmp(path, "-")) {
+		fd = STDIN_FILENO;
+		path = "standard input";
+	} else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			die("Cannot open %s: %m", path);
+	}
 
 	if (fstat(fd, &st) < 0)
 		die("Cannot stat %s: %m", path);
 
-	if (!S_ISREG(st.st_mode))
-		die("%s is not a regular file", path);
+	if (S_ISDIR(st.st_mode))
+		die("%s is a directory", path);
+
+	allocated = !S_ISREG(st.st_mode);
+	if (allocated) {
+		data = read_stream(fd, &st, path, &size);
+		if (size < 8)
+			die("%s is too small (%zu bytes)", path, size);
+	} else if ((format = unpack_format(fd))) {
+		unpack = unpack_start(fd, path, format);
+		data = unpack_data(unpack);
+
+		size = allow_partial ? unpack_size_hint(unpack) : 0;
+
+		/* tar archives are always unpacked whole */
+		if (size >= 512) {
+			unpack_wait(unpack, 512);
+			if (!memcmp(data + 257, "ustar", 5))
+				size = 0;
+		}
+
+		if (size)
+			loading = unpack;
+		else
+			size = unpack_finish(unpack);
+
+		if (size < 8)
+			die("%s is too small (%zu bytes)", path, size);
+	} else {
+		size = st.st_size;
+		if (size < 8)
+			die("%s is too small (%zu bytes)", path, size);
+
+		/* start reading ahead, the file is going to be hashed from the start */
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+			    0);
+		if (data == MAP_FAILED)
+			die("Cannot mmap %s: %m", path);
 
-	if (st.st_size < 8)
-		die("%s is too small (%zu bytes)", path, st.st_size);
+		madvise(data, size, MADV_SEQUENTIAL);
 
-	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-	if (data == MAP_FAILED)
-		die("Cannot mmap %s: %m", path);
+		keep_fd = keep_files && fd != STDIN_FILENO;
+	}
+
+	if (fd != STDIN_FILENO && !keep_fd)
+		close(fd);
 
-	close(fd);
+	/* remember the mapping first so that it is freed with the table */
+	i = table->nmaps;
+	if (i == 32)
+		die("Too many image files");
+	table->maps[i].data = data;
+	table->maps[i].size = size;
+	table->maps[i].allocated = allocated;
+	table->maps[i].unpack = unpack;
+	table->maps[i].fd = keep_fd ? fd : -1;
+	table->nmaps++;
+
+	if (!loading && size >= 512 && !memcmp(data + 257, "ustar", 5))
+		f = load_tar(data, size, path);
+	else
+		f = do_load(data, size, 0);
+
+	/* images are not needed if the file only contained a TIM */
+	if (!f) {
+		unmap(data, size, allocated, unpack, table->maps[i].fd);
+		table->nmaps--;
+	} else {
+		hash_on_load(data, size, loading);
+	}
 
-	do_load(data, st.st_size, 0);
+	loading = NULL;
 }
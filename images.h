@@ -6,18 +6,40 @@
 #ifndef _IMAGES_H_
 #define _IMAGES_H_
 
+#include <sys/types.h>
 #include "utils.h"
 
 typedef struct {
 	u32 id;
 	u32 size;
 	u8 *data;
+
+	/* cached digest of the whole image, valid if hashalg is non-zero */
+	u32 hashalg;
+	u32 hashsize;
+	u32 hash[16];
+
+	/* compressed input the image is still being decompressed from */
+	struct unpack *unpack;
 } image_t;
 
+struct image_table;
+
+extern struct image_table *image_table_new(void);
+extern void image_table_use(struct image_table *t);
+extern void image_table_free(struct image_table *t);
+extern u32 image_waiting(void);
 extern image_t *image_find(u32 id);
 extern void image_hash(u32 alg, void *buf, size_t size, void *out, u32 hashaddr);
+extern void image_precompute_hash(image_t *img, u32 alg);
+extern void image_digest(const image_t *img, u32 alg, void *out);
 extern image_t *image_new(void *data, u32 size, u32 id);
 extern void image_delete_all(void);
+extern void image_wait(const image_t *img, u32 end);
+extern void image_allow_partial(int allow);
+extern void image_keep_files(int keep);
+extern int image_file(const image_t *img, off_t *offset);
+extern void image_prefault_all(void);
 extern void image_load(const char *path);
 
 #endif /* _IMAGES_H_ */
@@ -10,16 +10,20 @@
 #include <endian.h>
 #include <ctype.h>
 #include "utils.h"
+#include "instr.h"
 
 struct insn {
 	char *name;
 	u8 code;
 	u8 args;
+	/* index of the comparison operator argument, 0 if none */
+	u8 oparg;
 	char *help;
 };
 
+/* the table is indexed by instruction code */
 #define DECL_INSN(n,c,h)	\
-	{			\
+	[c] = {			\
 		.name = #n,	\
 		.code = c,	\
 		.help = h,	\
@@ -61,7 +65,7 @@ static struct insn insns[] = {
 	DECL_INSN(SUB_SM_SM,			32,	"SM[%d] -= SM[%d]")
 	DECL_INSN(LOAD_SM_FROM_ADDR_IN_SM,	33,	"SM[%d] = *SM[%d]")
 	DECL_INSN(STORE_SM_TO_ADDR_IN_SM,	34,	"*SM[%2d] = SM[%1d]")
-	{ NULL, 0, 0, NULL }
+	{ NULL }
 };
 
 struct op {
@@ -79,133 +83,215 @@ static struct op ops[] = {
 	{ 0,	"" },
 };
 
-static struct insn *find_insn(u32 code)
+#define NINSNS		(sizeof(insns) / sizeof(insns[0]) - 1)
+#define NOPS		(sizeof(ops) / sizeof(ops[0]) - 1)
+
+static u8 count_args(struct insn *insn)
 {
-	int i;
+	const char *help = insn->help;
+	u8 res = 0, max = 0, idx;
+
+	while (*help) {
+		if (*help++ != '%')
+			continue;
 
-	for (i = 0; insns[i].name; ++i)
-		if (insns[i].code == code)
-			return &insns[i];
+		idx = ++res;
+		if (*help >= '1' && *help <= '9') {
+			idx = *help - '0';
+			if (idx > max)
+				max = idx;
+			++help;
+		}
 
-	return NULL;
+		if (*help == 'o')
+			insn->oparg = idx;
+	}
+
+	return max ? max : res;
+}
+
+static __attribute__((constructor)) void insns_init(void)
+{
+	struct insn *insn;
+
+	for (insn = insns; insn->name; ++insn)
+		insn->args = count_args(insn);
+}
+
+int gpp_decode(gpp_insn_t *res, const u32 *input, size_t len, size_t pos)
+{
+	const struct insn *insn;
+
+	if (input[0] >= NINSNS)
+		die("Unrecognized instruction with code %d at position %u", input[0], pos);
+
+	insn = &insns[input[0]];
+
+	if (len - 1 < insn->args)
+		die("Instruction %d (%s) at position %u has too few arguments (%d, needs %d)", input[0], insn->name, pos, len - 1, insn->args);
+
+	if (insn->oparg && (input[insn->oparg] - 1) >= NOPS)
+		die("Unrecognized operation %u for instruction %s at position %u (+%d)", input[insn->oparg], insn->name, pos, insn->oparg);
+
+	res->code = input[0];
+	res->name = insn->name;
+	res->nargs = insn->args;
+	res->args = input + 1;
+	res->pos = pos;
+
+	return insn->args + 1;
+}
+
+int gpp_count(const u32 *input, size_t len)
+{
+	gpp_insn_t insn;
+	size_t pos = 0;
+	int res = 0;
+
+	while (pos < len) {
+		pos += gpp_decode(&insn, input + pos, len - pos, pos);
+		++res;
+	}
+
+	return res;
+}
+
+static char *put_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+
+	return p;
 }
 
-static struct op *find_op(u32 code)
+static char *put_hex(char *p, u32 val)
 {
+	static const char digits[] = "0123456789ABCDEF";
 	int i;
 
-	for (i = 0; ops[i].code; ++i)
-		if (ops[i].code == code)
-			return &ops[i];
+	*p++ = '0';
+	*p++ = 'x';
+	for (i = 28; i >= 0; i -= 4)
+		*p++ = digits[(val >> i) & 0xf];
 
-	return NULL;
+	return p;
 }
 
-static u8 count_args(const char *help)
+static char *put_dec(char *p, int val)
 {
-	u8 res = 0, max = 0;
+	char tmp[11];
+	u32 uval = val;
+	int n = 0;
 
-	while (*help) {
-		if (*help++ == '%') {
-			++res;
-			if (*help >= '1' && *help <= '9') {
-				if (*help - '0' > max)
-					max = *help - '0';
-				++help;
-				continue;
-			}
-		}
+	if (val < 0) {
+		*p++ = '-';
+		uval = -uval;
 	}
 
-	return max ? max : res;
+	do {
+		tmp[n++] = '0' + uval % 10;
+		uval /= 10;
+	} while (uval);
+
+	while (n)
+		*p++ = tmp[--n];
+
+	return p;
 }
 
-static __attribute__((constructor)) void insns_init(void)
+static char *put_pad(char *p, int n)
 {
-	struct insn *insn;
+	memset(p, ' ', n);
 
-	for (insn = insns; insn->name; ++insn)
-		insn->args = count_args(insn->help);
+	return p + n;
 }
 
-static void disasm(const char *lineprefix, struct insn *insn, const u32 *params, int args, size_t pos)
+/*
+ * Format one decoded instruction as a line into buf (big enough for the
+ * longest line) and return its length.
+ */
+size_t gpp_format(char *buf, const char *lineprefix, const gpp_insn_t *insn)
 {
-	char buf[128];
-	int len = 0, idx = 1, i;
-	char *p = insn->help;
-	struct op *op;
-
-	if (lineprefix) {
-		printf("%s%-27s", lineprefix, insn->name);
-		for (i = 1; i <= args; ++i)
-			printf(" 0x%08X", params[i]);
-		for (; i <= 5; ++i)
-			printf("           ");
-		printf(" # ");
+	const struct insn *desc = &insns[insn->code];
+	const char *h = desc->help;
+	int idx = 1, i, namelen;
+	char *p;
+
+	p = put_str(buf, lineprefix);
+	namelen = strlen(insn->name);
+	p = put_str(p, insn->name);
+	if (namelen < 27)
+		p = put_pad(p, 27 - namelen);
+
+	for (i = 0; i < insn->nargs; ++i) {
+		*p++ = ' ';
+		p = put_hex(p, insn->args[i]);
 	}
+	p = put_pad(p, 11 * (5 - i));
+	p = put_str(p, " # ");
 
-	while (*p) {
-		if (*p != '%') {
-			buf[len++] = *p++;
+	while (*h) {
+		if (*h != '%') {
+			*p++ = *h++;
 			continue;
 		}
 
-		++p;
-		if (*p >= '1' && *p <= '5') {
-			idx = *p - '0';
-			++p;
+		++h;
+		if (*h >= '1' && *h <= '5') {
+			idx = *h - '0';
+			++h;
 		}
 
-		switch (*p) {
+		switch (*h) {
 		case 'x':
-			len += sprintf(buf + len, "0x%08X", params[idx]);
+			p = put_hex(p, insn->args[idx - 1]);
 			break;
 		case 'd':
-			len += sprintf(buf + len, "%d", params[idx]);
+			p = put_dec(p, insn->args[idx - 1]);
 			break;
 		case 's':
-			len += sprintf(buf + len, "%s", id2name(htobe32(params[idx])));
+			p = put_str(p, id2name(htobe32(insn->args[idx - 1])));
 			break;
 		case 'o':
-			op = find_op(params[idx]);
-			if (!op)
-				die("Unrecognized operation %u for instruction %s at position %u (+%d)", params[idx], insn->name, pos, idx);
-			len += sprintf(buf + len, "%s", op->repr);
+			p = put_str(p, ops[insn->args[idx - 1] - 1].repr);
 			break;
-		default:
-			die("Unrecognized specifier %%%c", *p);
 		}
-		++p;
+		++h;
 		++idx;
 	}
-	buf[len++] = '\0';
 
-	if (lineprefix)
-		printf("%s\n", buf);
+	*p++ = '\n';
+
+	return p - buf;
 }
 
 int disassemble(const char *lineprefix, const u32 *input, size_t len)
 {
-	size_t pos = 0;
+	char buf[4096];
+	gpp_insn_t insn;
+	size_t pos = 0, blen = 0, max;
 	int res = 0;
 
-	while (len > 0) {
-		struct insn *insn = find_insn(input[0]);
-
-		if (!insn)
-			die("Unrecognized instruction with code %d at position %u", input[0], pos);
+	if (!lineprefix)
+		return gpp_count(input, len);
 
-		if (len - 1 < insn->args)
-			die("Instruction %d (%s) at position %u has too few arguments (%d, needs %d)", input[0], insn->name, pos, len - 1, insn->args);
+	max = strlen(lineprefix) + GPP_FORMAT_MAX;
+	if (max > sizeof(buf))
+		die("Line prefix too long");
 
-		disasm(lineprefix, insn, input, insn->args, pos);
-
-		input += insn->args + 1;
-		pos += insn->args + 1;
-		len -= insn->args + 1;
+	while (pos < len) {
+		pos += gpp_decode(&insn, input + pos, len - pos, pos);
 		++res;
+
+		if (blen + max > sizeof(buf)) {
+			fwrite(buf, 1, blen, stdout);
+			blen = 0;
+		}
+		blen += gpp_format(buf + blen, lineprefix, &insn);
 	}
 
+	fwrite(buf, 1, blen, stdout);
+
 	return res;
 }
 
@@ -9,6 +9,23 @@
 #include <stdio.h>
 #include "utils.h"
 
+/* decoded GPP instruction, args point into the code */
+typedef struct {
+	u32 code;
+	const char *name;
+	int nargs;
+	const u32 *args;
+	size_t pos;
+} gpp_insn_t;
+
+/* the longest line gpp_format() produces, without line prefix */
+#define GPP_FORMAT_MAX	256
+
+extern int gpp_decode(gpp_insn_t *insn, const u32 *input, size_t len,
+		      size_t pos);
+extern int gpp_count(const u32 *input, size_t len);
+extern size_t gpp_format(char *buf, const char *lineprefix,
+			 const gpp_insn_t *insn);
 extern int disassemble(const char *lineprefix, const u32 *input, size_t len);
 extern int assemble(u32 **out, FILE *fp, const char *file);
 
@@ -3,17 +3,40 @@
  * 2018 by Marek Behun <marek.behun@nic.cz>
  */
 
+#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <openssl/bn.h>
+#include <openssl/core_names.h>
 #include <openssl/ec.h>
+#include <openssl/evp.h>
 #include <openssl/obj_mac.h>
+#include <openssl/param_build.h>
 #include "bn.h"
 #include "utils.h"
 #include "sharand.h"
+#include "key.h"
+
+/* P-521 group, built only once and shared by all threads */
+static EC_GROUP *p521;
+static pthread_once_t p521_once = PTHREAD_ONCE_INIT;
+
+static void p521_init(void)
+{
+	p521 = EC_GROUP_new_by_curve_name(NID_secp521r1);
+	if (!p521)
+		die("Cannot create EC group");
+}
+
+static const EC_GROUP *get_p521(void)
+{
+	pthread_once(&p521_once, p521_init);
+
+	return p521;
+}
 
 static void randrange(BIGNUM *dst, BIGNUM *range)
 {
@@ -35,111 +58,142 @@ static void randrange(BIGNUM *dst, BIGNUM *range)
 		*last = htole32(le32toh(*last) & ((1 << (n % 32)) - 1));
 		tim2bn(buf, l, dst);
 	} while (BN_cmp(dst, range) >= 0);
+
+	free(buf);
+}
+
+/*
+ * Build EVP key from public point in uncompressed form (and private key, if
+ * given).
+ */
+static EVP_PKEY *build_pkey(const u8 *pub, size_t publen, const BIGNUM *priv)
+{
+	OSSL_PARAM_BLD *bld;
+	OSSL_PARAM *params;
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *pkey = NULL;
+
+	bld = OSSL_PARAM_BLD_new();
+	if (!bld ||
+	    !OSSL_PARAM_BLD_push_utf8_string(bld, OSSL_PKEY_PARAM_GROUP_NAME,
+					     SN_secp521r1, 0) ||
+	    !OSSL_PARAM_BLD_push_octet_string(bld, OSSL_PKEY_PARAM_PUB_KEY,
+					      pub, publen) ||
+	    (priv && !OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY,
+					     priv)))
+		die("Out of memory");
+
+	params = OSSL_PARAM_BLD_to_param(bld);
+	ctx = EVP_PKEY_CTX_new_from_name(NULL, "EC", NULL);
+	if (!params || !ctx)
+		die("Out of memory");
+
+	/* fails if the point is not on the curve */
+	if (EVP_PKEY_fromdata_init(ctx) <= 0 ||
+	    EVP_PKEY_fromdata(ctx, &pkey, priv ? EVP_PKEY_KEYPAIR :
+						 EVP_PKEY_PUBLIC_KEY,
+			      params) <= 0)
+		pkey = NULL;
+
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_free(params);
+	OSSL_PARAM_BLD_free(bld);
+
+	return pkey;
 }
 
-static void compute_public_key(EC_KEY *key, const BIGNUM *priv, BN_CTX *ctx)
+/*
+ * Compute the public key from the private one (only once per loaded key) and
+ * remember its coordinates in TIM format.
+ */
+static signkey_t *priv2signkey(const BIGNUM *priv)
 {
-	EC_POINT *pub;
-	const EC_GROUP *group;
+	const EC_GROUP *group = get_p521();
+	u8 pub[1 + 2 * 66];
+	BIGNUM *x, *y;
+	signkey_t *sk;
+	EC_POINT *pt;
+	BN_CTX *ctx;
+
+	ctx = BN_CTX_new();
+	pt = EC_POINT_new(group);
+	x = BN_new();
+	y = BN_new();
+	if (!ctx || !pt || !x || !y)
+		goto err;
 
-	group = EC_KEY_get0_group(key);
-	pub = EC_POINT_new(group);
-	if (!pub)
+	if (!EC_POINT_mul(group, pt, priv, NULL, NULL, ctx))
 		goto err;
 
-	if (!EC_KEY_set_private_key(key, priv))
+	if (!EC_POINT_get_affine_coordinates(group, pt, x, y, ctx))
 		goto err;
 
-	if (!EC_POINT_mul(group, pub, priv, NULL, NULL, ctx))	
+	if (EC_POINT_point2oct(group, pt, POINT_CONVERSION_UNCOMPRESSED, pub,
+			       sizeof(pub), ctx) != sizeof(pub))
 		goto err;
 
-	if (!EC_KEY_set_public_key(key, pub))
+	sk = xmalloc(sizeof(*sk));
+	bn2tim(x, sk->x, 17);
+	bn2tim(y, sk->y, 17);
+
+	sk->pkey = build_pkey(pub, sizeof(pub), priv);
+	if (!sk->pkey)
 		goto err;
 
-	EC_POINT_free(pub);
-	return;
+	BN_free(x);
+	BN_free(y);
+	EC_POINT_free(pt);
+	BN_CTX_free(ctx);
+
+	return sk;
 
 err:
 	die("Error computing public key");
 }
 
-EC_KEY *sharand_generate_key(void)
+signkey_t *sharand_generate_key(void)
 {
-	EC_KEY *key;
-	BN_CTX *ctx;
 	BIGNUM *priv, *order;
-	const EC_GROUP *group;
+	signkey_t *sk;
 
-	key = EC_KEY_new_by_curve_name(NID_secp521r1);
-	if (!key)
+	priv = BN_new();
+	order = BN_new();
+	if (!priv || !order)
 		goto err;
 
-	group = EC_KEY_get0_group(key);
-
-	ctx = BN_CTX_new();
-	if (!ctx)
-		goto err;
-
-	BN_CTX_start(ctx);
-
-	order = BN_CTX_get(ctx);
-	priv = BN_CTX_get(ctx);
-	if (!order || !priv)
-		goto err;
-
-	if (!EC_GROUP_get_order(group, order, ctx))
+	if (!EC_GROUP_get_order(get_p521(), order, NULL))
 		goto err;
 
 	do
 		randrange(priv, order);
 	while (BN_is_zero(priv));
 
-	compute_public_key(key, priv, ctx);
+	sk = priv2signkey(priv);
 
-	BN_CTX_end(ctx);
-	BN_CTX_free(ctx);
+	BN_clear_free(priv);
+	BN_free(order);
 
-	return key;
+	return sk;
 
 err:
 	die("Error generating EC key");
 }
 
-static EC_KEY *dec2key(const char *privstr)
+static signkey_t *dec2signkey(const char *privstr)
 {
-	EC_KEY *key;
-	BN_CTX *ctx;
-	BIGNUM *priv;
-
-	key = EC_KEY_new_by_curve_name(NID_secp521r1);
-	if (!key)
-		goto err;
-
-	ctx = BN_CTX_new();
-	if (!ctx)
-		goto err;
-
-	BN_CTX_start(ctx);
-
-	priv = BN_CTX_get(ctx);
-	if (!priv)
-		goto err;
+	BIGNUM *priv = NULL;
+	signkey_t *sk;
 
 	if (!BN_dec2bn(&priv, privstr))
-		goto err;
-
-	compute_public_key(key, priv, ctx);
-
-	BN_CTX_end(ctx);
-	BN_CTX_free(ctx);
+		die("Cannot create key from decimal string");
 
-	return key;
+	sk = priv2signkey(priv);
+	BN_clear_free(priv);
 
-err:
-	die("Cannot create key from decimal string");
+	return sk;
 }
 
-EC_KEY *load_key(const char *path)
+signkey_t *load_signkey(const char *path)
 {
 	int fd;
 	char buf[166];
@@ -166,11 +220,12 @@ EC_KEY *load_key(const char *path)
 
 	buf[i] = '\0';
 
-	return dec2key(buf);
+	return dec2signkey(buf);
 }
 
-void save_key(const char *path, const EC_KEY *key)
+void save_key(const char *path, const signkey_t *key)
 {
+	BIGNUM *bn = NULL;
 	int fd;
 	char *priv;
 	ssize_t wr;
@@ -179,7 +234,10 @@ void save_key(const char *path, const EC_KEY *key)
 	if (fd < 0)
 		die("Cannot open key file %s: %m", path);
 
-	priv = BN_bn2dec(EC_KEY_get0_private_key(key));
+	if (!EVP_PKEY_get_bn_param(key->pkey, OSSL_PKEY_PARAM_PRIV_KEY, &bn))
+		die("Cannot get private key");
+
+	priv = BN_bn2dec(bn);
 	if (!priv)
 		die("Cannot convert private key");
 
@@ -190,29 +248,179 @@ void save_key(const char *path, const EC_KEY *key)
 		die("Cannot write whole key file %s", path);
 
 	close(fd);
+	OPENSSL_clear_free(priv, strlen(priv));
+	BN_clear_free(bn);
 }
 
-void key_get_tim_coords(const EC_KEY *key, u32 *x, u32 *y)
+void free_signkey(signkey_t *key)
 {
-	const EC_POINT *pub;
-	const EC_GROUP *group;
-	BIGNUM *_x, *_y;
+	EVP_PKEY_free(key->pkey);
+	free(key);
+}
 
-	pub = EC_KEY_get0_public_key(key);
-	group = EC_KEY_get0_group(key);
+static void sig2tim(const u8 *der, size_t len, u32 *r, u32 *s)
+{
+	const BIGNUM *_r, *_s;
+	ECDSA_SIG *sig;
 
-	_x = BN_new();
-	_y = BN_new();
-	if (!_x || !_y)
-		goto err;
+	sig = d2i_ECDSA_SIG(NULL, &der, len);
+	if (!sig)
+		die("Cannot decode signature");
 
-	if (!EC_POINT_get_affine_coordinates_GFp(group, pub, _x, _y, NULL))
-		goto err;
+	ECDSA_SIG_get0(sig, &_r, &_s);
+	bn2tim(_r, r, 17);
+	bn2tim(_s, s, 17);
 
-	bn2tim(_x, x, 17);
-	bn2tim(_y, y, 17);
+	ECDSA_SIG_free(sig);
+}
 
-	return;
-err:
-	die("Cannot get key coordinates");
+/* each call uses its own context, so that more threads can sign at once */
+void key_sign(const signkey_t *key, const void *digest, int len, u32 *r,
+	      u32 *s)
+{
+	EVP_PKEY_CTX *ctx;
+	u8 der[160];
+	size_t derlen = sizeof(der);
+
+	ctx = EVP_PKEY_CTX_new_from_pkey(NULL, key->pkey, NULL);
+	if (!ctx)
+		die("Out of memory");
+
+	if (EVP_PKEY_sign_init(ctx) <= 0 ||
+	    EVP_PKEY_sign(ctx, der, &derlen, digest, len) <= 0)
+		die("Could not sign");
+
+	EVP_PKEY_CTX_free(ctx);
+
+	sig2tim(der, derlen, r, s);
+}
+
+/*
+ * Public keys found in TIMs, decoded and checked to lie on the curve only once
+ * and then shared by all threads verifying signatures.
+ */
+struct pubkey {
+	u32 x[17];
+	u32 y[17];
+	EVP_PKEY *pkey;
+	struct pubkey *next;
+};
+
+static struct pubkey *pubkeys;
+static pthread_mutex_t pubkeys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static EVP_PKEY *coords2pkey(const u32 *x, const u32 *y)
+{
+	u8 pub[1 + 2 * 66];
+	BIGNUM *bn;
+
+	bn = BN_new();
+	if (!bn)
+		die("Out of memory");
+
+	pub[0] = POINT_CONVERSION_UNCOMPRESSED;
+	tim2bn(x, 17, bn);
+	if (BN_bn2binpad(bn, pub + 1, 66) < 0)
+		goto invalid;
+	tim2bn(y, 17, bn);
+	if (BN_bn2binpad(bn, pub + 1 + 66, 66) < 0)
+		goto invalid;
+
+	BN_free(bn);
+
+	return build_pkey(pub, sizeof(pub), NULL);
+
+invalid:
+	BN_free(bn);
+	return NULL;
+}
+
+static struct pubkey *find_pubkey(const u32 *x, const u32 *y)
+{
+	struct pubkey *pk;
+
+	for (pk = pubkeys; pk; pk = pk->next)
+		if (!memcmp(pk->x, x, sizeof(pk->x)) &&
+		    !memcmp(pk->y, y, sizeof(pk->y)))
+			break;
+
+	return pk;
+}
+
+/*
+ * The key is built without holding the lock, since building it may die(),
+ * which under --verify longjmps out of the thread's current job.
+ */
+static EVP_PKEY *get_pubkey(const u32 *x, const u32 *y)
+{
+	struct pubkey *pk, *new;
+
+	pthread_mutex_lock(&pubkeys_lock);
+	pk = find_pubkey(x, y);
+	pthread_mutex_unlock(&pubkeys_lock);
+
+	if (pk)
+		return pk->pkey;
+
+	new = xmalloc(sizeof(*new));
+	memcpy(new->x, x, sizeof(new->x));
+	memcpy(new->y, y, sizeof(new->y));
+	new->pkey = coords2pkey(x, y);
+
+	pthread_mutex_lock(&pubkeys_lock);
+	pk = find_pubkey(x, y);
+	if (!pk) {
+		new->next = pubkeys;
+		pubkeys = pk = new;
+	}
+	pthread_mutex_unlock(&pubkeys_lock);
+
+	/* another thread was faster */
+	if (pk != new) {
+		EVP_PKEY_free(new->pkey);
+		free(new);
+	}
+
+	return pk->pkey;
+}
+
+int key_verify(const u32 *x, const u32 *y, const void *digest, int len,
+	       const u32 *r, const u32 *s)
+{
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *pkey;
+	BIGNUM *_r, *_s;
+	ECDSA_SIG *sig;
+	u8 *der = NULL;
+	int derlen, ret;
+
+	pkey = get_pubkey(x, y);
+	if (!pkey)
+		return -1;
+
+	sig = ECDSA_SIG_new();
+	_r = BN_new();
+	_s = BN_new();
+	if (!sig || !_r || !_s)
+		die("Out of memory");
+
+	tim2bn(r, 17, _r);
+	tim2bn(s, 17, _s);
+	ECDSA_SIG_set0(sig, _r, _s);
+
+	derlen = i2d_ECDSA_SIG(sig, &der);
+	ECDSA_SIG_free(sig);
+	if (derlen <= 0)
+		die("Cannot encode signature");
+
+	ctx = EVP_PKEY_CTX_new_from_pkey(NULL, pkey, NULL);
+	if (!ctx || EVP_PKEY_verify_init(ctx) <= 0)
+		die("Cannot initialize signature verification");
+
+	ret = EVP_PKEY_verify(ctx, der, derlen, digest, len) == 1;
+
+	EVP_PKEY_CTX_free(ctx);
+	OPENSSL_free(der);
+
+	return ret;
 }
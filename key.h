@@ -6,12 +6,29 @@
 #ifndef _KEY_H_
 #define _KEY_H_
 
-#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include "utils.h"
 
-extern EC_KEY *sharand_generate_key(void);
-extern EC_KEY *load_key(const char *path);
-extern void save_key(const char *path, const EC_KEY *key);
-extern void key_get_tim_coords(const EC_KEY *key, u32 *x, u32 *y);
+/* private key together with its public coordinates in TIM format */
+typedef struct {
+	EVP_PKEY *pkey;
+	u32 x[17];
+	u32 y[17];
+} signkey_t;
+
+extern signkey_t *sharand_generate_key(void);
+extern signkey_t *load_signkey(const char *path);
+extern void save_key(const char *path, const signkey_t *key);
+extern void free_signkey(signkey_t *key);
+extern void key_sign(const signkey_t *key, const void *digest, int len,
+		     u32 *r, u32 *s);
+
+/*
+ * Verify ECDSA-521 signature (r, s) of digest by public key (x, y), all in TIM
+ * format. Returns 1 if valid, 0 if not and -1 if the public key is invalid.
+ */
+extern int key_verify(const u32 *x, const u32 *y, const void *digest, int len,
+		      const u32 *r, const u32 *s);
 
 #endif /* _KEY_H_ */
 
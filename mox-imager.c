@@ -16,6 +16,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <openssl/ec.h>
 #include <term.h>
 #include "tim.h"
@@ -24,6 +25,10 @@
 #include "sharand.h"
 #include "key.h"
 #include "images.h"
+#include "cache.h"
+#include "delta.h"
+#include "verify.h"
+#include "realtime.h"
 
 #include "wtmi.c"
 
@@ -32,6 +37,14 @@
 #define MOX_U_BOOT_OFFSET	0x20000
 #define MOX_ENV_OFFSET		0x180000
 
+static const struct flash_region mox_flash_layout[] = {
+	{ "TIMH", 0,			MOX_TIMN_OFFSET },
+	{ "TIMN", MOX_TIMN_OFFSET,	MOX_WTMI_OFFSET },
+	{ "WTMI", MOX_WTMI_OFFSET,	MOX_U_BOOT_OFFSET },
+	{ "OBMI", MOX_U_BOOT_OFFSET,	MOX_ENV_OFFSET },
+	{ "ENV",  MOX_ENV_OFFSET,	0xffffffff },
+};
+
 static int gpp_disassemble;
 int terminal_on_exit = 0;
 
@@ -47,7 +60,7 @@ struct mox_builder_data {
 
 static void generate_key(const char *keypath, const char *seedpath)
 {
-	EC_KEY *key;
+	signkey_t *key;
 	int fd;
 	struct stat st;
 	void *seed;
@@ -74,7 +87,7 @@ static void generate_key(const char *keypath, const char *seedpath)
 
 	key = sharand_generate_key();
 	save_key(keypath, key);
-	EC_KEY_free(key);
+	free_signkey(key);
 }
 
 static void save_flash_image(image_t *tim, const char *path)
@@ -124,58 +137,106 @@ static void save_flash_image(image_t *tim, const char *path)
 		die("Cannot unmap %s: %m", path);
 }
 
-static void do_create_trusted_image(const char *keyfile, const char *output,
-				    u32 bootfs, u32 partition)
+struct image_variant {
+	u32 bootfs;
+	u32 partition;
+	char *output;
+	int trusted;
+	const signkey_t *key;
+	image_t timh, timn;
+	u8 *buf;
+	int cached;
+	cache_key_t cache_key;
+	pthread_t thread;
+};
+
+static void build_trusted_image(struct image_variant *v)
 {
-	EC_KEY *key;
 	image_t *timh, *timn, *wtmi, *obmi;
-	void *buf;
-	ssize_t wr;
-	int fd;
+	struct tim_builder b;
 	u32 timh_loadaddr, timn_loadaddr;
 
-	if (bootfs == BOOTFS_SPINOR || bootfs == BOOTFS_EMMC) {
+	if (v->bootfs == BOOTFS_SPINOR || v->bootfs == BOOTFS_EMMC) {
 		timh_loadaddr = 0x20006000;
 		timn_loadaddr = 0x20003000;
-	} else if (bootfs == BOOTFS_UART) {
+	} else if (v->bootfs == BOOTFS_UART) {
 		timh_loadaddr = 0x20002000;
 		timn_loadaddr = 0x20006000;
 	} else {
 		die("Only UART/SPI/EMMC modes are supported");
 	}
 
-	wtmi = image_find(name2id("WTMI"));
-	obmi = image_new(NULL, 0, name2id("OBMI"));
-	obmi->size = MOX_ENV_OFFSET - MOX_U_BOOT_OFFSET;
+	wtmi = image_find(WTMI_ID);
+	obmi = image_find(OBMI_ID);
+
+	timh = &v->timh;
+	tim_builder_minimal(&b, 1, TIMH_ID, 0);
+	tim_builder_set_boot(&b, v->bootfs);
+	tim_builder_imap_set(&b, name2id("CSKT"), MOX_TIMN_OFFSET,
+			     v->partition);
+	tim_builder_set_loadaddr(&b, TIMH_ID, timh_loadaddr);
+	tim_builder_add_key(&b, name2id("CSK0"), v->key);
+	tim_builder_finish(&b, timh);
+	tim_sign(timh, v->key);
+
+	memcpy(v->buf, timh->data, timh->size);
+
+	timn = &v->timn;
+	tim_builder_minimal(&b, 1, TIMN_ID, v->bootfs == BOOTFS_UART);
+	tim_builder_set_boot(&b, v->bootfs);
+	tim_image_set_loadaddr(timh, TIMN_ID, timn_loadaddr);
+	tim_builder_add_image(&b, wtmi, TIMN_ID, 0x1fff0000, MOX_WTMI_OFFSET,
+			      v->partition, 1);
+	tim_builder_add_image(&b, obmi, WTMI_ID, 0x64100000, MOX_U_BOOT_OFFSET,
+			      v->partition, 0);
+	tim_builder_finish(&b, timn);
+	tim_sign(timn, v->key);
+
+	memcpy(v->buf + MOX_TIMN_OFFSET, timn->data, timn->size);
+	memcpy(v->buf + MOX_WTMI_OFFSET, wtmi->data, wtmi->size);
+}
 
-	buf = xmalloc(MOX_U_BOOT_OFFSET);
-	memset(buf, 0, MOX_U_BOOT_OFFSET);
+static void build_untrusted_image(struct image_variant *v)
+{
+	image_t *timh, *wtmi, *obmi;
+	struct tim_builder b;
+
+	wtmi = image_find(WTMI_ID);
+	obmi = image_find(OBMI_ID);
+
+	timh = &v->timh;
+	tim_builder_minimal(&b, 0, TIMH_ID, 0);
+	tim_builder_add_image(&b, wtmi, TIMH_ID, 0x1fff0000, MOX_WTMI_OFFSET,
+			      v->partition, 1);
+	tim_builder_add_image(&b, obmi, WTMI_ID, 0x64100000, MOX_U_BOOT_OFFSET,
+			      v->partition, 0);
+	tim_builder_set_boot(&b, v->bootfs);
+	tim_builder_finish(&b, timh);
+	tim_rehash(timh);
 
-	key = load_key(keyfile);
+	memcpy(v->buf, timh->data, timh->size);
+	memcpy(v->buf + MOX_WTMI_OFFSET, wtmi->data, wtmi->size);
+}
 
-	timh = image_new(NULL, 0, TIMH_ID);
-	tim_minimal_image(timh, 1, TIMH_ID, 0);
-	tim_set_boot(timh, bootfs);
-	tim_imap_pkg_addr_set(timh, name2id("CSKT"), MOX_TIMN_OFFSET, partition);
-	tim_image_set_loadaddr(timh, TIMH_ID, timh_loadaddr);
-	tim_add_key(timh, name2id("CSK0"), key);
-	tim_sign(timh, key);
-	tim_parse(timh, NULL, gpp_disassemble, NULL);
+static void *build_image_handler(void *ptr)
+{
+	struct image_variant *v = ptr;
 
-	memcpy(buf, timh->data, timh->size);
+	v->buf = xmalloc(MOX_U_BOOT_OFFSET);
+	memset(v->buf, 0, MOX_U_BOOT_OFFSET);
 
-	timn = image_new(NULL, 0, TIMN_ID);
-	tim_minimal_image(timn, 1, TIMN_ID, bootfs == BOOTFS_UART);
-	tim_set_boot(timn, bootfs);
-	tim_image_set_loadaddr(timh, TIMN_ID, timn_loadaddr);
-	tim_add_image(timn, wtmi, TIMN_ID, 0x1fff0000, MOX_WTMI_OFFSET, partition, 1);
-	tim_add_image(timn, obmi, name2id("WTMI"), 0x64100000, MOX_U_BOOT_OFFSET,
-		      partition, 0);
-	tim_sign(timn, key);
-	tim_parse(timn, NULL, gpp_disassemble, NULL);
+	if (v->trusted)
+		build_trusted_image(v);
+	else
+		build_untrusted_image(v);
 
-	memcpy(buf + MOX_TIMN_OFFSET, timn->data, timn->size);
-	memcpy(buf + MOX_WTMI_OFFSET, wtmi->data, wtmi->size);
+	return NULL;
+}
+
+static void write_image(const char *output, const void *buf, size_t size)
+{
+	ssize_t wr;
+	int fd;
 
 	fd = open(output, O_RDWR | O_CREAT, 0644);
 	if (fd < 0)
@@ -184,56 +245,283 @@ static void do_create_trusted_image(const char *keyfile, const char *output,
 	if (ftruncate(fd, 0) < 0)
 		die("Cannot truncate %s to size 0: %m", output);
 
-	wr = write(fd, buf, MOX_U_BOOT_OFFSET);
+	wr = write(fd, buf, size);
 	if (wr < 0)
 		die("Cannot write to %s: %m", output);
-	else if (wr < MOX_U_BOOT_OFFSET)
+	else if ((size_t)wr < size)
 		die("Cannot write whole output %s", output);
 
 	close(fd);
 }
 
-static void do_create_untrusted_image(const char *output, u32 bootfs,
-				      u32 partition)
+/*
+ * Look the variant up in the cache. Entries which do not pass the checks done
+ * on freshly built images are ignored.
+ */
+static int variant_from_cache(struct image_variant *v)
 {
-	image_t *timh, *wtmi, *obmi;
-	void *buf;
-	ssize_t wr;
-	int fd;
+	volatile int ok = 0;
+	u32 wtmi_hash[16];
+	image_t *wtmi;
+	jmp_buf jmp;
+	size_t size;
+	u8 *buf;
+
+	wtmi = image_find(WTMI_ID);
+	image_digest(wtmi, HASH_SHA512, wtmi_hash);
+
+	cache_key_init(&v->cache_key, v->trusted ? "trusted-image" :
+						   "untrusted-image");
+	cache_key_add_u32(&v->cache_key, v->bootfs);
+	cache_key_add_u32(&v->cache_key, v->partition);
+	cache_key_add_u32(&v->cache_key, wtmi->size);
+	cache_key_add(&v->cache_key, wtmi_hash, sizeof(wtmi_hash));
+	cache_key_add_u32(&v->cache_key, image_find(OBMI_ID)->size);
+	cache_key_add_signkey(&v->cache_key, v->trusted ? v->key : NULL);
+
+	buf = cache_get(&v->cache_key, &size);
+	if (!buf)
+		return 0;
+
+	if (size != MOX_U_BOOT_OFFSET ||
+	    tim_size((timhdr_t *) buf) > (v->trusted ? MOX_TIMN_OFFSET :
+						       MOX_WTMI_OFFSET) ||
+	    (v->trusted && tim_size((timhdr_t *) (buf + MOX_TIMN_OFFSET)) >
+			   MOX_WTMI_OFFSET - MOX_TIMN_OFFSET)) {
+		munmap(buf, size);
+		return 0;
+	}
+
+	v->buf = buf;
+	v->timh.id = TIMH_ID;
+	v->timh.data = buf;
+	v->timh.size = tim_size((timhdr_t *) buf);
+	if (v->trusted) {
+		v->timn.id = TIMN_ID;
+		v->timn.data = buf + MOX_TIMN_OFFSET;
+		v->timn.size = tim_size((timhdr_t *) v->timn.data);
+	}
+
+	tim_set_quiet(1);
+	die_jmp = &jmp;
+	if (!setjmp(jmp)) {
+		tim_parse(&v->timh, NULL, 0, NULL);
+		if (v->trusted) {
+			tim_parse(&v->timn, NULL, 0, NULL);
+			tim_check_key_chain(&v->timh, &v->timn);
+		}
+		ok = 1;
+	}
+	die_jmp = NULL;
+	tim_set_quiet(0);
+
+	if (!ok) {
+		fprintf(stderr, "Ignoring invalid cache entry: %s\n", die_msg);
+		memset(&v->timh, 0, sizeof(v->timh));
+		memset(&v->timn, 0, sizeof(v->timn));
+		munmap(buf, size);
+		return 0;
+	}
+
+	v->cached = 1;
+
+	return 1;
+}
 
-	wtmi = image_find(name2id("WTMI"));
-	obmi = image_new(NULL, 0, name2id("OBMI"));
+static int regular_files(char **paths, int n)
+{
+	struct stat st;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		if (!strcmp(paths[i], "-") || stat(paths[i], &st) < 0 ||
+		    !S_ISREG(st.st_mode))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Check and print info of flash image cache entry before it is written to the
+ * output, using own image table so that nothing remains loaded.
+ */
+static int check_cached_output(const char *path)
+{
+	struct image_table *table;
+	volatile int ok = 0;
+	jmp_buf jmp;
+
+	table = image_table_new();
+	image_table_use(table);
+
+	tim_set_quiet(1);
+	die_jmp = &jmp;
+	if (!setjmp(jmp)) {
+		image_load(path);
+		tim_parse(image_find(TIMH_ID), NULL, 0, NULL);
+		ok = 1;
+	}
+	die_jmp = NULL;
+	tim_set_quiet(0);
+
+	if (ok)
+		tim_parse(image_find(TIMH_ID), NULL, gpp_disassemble, NULL);
+	else
+		fprintf(stderr, "Ignoring invalid cache entry: %s\n", die_msg);
+
+	image_table_use(NULL);
+	image_table_free(table);
+
+	return ok;
+}
+
+/*
+ * Create images for all requested boot media. Everything the variants have in
+ * common (the WTMI hash and the signing key with its public coordinates) is
+ * prepared only once, then the TIMs for the variants are built and signed in
+ * parallel. Parsing the results (which prints image info) and writing them is
+ * done afterwards in the main thread, in the order the variants were given.
+ */
+static void do_create_images(struct image_variant *variants, int nvariants,
+			     const signkey_t *key)
+{
+	image_t *wtmi, *obmi;
+	int i, ret;
+
+	wtmi = image_find(WTMI_ID);
+	image_precompute_hash(wtmi, HASH_SHA512);
+
+	obmi = image_new(NULL, 0, OBMI_ID);
 	obmi->size = MOX_ENV_OFFSET - MOX_U_BOOT_OFFSET;
 
-	buf = xmalloc(MOX_U_BOOT_OFFSET);
-	memset(buf, 0, MOX_U_BOOT_OFFSET);
+	for (i = 0; i < nvariants; ++i) {
+		struct image_variant *v = &variants[i];
 
-	timh = image_new(NULL, 0, TIMH_ID);
-	tim_minimal_image(timh, 0, TIMH_ID, 0);
-	tim_add_image(timh, wtmi, TIMH_ID, 0x1fff0000, MOX_WTMI_OFFSET, partition, 1);
-	tim_add_image(timh, obmi, name2id("WTMI"), 0x64100000, MOX_U_BOOT_OFFSET,
-		      partition, 0);
-	tim_set_boot(timh, bootfs);
-	tim_rehash(timh);
-	tim_parse(timh, NULL, gpp_disassemble, NULL);
+		v->key = key;
+		if (cache_enabled() && variant_from_cache(v))
+			continue;
 
-	memcpy(buf, timh->data, timh->size);
-	memcpy(buf + MOX_WTMI_OFFSET, wtmi->data, wtmi->size);
+		ret = pthread_create(&v->thread, NULL, build_image_handler, v);
+		if (ret) {
+			errno = ret;
+			die("pthread_create failed: %m");
+		}
+	}
 
-	fd = open(output, O_RDWR | O_CREAT, 0644);
-	if (fd < 0)
-		die("Cannot open %s for writing: %m", output);
+	for (i = 0; i < nvariants; ++i) {
+		struct image_variant *v = &variants[i];
 
-	if (ftruncate(fd, 0) < 0)
-		die("Cannot truncate %s to size 0: %m", output);
+		if (!v->cached) {
+			ret = pthread_join(v->thread, NULL);
+			if (ret) {
+				errno = ret;
+				die("pthread_join failed: %m");
+			}
+		}
 
-	wr = write(fd, buf, MOX_U_BOOT_OFFSET);
-	if (wr < 0)
-		die("Cannot write to %s: %m", output);
-	else if (wr < MOX_U_BOOT_OFFSET)
-		die("Cannot write whole output %s", output);
+		tim_parse(&v->timh, NULL, gpp_disassemble, NULL);
+		if (v->trusted) {
+			tim_parse(&v->timn, NULL, gpp_disassemble, NULL);
+			tim_check_key_chain(&v->timh, &v->timn);
+		}
 
-	close(fd);
+		write_image(v->output, v->buf, MOX_U_BOOT_OFFSET);
+		printf("Saved %s image to %s%s\n\n", bootfs2name(v->bootfs),
+		       v->output, v->cached ? " (from cache)" : "");
+
+		if (cache_enabled() && !v->cached)
+			cache_put(&v->cache_key, v->buf, MOX_U_BOOT_OFFSET);
+	}
+}
+
+static int parse_bootfs_list(const char *arg, struct image_variant *variants)
+{
+	char *list, *name, *saveptr;
+	int i, n = 0;
+
+	list = xstrdup(arg);
+
+	for (name = strtok_r(list, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		u32 bootfs;
+
+		if (!strcmp(name, "UART"))
+			bootfs = BOOTFS_UART;
+		else if (!strcmp(name, "SPI"))
+			bootfs = BOOTFS_SPINOR;
+		else if (!strcmp(name, "EMMC"))
+			bootfs = BOOTFS_EMMC;
+		else
+			die("Invalid argument for parameter --create-[un]trusted-image");
+
+		for (i = 0; i < n; ++i)
+			if (variants[i].bootfs == bootfs)
+				die("Boot medium %s given more than once", name);
+
+		variants[n].bootfs = bootfs;
+		/* Boot partition on eMMC is partition 2 */
+		variants[n].partition = bootfs == BOOTFS_EMMC ? 2 : 0;
+		++n;
+	}
+
+	free(list);
+
+	if (!n)
+		die("Invalid argument for parameter --create-[un]trusted-image");
+
+	return n;
+}
+
+/*
+ * Assign output paths to image variants. Either one path per variant is given
+ * in a comma separated list, or a single template, in which "%s" is replaced by
+ * the lowercase name of the boot medium (uart, spi or emmc).
+ */
+static void assign_outputs(const char *arg, struct image_variant *variants,
+			   int nvariants)
+{
+	static const char *const names[] = { "uart", "spi", "emmc" };
+	char *list, *path, *saveptr, *tmpl;
+	int i, n = 0;
+
+	list = xstrdup(arg);
+
+	for (path = strtok_r(list, ",", &saveptr); path;
+	     path = strtok_r(NULL, ",", &saveptr)) {
+		if (n == nvariants)
+			die("More output files than boot media given");
+		variants[n++].output = xstrdup(path);
+	}
+
+	free(list);
+
+	if (n == nvariants)
+		return;
+	else if (n != 1)
+		die("Number of output files does not match number of boot media");
+
+	tmpl = variants[0].output;
+	path = strstr(tmpl, "%s");
+	if (!path)
+		die("Output must contain %%s when creating images for more than one boot medium");
+
+	for (i = 0; i < nvariants; ++i) {
+		const char *name;
+		char *out;
+
+		if (variants[i].bootfs == BOOTFS_UART)
+			name = names[0];
+		else if (variants[i].bootfs == BOOTFS_SPINOR)
+			name = names[1];
+		else
+			name = names[2];
+
+		out = xmalloc(strlen(tmpl) + strlen(name) - 1);
+		sprintf(out, "%.*s%s%s", (int)(path - tmpl), tmpl, name, path + 2);
+		variants[i].output = out;
+	}
+
+	free(tmpl);
 }
 
 static int xdigit2i(char c)
@@ -286,7 +574,28 @@ struct mox_builder_data *find_mbd(void)
 	return r;
 }
 
-static void do_get_otp_hash(u32 *hash)
+/* check TIMN of secure firmware, if its images are given */
+static void check_timn(image_t *timh)
+{
+	image_t *timn;
+
+	if (tim_imap_pkg_addr(timh, name2id("CSKT")) == -1U)
+		return;
+
+	/* secure firmware images do not contain the a53 firmware */
+	if (image_waiting()) {
+		fprintf(stderr, "Warning: image %s not given, TIMN not checked\n",
+			id2name(image_waiting()));
+		return;
+	}
+
+	timn = image_find(TIMN_ID);
+	tim_parse(timn, NULL, 0, NULL);
+	tim_check_key_chain(timh, timn);
+}
+
+/* the hash only depends on the TIMH */
+static image_t *do_get_otp_hash(u32 *hash)
 {
 	image_t *tim;
 
@@ -294,6 +603,8 @@ static void do_get_otp_hash(u32 *hash)
 	/* check if the TIM is correct by parsing it */
 	tim_parse(tim, NULL, 0, NULL);
 	tim_get_otp_hash(tim, hash);
+
+	return tim;
 }
 
 static void do_deploy(struct mox_builder_data *mbd, const char *serial_number,
@@ -349,7 +660,7 @@ static void do_deploy(struct mox_builder_data *mbd, const char *serial_number,
 		}
 	} else {
 		/* else generate from given secure firmware */
-		do_get_otp_hash(mbd->otp_hash);
+		check_timn(do_get_otp_hash(mbd->otp_hash));
 	}
 }
 
@@ -357,11 +668,26 @@ static void help(void)
 {
 	fprintf(stdout,
 		"Usage: mox-imager [OPTION]... [IMAGE]...\n\n"
-		"  -D, --device=TTY                            upload images via UART to TTY\n"
+		"  -D, --device=TTY                            upload images via UART to TTY, or to a serial server given as\n"
+		"                                              tcp:HOST:PORT, unix:PATH (raw) or rfc2217:HOST:PORT,\n"
+		"                                              or replay board side of a trace: replay:FILE, replay-fast:FILE\n"
 		"  -b, --baudrate=BAUD                         fast upload mode by switching to baudrate BAUD, if supported by image\n"
 		"  -F, --fd=FD                                 TTY file descriptor\n"
 		"  -E, --send-escape-sequence                  send escape sequence to force boot from UART\n"
 		"  -t, --terminal                              run mini terminal after images are sent\n"
+		"      --expect=SCRIPT                         run expect script on UART after images are sent\n"
+		"      --log=FILE                              append timestamped board output from terminal / expect script\n"
+		"                                              to FILE (use /dev/fd/N for file descriptor N)\n"
+		"      --record=FILE                           record session trace (all UART traffic with timestamps) to FILE\n"
+		"      --probe-latency[=N]                     measure round trip latency of the UART adapter with N commands\n"
+		"                                              (default 100) before uploading\n"
+		"      --realtime[=OPTS]                       upload with real-time scheduling and locked memory, report\n"
+		"                                              missed deadlines in fast mode; OPTS is a comma separated list\n"
+		"                                              of fifo (default), rr, prio=N (default 40) and cpu=N\n"
+		"      --timeouts=PHASE=MS,...                 time the board may take to process a command before replying,\n"
+		"                                              in addition to the time replies take on the line; phases\n"
+		"                                              are wtp (200), probe (100), select (5000), image (1000),\n"
+		"                                              baudrate (5000), otp-read (10000) and deploy (10000)\n"
 		"  -o, --output=IMAGE                          output SPI NOR flash image to IMAGE\n"
 		"  -k, --key=KEY                               read ECDSA-521 private key from file KEY\n"
 		"  -r, --random-seed=FILE                      read random seed from file\n"
@@ -376,15 +702,45 @@ static void help(void)
 		"  -s, --sign                                  sign TIM image with ECDSA-521 private key\n"
 		"      --create-trusted-image=SPI/UART/EMMC    create secure image for SPI / UART (private key required)\n"
 		"      --create-untrusted-image=SPI/UART/EMMC  create untrusted secure image (no private key required)\n"
+		"                                              more boot media can be given as a comma separated list, in that\n"
+		"                                              case --output is a list of files or a template with %%s\n"
 		"  -S  --disassemble                           disassemble GPP code when parsing TIM\n"
 		"      --get-otp-hash                          print OTP hash of given secure firmware image\n"
 		"  -u, --hash-a53-firmware                     save A53 firmware (TF-A + U-Boot) image hash to TIM\n"
 		"  -n, --no-a53-firmware                       remove A53 firmware (TF-A + U-Boot) image from TIM\n"
+		"      --strip-padding                         do not send trailing 0x00 / 0xff padding of images, if possible\n"
+		"                                              (not for trusted images, whose sizes are signed)\n"
+		"      --delta-from=OLD                        print which erase blocks of the given flash image differ from\n"
+		"                                              flash image OLD, and save them to --output as a delta patch\n"
+		"      --erase-block-size=SIZE                 erase block size for --delta-from (default 65536)\n"
+		"      --verify                                check image sets in given files and directories (as parsing\n"
+		"                                              and --get-otp-hash do) and print one JSON record per set\n"
+		"      --jobs=N                                number of parallel jobs for --verify (default number of CPUs)\n"
+		"      --cache-dir=DIR                         reuse images created / saved with --output by earlier runs with\n"
+		"                                              the same inputs, key and options, stored in DIR\n"
 		"  -h, --help                                  show this help and exit\n"
+		"\n"
+		"IMAGE can also be a pipe, character or block device (e.g. /dev/mtd0), or - for standard input.\n"
+		"Files compressed by xz, zstd, gzip or bzip2 and tar archives of images are unpacked in memory.\n"
 		"\n");
 	exit(EXIT_SUCCESS);
 }
 
+enum {
+	OPT_DELTA_FROM = 0x100,
+	OPT_ERASE_BLOCK_SIZE,
+	OPT_STRIP_PADDING,
+	OPT_EXPECT,
+	OPT_LOG,
+	OPT_RECORD,
+	OPT_VERIFY,
+	OPT_JOBS,
+	OPT_CACHE_DIR,
+	OPT_PROBE_LATENCY,
+	OPT_REALTIME,
+	OPT_TIMEOUTS,
+};
+
 static const struct option long_options[] = {
 	{ "device",			required_argument,	0,	'D' },
 	{ "baudrate",			required_argument,	0,	'b' },
@@ -409,6 +765,18 @@ static const struct option long_options[] = {
 	{ "get-otp-hash",		no_argument,		0,	'G' },
 	{ "hash-a53-firmware",		no_argument,		0,	'u' },
 	{ "no-a53-firmware",		no_argument,		0,	'n' },
+	{ "delta-from",			required_argument,	0,	OPT_DELTA_FROM },
+	{ "erase-block-size",		required_argument,	0,	OPT_ERASE_BLOCK_SIZE },
+	{ "strip-padding",		no_argument,		0,	OPT_STRIP_PADDING },
+	{ "expect",			required_argument,	0,	OPT_EXPECT },
+	{ "log",			required_argument,	0,	OPT_LOG },
+	{ "record",			required_argument,	0,	OPT_RECORD },
+	{ "verify",			no_argument,		0,	OPT_VERIFY },
+	{ "jobs",			required_argument,	0,	OPT_JOBS },
+	{ "cache-dir",			required_argument,	0,	OPT_CACHE_DIR },
+	{ "probe-latency",		optional_argument,	0,	OPT_PROBE_LATENCY },
+	{ "realtime",			optional_argument,	0,	OPT_REALTIME },
+	{ "timeouts",			required_argument,	0,	OPT_TIMEOUTS },
 	{ "help",			no_argument,		0,	'h' },
 	{ 0,				0,			0,	0 },
 };
@@ -417,21 +785,29 @@ int main(int argc, char **argv)
 {
 	const char *tty, *fdstr, *output, *keyfile, *seed, *genkey,
 		   *serial_number, *mac_address, *board, *board_version,
-		   *otp_hash;
+		   *otp_hash, *delta_from, *expect_script, *log_file,
+		   *record_file, *cache_dir;
+	u32 erase_block_size = 0x10000;
 	int sign, hash_a53_firmware, no_a53_firmware, otp_read, deploy,
 	    get_otp_hash, create_trusted_image, create_untrusted_image,
-	    send_escape, baudrate, dummy;
-	u32 image_bootfs = 0, partition;
+	    send_escape, baudrate, strip_padding, verify, jobs, cache_output,
+	    probe_latency, dummy;
+	struct image_variant variants[3] = {};
 	image_t *timh = NULL, *timn = NULL;
-	int nimages, nimages_timn, images_given, trusted;
+	signkey_t *key = NULL;
+	cache_key_t output_key;
+	int nimages, nimages_timn, images_given, trusted, nvariants = 0;
 
 	tty = fdstr = output = keyfile = seed = genkey = serial_number =
-              mac_address = board = board_version = otp_hash = NULL;
+              mac_address = board = board_version = otp_hash = delta_from =
+	      expect_script = log_file = record_file = cache_dir = NULL;
 	sign = hash_a53_firmware = no_a53_firmware = otp_read = deploy =
 	       get_otp_hash = create_trusted_image = create_untrusted_image =
-	       send_escape = baudrate = 0;
+	       send_escape = baudrate = strip_padding = verify = jobs =
+	       cache_output = probe_latency = 0;
 
 	while (1) {
+		char *end;
 		int c;
 
 		c = getopt_long(argc, argv, "D:b:F:Eo:k:r:Rdg:sStunh",
@@ -543,14 +919,7 @@ int main(int argc, char **argv)
 			break;
 		case 'c':
 		case 'C':
-			if (!strcmp(optarg, "UART"))
-				image_bootfs = BOOTFS_UART;
-			else if (!strcmp(optarg, "SPI"))
-				image_bootfs = BOOTFS_SPINOR;
-			else if (!strcmp(optarg, "EMMC"))
-				image_bootfs = BOOTFS_EMMC;
-			else
-				die("Invalid argument for parameter --create-[un]trusted-image");
+			nvariants = parse_bootfs_list(optarg, variants);
 			if (c == 'c')
 				create_trusted_image = 1;
 			else
@@ -568,6 +937,59 @@ int main(int argc, char **argv)
 		case 'n':
 			no_a53_firmware = 1;
 			break;
+		case OPT_DELTA_FROM:
+			if (delta_from)
+				die("Old flash image already given");
+			delta_from = optarg;
+			break;
+		case OPT_ERASE_BLOCK_SIZE:
+			erase_block_size = strtoul(optarg, &end, 0);
+			if (*end || !erase_block_size)
+				die("Invalid erase block size \"%s\"", optarg);
+			break;
+		case OPT_LOG:
+			if (log_file)
+				die("Log file already given");
+			log_file = optarg;
+			break;
+		case OPT_RECORD:
+			if (record_file)
+				die("Record file already given");
+			record_file = optarg;
+			break;
+		case OPT_EXPECT:
+			if (expect_script)
+				die("Expect script already given");
+			expect_script = optarg;
+			break;
+		case OPT_STRIP_PADDING:
+			strip_padding = 1;
+			break;
+		case OPT_VERIFY:
+			verify = 1;
+			break;
+		case OPT_CACHE_DIR:
+			if (cache_dir)
+				die("Cache directory already given");
+			cache_dir = optarg;
+			break;
+		case OPT_PROBE_LATENCY:
+			probe_latency = optarg ? strtol(optarg, &end, 0) : 100;
+			if ((optarg && *end) || probe_latency <= 0)
+				die("Invalid number of commands \"%s\"",
+				    optarg);
+			break;
+		case OPT_REALTIME:
+			realtime_parse(optarg);
+			break;
+		case OPT_TIMEOUTS:
+			wtp_set_timeouts(optarg);
+			break;
+		case OPT_JOBS:
+			jobs = strtol(optarg, &end, 0);
+			if (*end || jobs <= 0)
+				die("Invalid number of jobs \"%s\"", optarg);
+			break;
 		case 'h':
 			help();
 			break;
@@ -596,6 +1018,18 @@ int main(int argc, char **argv)
 	if (otp_read && deploy)
 		die("Options to read OTP and deploy cannot be used together");
 
+	if (expect_script && !tty && !fdstr)
+		die("Option --device must be specified when running expect script");
+
+	if (record_file && !tty && !fdstr)
+		die("Option --device must be specified when recording session");
+
+	if (probe_latency && !tty && !fdstr)
+		die("Option --device must be specified when probing latency");
+
+	if (realtime_enabled() && !tty && !fdstr)
+		die("Option --device must be specified for real-time mode");
+
 	if (deploy && (!serial_number || !mac_address || !board || !board_version))
 		die("Serial number, MAC address, board and board version must be given when deploying device");
 
@@ -609,30 +1043,111 @@ int main(int argc, char **argv)
 		exit(EXIT_SUCCESS);
 	}
 
+	if (delta_from) {
+		if (argc - optind != 1)
+			die("Exactly one new flash image must be given with --delta-from");
+
+		flash_delta(delta_from, argv[optind], output, erase_block_size,
+			    mox_flash_layout,
+			    sizeof(mox_flash_layout) / sizeof(*mox_flash_layout));
+		exit(EXIT_SUCCESS);
+	}
+
+	if (verify) {
+		if (tty || fdstr || output)
+			die("Option --verify cannot be used with --device or --output");
+		if (optind == argc)
+			die("No files or directories to verify given");
+
+		if (!jobs)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+
+		exit(verify_images(argv + optind, argc - optind, jobs) ?
+		     EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (cache_dir)
+		cache_open(cache_dir);
+
+	if (keyfile && (sign || create_trusted_image))
+		key = load_signkey(keyfile);
+
 	images_given = argc - optind;
 
+	/*
+	 * saved flash image only depends on the inputs, key, options and boot
+	 * medium (streams can be read only once, so they are not cached). The
+	 * shortcut is only taken when nothing is to be sent to the board.
+	 */
+	if (cache_dir && output && images_given && !tty && !fdstr &&
+	    !create_trusted_image && !create_untrusted_image && !get_otp_hash &&
+	    regular_files(argv + optind, images_given)) {
+		size_t size;
+		void *data;
+		char *path;
+		int i;
+
+		cache_key_init(&output_key, "flash-image");
+		for (i = optind; i < argc; ++i)
+			cache_key_add_file(&output_key, argv[i]);
+		cache_key_add_signkey(&output_key, sign ? key : NULL);
+		cache_key_add_u32(&output_key, hash_a53_firmware);
+		cache_key_add_u32(&output_key, no_a53_firmware);
+		cache_key_add_u32(&output_key, strip_padding);
+		cache_key_add_u32(&output_key, baudrate);
+		cache_key_add_u32(&output_key, tty || fdstr);
+
+		/* the entry is checked before anything is written */
+		path = cache_get_path(&output_key);
+		if (path && check_cached_output(path)) {
+			data = cache_get(&output_key, &size);
+			if (data) {
+				write_image(output, data, size);
+				printf("Saved to image %s (from cache)\n\n",
+				       output);
+				exit(EXIT_SUCCESS);
+			}
+		}
+		free(path);
+
+		cache_output = 1;
+	}
+
+	/*
+	 * when only uploading, compressed images can be sent while the rest is
+	 * still being decompressed
+	 */
+	if ((tty || fdstr) && !output && !strip_padding && !get_otp_hash &&
+	    !create_trusted_image && !create_untrusted_image)
+		image_allow_partial(1);
+
+	if (tty || fdstr)
+		image_keep_files(1);
+
 	for (; optind < argc; ++optind)
 		image_load(argv[optind]);
 
-	if (image_bootfs == BOOTFS_EMMC)
-		/* Boot partition on eMMC is partition 2 */
-		partition = 2;
-	else
-		partition = 0;
+	if (create_trusted_image || create_untrusted_image) {
+		int i;
 
-	if (create_trusted_image) {
-		do_create_trusted_image(keyfile, output, image_bootfs, partition);
-		exit(EXIT_SUCCESS);
-	} else if (create_untrusted_image) {
-		do_create_untrusted_image(output, image_bootfs, partition);
+		assign_outputs(output, variants, nvariants);
+		for (i = 0; i < nvariants; ++i)
+			variants[i].trusted = create_trusted_image;
+
+		do_create_images(variants, nvariants,
+				 create_trusted_image ? key : NULL);
 		exit(EXIT_SUCCESS);
 	}
 
-	if (!otp_read && !deploy && !images_given && !terminal_on_exit)
+	if (!otp_read && !deploy && !images_given && !terminal_on_exit &&
+	    !expect_script && !probe_latency)
 		die("No images given, try -h for help");
 
 	if (otp_read || deploy) {
 		struct mox_builder_data *mbd;
+		struct tim_builder b;
 		image_t *wtmi;
 
 		if (otp_read && images_given)
@@ -648,9 +1163,10 @@ int main(int argc, char **argv)
 		image_delete_all();
 
 		timh = image_new(NULL, 0, TIMH_ID);
-		tim_minimal_image(timh, 0, TIMH_ID, 1);
 		wtmi = image_new((void *) wtmi_data, wtmi_data_size, WTMI_ID);
-		tim_add_image(timh, wtmi, TIMH_ID, 0x1fff0000, 0, 0, 1);
+		tim_builder_minimal(&b, 0, TIMH_ID, 1);
+		tim_builder_add_image(&b, wtmi, TIMH_ID, 0x1fff0000, 0, 0, 1);
+		tim_builder_finish(&b, timh);
 		tim_rehash(timh);
 		nimages = 2;
 		trusted = 0;
@@ -662,11 +1178,13 @@ int main(int argc, char **argv)
 			u32 hash[8];
 			int i;
 
-			do_get_otp_hash(hash);
+			timh = do_get_otp_hash(hash);
 			printf("Secure firmware OTP hash: ");
 			for (i = 0; i < 8; ++i)
 				printf("%08x", hash[i]);
 			printf("\n");
+
+			check_timn(timh);
 			exit(EXIT_SUCCESS);
 		}
 
@@ -683,11 +1201,20 @@ int main(int argc, char **argv)
 			tim_rehash(timh);
 		}
 
+		if (strip_padding) {
+			tim_strip_padding(timh);
+			if (timn)
+				tim_strip_padding(timn);
+		}
+
 		tim_parse(timh, &nimages, gpp_disassemble,
 			  &has_fast_mode);
-		if (timn)
+		if (timn) {
 			tim_parse(timn, &nimages_timn, gpp_disassemble,
 				  &has_fast_mode);
+			if (trusted)
+				tim_check_key_chain(timh, timn);
+		}
 
 		if (baudrate && !has_fast_mode) {
 			if (trusted)
@@ -711,7 +1238,6 @@ int main(int argc, char **argv)
 			tim_set_boot(timh, BOOTFS_SPINOR);
 
 		if (sign) {
-			EC_KEY *key = load_key(keyfile);
 			tim_sign(timh, key);
 			if (timn)
 				tim_sign(timn, key);
@@ -725,18 +1251,29 @@ int main(int argc, char **argv)
 	if (tty || fdstr) {
 		int i, nimages_all;
 
+		if (realtime_enabled()) {
+			realtime_enable();
+			image_prefault_all();
+		}
+
 		if (fdstr)
 			setwtpfd(fdstr);
 		else
 			openwtp(tty);
 
+		if (record_file)
+			recordwtp(record_file);
+
 		nimages_all = nimages;
 		if (timn)
 			nimages_all += nimages_timn;
 
-		if (nimages_all || send_escape)
+		if (nimages_all || send_escape || probe_latency)
 			initwtp(send_escape);
 
+		if (probe_latency)
+			wtp_probe_latency(probe_latency);
+
 		for (i = 0; i < nimages_all; ++i) {
 			u32 imgtype;
 			image_t *img;
@@ -751,6 +1288,9 @@ int main(int argc, char **argv)
 				try_change_baudrate(baudrate);
 		}
 
+		if (nimages_all)
+			wtp_print_rtt();
+
 		if (baudrate && nimages_all)
 			change_baudrate(115200);
 		else if (baudrate)
@@ -761,9 +1301,16 @@ int main(int argc, char **argv)
 		else if (deploy)
 			uart_deploy();
 
+		if (log_file)
+			uart_log_open(log_file);
+
+		if (expect_script)
+			uart_expect(expect_script);
+
 		if (terminal_on_exit)
 			uart_terminal();
 
+		wtp_print_link_health();
 		closewtp();
 	}
 
@@ -772,6 +1319,9 @@ int main(int argc, char **argv)
 			die("TIMH + TIMN image saving not supported!");
 		save_flash_image(timh, output);
 		printf("Saved to image %s\n\n", output);
+
+		if (cache_output)
+			cache_put_file(&output_key, output);
 	}
 
 	exit(EXIT_SUCCESS);
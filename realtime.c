@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: Beerware
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "realtime.h"
+
+/*
+ * Real-time mode for uploads at high baudrates, where the tty TX queue must
+ * never run empty. The thread doing the transfer gets a real-time scheduling
+ * policy (below the default priority 50 of threaded interrupt handlers, which
+ * must still be able to run the serial driver), optionally on a given CPU,
+ * and all memory is locked.
+ */
+static int enabled;
+static int policy = SCHED_FIFO;
+static int priority = 40;
+static int cpu = -1;
+
+/* spec is a comma separated list of fifo, rr, prio=N and cpu=N, or NULL */
+void realtime_parse(const char *spec)
+{
+	char *list, *opt, *saveptr, *end;
+
+	enabled = 1;
+	if (!spec)
+		return;
+
+	list = xstrdup(spec);
+	for (opt = strtok_r(list, ",", &saveptr); opt;
+	     opt = strtok_r(NULL, ",", &saveptr)) {
+		if (!strcmp(opt, "fifo")) {
+			policy = SCHED_FIFO;
+		} else if (!strcmp(opt, "rr")) {
+			policy = SCHED_RR;
+		} else if (!strncmp(opt, "prio=", 5)) {
+			priority = strtol(opt + 5, &end, 10);
+			if (*end || end == opt + 5 || priority < 1 ||
+			    priority > 99)
+				die("Invalid real-time priority \"%s\"",
+				    opt + 5);
+		} else if (!strncmp(opt, "cpu=", 4)) {
+			cpu = strtol(opt + 4, &end, 10);
+			if (*end || end == opt + 4 || cpu < 0 ||
+			    cpu >= CPU_SETSIZE)
+				die("Invalid CPU \"%s\"", opt + 4);
+		} else {
+			die("Invalid real-time option \"%s\"", opt);
+		}
+	}
+	free(list);
+}
+
+int realtime_enabled(void)
+{
+	return enabled;
+}
+
+/*
+ * Applies only to the calling thread. Threads and processes decompressing
+ * images were started before and keep their scheduling, SCHED_RESET_ON_FORK
+ * keeps it for ones started later.
+ */
+void realtime_enable(void)
+{
+	struct sched_param sp = { .sched_priority = priority };
+	cpu_set_t set;
+
+	if (!enabled)
+		return;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			die("Cannot set CPU affinity to CPU %i: %m", cpu);
+	}
+
+	if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &sp) < 0)
+		die("Cannot set real-time scheduling (needs CAP_SYS_NICE or "
+		    "RLIMIT_RTPRIO): %m");
+
+	/*
+	 * Pages are locked as they are faulted in, so that the reserved but
+	 * mostly unused buffers for decompressed images are not populated.
+	 * Images are populated by image_prefault_all().
+	 */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) < 0)
+		die("Cannot lock memory (needs CAP_IPC_LOCK or "
+		    "RLIMIT_MEMLOCK): %m");
+
+	printf("Real-time mode: %s priority %i", policy == SCHED_RR ?
+	       "SCHED_RR" : "SCHED_FIFO", priority);
+	if (cpu >= 0)
+		printf(" on CPU %i", cpu);
+	printf(", memory locked\n");
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+
+#include "utils.h"
+
+extern void realtime_parse(const char *spec);
+extern int realtime_enabled(void);
+extern void realtime_enable(void);
+
+#endif /* _REALTIME_H_ */
@@ -7,13 +7,11 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
-#include <openssl/ecdsa.h>
 #include <endian.h>
 #include "tim.h"
 #include "utils.h"
 #include "wtptp.h"
 #include "key.h"
-#include "bn.h"
 #include "images.h"
 #include "instr.h"
 
@@ -21,13 +19,12 @@
 #pragma GCC diagnostic ignored "-Wzero-length-bounds"
 #endif
 
-static void tim_add_cidp_pkg(image_t *tim, const char *consumer, int npkgs,
-			     ...);
-static void tim_add_gpp_pkg(image_t *tim, const char *name, void *code,
-			    size_t codesize, int init_ddr,
-			    int enable_memtest, u32 memtest_start,
-			    u32 memtest_size, int init_attempts,
-			    int ignore_timeouts_op, int ignore_timeouts_val);
+static respkg_t *cidp_pkg(const char *consumer, int npkgs, ...);
+static respkg_t *gpp_pkg(const char *name, void *code, size_t codesize,
+			 int init_ddr, int enable_memtest, u32 memtest_start,
+			 u32 memtest_size, int init_attempts,
+			 int ignore_timeouts_op, int ignore_timeouts_val);
+static void key_hash(u32 alg, u32 *hash, const u32 *x, const u32 *y, int pad);
 
 static reshdr_t *reserved_area(timhdr_t *timhdr)
 {
@@ -36,41 +33,84 @@ static reshdr_t *reserved_area(timhdr_t *timhdr)
 		le32toh(timhdr->numkeys) * sizeof(keyinfo_t);
 }
 
-static respkg_t *nextpkg(timhdr_t *timhdr, respkg_t *pkg)
+static inline u32 tim_index_slot(u32 id)
 {
-	reshdr_t *reshdr;
-	respkg_t *next, *end;
+	return (id * 0x9e3779b1U) >> (32 - TIM_INDEX_BITS);
+}
 
-	reshdr = reserved_area(timhdr);
+static void tim_index_add(u8 *index, u32 id, const void *base, size_t stride,
+			  int i)
+{
+	u32 mask = (1 << TIM_INDEX_BITS) - 1, s;
 
-	next = ((void *) pkg) + le32toh(pkg->size);
-	end = ((void *) reshdr) + le32toh(timhdr->sizeofreserved);
+	/* keep the first entry if IDs are duplicated */
+	for (s = tim_index_slot(id); index[s]; s = (s + 1) & mask)
+		if (*(u32 *)(base + (index[s] - 1) * stride) == id)
+			return;
 
-	if (next > end)
-		die("Reserved area broken");
-	else if (next == end)
-		return NULL;
-	else
-		return next;
+	index[s] = i + 1;
 }
 
-static respkg_t *firstpkg(timhdr_t *timhdr)
+static int tim_index_find(const u8 *index, u32 id, const void *base,
+			  size_t stride)
 {
-	reshdr_t *reshdr;
-	respkg_t *first, *pkg;
+	u32 mask = (1 << TIM_INDEX_BITS) - 1, s;
+
+	for (s = tim_index_slot(id); index[s]; s = (s + 1) & mask)
+		if (*(u32 *)(base + (index[s] - 1) * stride) == id)
+			return index[s] - 1;
+
+	return -1;
+}
+
+void tim_view(tim_view_t *v, const image_t *tim)
+{
+	timhdr_t *timhdr;
+	respkg_t *pkg;
+	void *end;
 	u32 i, id, pkgs, size;
 
+	if (tim->size < sizeof(timhdr_t))
+		die("TIMH length too small (%u, should be at least %zu)",
+		    tim->size, sizeof(timhdr_t));
+
+	timhdr = (timhdr_t *) tim->data;
+
+	memset(v->imgidx, 0, sizeof(v->imgidx));
+	memset(v->pkgidx, 0, sizeof(v->pkgidx));
+	v->hdr = timhdr;
+	v->nimages = tim_nimages(timhdr);
+	v->nkeys = tim_nkeys(timhdr);
+	v->npkgs = 0;
+
+	if (v->nimages > TIM_MAX_IMAGES || v->nkeys > TIM_MAX_KEYS)
+		die("Too many images / keys in TIM (%d / %d)", v->nimages,
+		    v->nkeys);
+
+	if (tim_size(timhdr) > tim->size)
+		die("Invalid TIM length (%u, expected %zu)", tim->size,
+		    tim_size(timhdr));
+
+	v->images = (imginfo_t *) (timhdr + 1);
+	v->keys = (keyinfo_t *) (v->images + v->nimages);
+
+	for (i = 0; i < (u32) v->nimages; ++i)
+		tim_index_add(v->imgidx, v->images[i].id, v->images,
+			      sizeof(imginfo_t), i);
+
 	size = le32toh(timhdr->sizeofreserved);
+	v->reshdr = size ? reserved_area(timhdr) : NULL;
+	v->platds = timhdr->trusted ?
+		    (void *) reserved_area(timhdr) + size : NULL;
+
 	if (!size)
-		return NULL;
+		return;
 
 	if (size < sizeof(reshdr_t))
 		die("Size of reserved area (%u bytes) too small", size);
 
-	reshdr = reserved_area(timhdr);
-
-	id = le32toh(reshdr->id);
-	pkgs = le32toh(reshdr->pkgs);
+	id = le32toh(v->reshdr->id);
+	pkgs = le32toh(v->reshdr->pkgs);
 
 	if (id != RES_ID)
 		die("Incorrect reserved area ID %s", id2name(id));
@@ -79,114 +119,406 @@ static respkg_t *firstpkg(timhdr_t *timhdr)
 		die("Size of reserved area (%u bytes) too small for "
 		    "%u packages", size, pkgs);
 
-	first = (respkg_t *) (reshdr + 1);
-
-	i = 0;
-	for (pkg = first; pkg; pkg = nextpkg(timhdr, pkg))
-		++i;
+	end = (void *) v->reshdr + size;
+	for (pkg = (respkg_t *) (v->reshdr + 1); (void *) pkg < end;
+	     pkg = (void *) pkg + le32toh(pkg->size)) {
+		if ((void *) pkg + SIZEOF_RESPKG_HDR > end ||
+		    le32toh(pkg->size) < SIZEOF_RESPKG_HDR ||
+		    (void *) pkg + le32toh(pkg->size) > end)
+			die("Reserved area broken");
+
+		if (v->npkgs == TIM_MAX_PKGS)
+			die("Too many packages in reserved area");
+
+		v->pkgids[v->npkgs] = pkg->id;
+		tim_index_add(v->pkgidx, pkg->id, v->pkgids, sizeof(u32),
+			      v->npkgs);
+		v->pkgs[v->npkgs++] = pkg;
+	}
 
-	if (i != pkgs)
+	if ((u32) v->npkgs != pkgs)
 		die("Reserved area broken (expected %u packages, found %u)",
-		    pkgs, i);
+		    pkgs, v->npkgs);
+}
 
-	return first;
+imginfo_t *tim_view_image(const tim_view_t *v, u32 id)
+{
+	int i = tim_index_find(v->imgidx, htole32(id), v->images,
+			       sizeof(imginfo_t));
+
+	return i < 0 ? NULL : &v->images[i];
 }
 
-static u32 getsizetohash(timhdr_t *timhdr)
+respkg_t *tim_view_pkg(const tim_view_t *v, u32 id)
 {
-	void *res;
+	int i = tim_index_find(v->pkgidx, htole32(id), v->pkgids, sizeof(u32));
 
-	res = (void *) timhdr + sizeof(timhdr_t) +
-	      le32toh(timhdr->numimages) * sizeof(imginfo_t) +
-	      le32toh(timhdr->sizeofreserved) +
-	      le32toh(timhdr->numkeys) * sizeof(keyinfo_t);
+	return i < 0 ? NULL : v->pkgs[i];
+}
 
-	if (timhdr->trusted) {
-		platds_t *platds = res;
+void tim_builder_load(struct tim_builder *b, const image_t *tim)
+{
+	tim_view_t v;
 
-		res += (void *) &platds->ECDSA.sig - res;
-	}
+	tim_view(&v, tim);
 
-	return res - (void *) timhdr;
+	b->id = tim->id;
+	b->hdr = *v.hdr;
+	b->nimages = v.nimages;
+	b->nkeys = v.nkeys;
+	b->npkgs = v.npkgs;
+	memset(b->owned, 0, sizeof(b->owned));
+	b->reserved = v.reshdr != NULL;
+
+	memcpy(b->images, v.images, v.nimages * sizeof(imginfo_t));
+	memcpy(b->keys, v.keys, v.nkeys * sizeof(keyinfo_t));
+	memcpy(b->pkgs, v.pkgs, v.npkgs * sizeof(respkg_t *));
+
+	if (v.platds)
+		b->platds = *v.platds;
+	else
+		memset(&b->platds, 0, sizeof(b->platds));
 }
 
-static imginfo_t *tim_find_image(image_t *tim, u32 id)
+static int tim_builder_find_image(struct tim_builder *b, u32 id)
 {
-	timhdr_t *timhdr;
-	imginfo_t *img;
 	int i;
 
-	timhdr = (void *) tim->data;
+	for (i = 0; i < b->nimages; ++i)
+		if (le32toh(b->images[i].id) == id)
+			return i;
 
-	for (i = 0; i < tim_nimages(timhdr); ++i) {
-		img = tim_image(timhdr, i);
+	return -1;
+}
 
-		if (le32toh(img->id) == id)
-			return img;
-	}
+static int tim_builder_find_pkg(struct tim_builder *b, u32 id)
+{
+	int i;
 
-	return NULL;
+	for (i = 0; i < b->npkgs; ++i)
+		if (le32toh(b->pkgs[i]->id) == id)
+			return i;
+
+	return -1;
 }
 
-void tim_image_set_loadaddr(image_t *tim, u32 id, u32 loadaddr)
+/* insert image info after image with ID after, fixing the nextid chain */
+static void tim_builder_insert_image(struct tim_builder *b,
+				     const imginfo_t *info, u32 after)
 {
-	imginfo_t *img;
+	int i;
 
-	img = tim_find_image(tim, id);
-	if (!img)
-		return;
+	i = tim_builder_find_image(b, after);
+	if (i < 0)
+		die("Cannot add imginfo if no imginfo exists!");
 
-	img->loadaddr = htole32(loadaddr);
+	if (b->nimages == TIM_MAX_IMAGES)
+		die("Too many images in TIM");
+
+	memmove(&b->images[i + 2], &b->images[i + 1],
+		(b->nimages - i - 1) * sizeof(imginfo_t));
+	++b->nimages;
+
+	b->images[i + 1] = *info;
+	b->images[i + 1].nextid = b->images[i].nextid;
+	b->images[i].nextid = info->id;
 }
 
-void tim_remove_image(image_t *tim, u32 id)
+static void tim_builder_remove_image(struct tim_builder *b, int i)
 {
-	timhdr_t *timhdr;
-	imginfo_t *img;
-	void *imgend;
+	if (i > 0)
+		b->images[i - 1].nextid = b->images[i].nextid;
 
-	timhdr = (void *) tim->data;
+	memmove(&b->images[i], &b->images[i + 1],
+		(b->nimages - i - 1) * sizeof(imginfo_t));
+	--b->nimages;
+}
 
-	img = tim_find_image(tim, id);
-	if (!img)
-		return;
+void tim_builder_add_image(struct tim_builder *b, image_t *image, u32 after,
+			   u32 loadaddr, u32 flashaddr, u32 partition, int hash)
+{
+	imginfo_t info;
+
+	memset(&info, 0, sizeof(imginfo_t));
+	info.id = htole32(image->id);
+	info.size = htole32(image->size);
+	info.flashentryaddr = htole32(flashaddr);
+	info.partitionnumber = htole32(partition);
+	info.loadaddr = htole32(loadaddr);
+	info.hashalg = htole32(HASH_SHA512);
+	info.sizetohash = hash ? info.size : 0;
+
+	tim_builder_insert_image(b, &info, after);
+}
 
-	if (img != tim_image(timhdr, 0))
-		(img - 1)->nextid = img->nextid;
+void tim_builder_set_loadaddr(struct tim_builder *b, u32 id, u32 loadaddr)
+{
+	int i = tim_builder_find_image(b, id);
 
-	imgend = img + 1;
-	memmove(img, imgend, (void *) tim->data + tim->size - imgend);
+	if (i >= 0)
+		b->images[i].loadaddr = htole32(loadaddr);
+}
 
-	timhdr->numimages = htole32(tim_nimages(timhdr) - 1);
-	tim->size -= sizeof(imginfo_t);
+void tim_builder_set_boot(struct tim_builder *b, u32 boot)
+{
+	b->hdr.bootflashsign = htole32(boot);
+}
 
-	img = tim_find_image(tim, tim->id);
-	if (img) {
-		img->size = htole32(tim->size);
-		img->sizetohash = htole32(tim->size);
+void tim_builder_add_key(struct tim_builder *b, u32 id, const signkey_t *key)
+{
+	keyinfo_t *keyinfo;
+
+	if (b->nkeys == TIM_MAX_KEYS)
+		die("Too many keys in TIM");
+
+	keyinfo = &b->keys[b->nkeys++];
+	memset(keyinfo, 0, sizeof(keyinfo_t));
+	keyinfo->id = htole32(id);
+	keyinfo->hashalg = htole32(HASH_SHA256);
+	keyinfo->size = htole32(521);
+	keyinfo->publickeysize = htole32(521);
+	keyinfo->encryptalg = htole32(DSALG_ECDSA_521);
+	memcpy(keyinfo->ECDSAcompx, key->x, sizeof(key->x));
+	memcpy(keyinfo->ECDSAcompy, key->y, sizeof(key->y));
+	key_hash(HASH_SHA256, keyinfo->hash, keyinfo->ECDSAcompx,
+		 keyinfo->ECDSAcompy, 0);
+}
+
+static void tim_builder_insert_pkg(struct tim_builder *b, int i, respkg_t *pkg)
+{
+	if (b->npkgs == TIM_MAX_PKGS)
+		die("Too many packages in reserved area");
+
+	memmove(&b->pkgs[i + 1], &b->pkgs[i],
+		(b->npkgs - i) * sizeof(respkg_t *));
+	memmove(&b->owned[i + 1], &b->owned[i], b->npkgs - i);
+	b->pkgs[i] = pkg;
+	b->owned[i] = 1;
+	++b->npkgs;
+}
+
+/*
+ * Add package pkg (allocated by the caller, the builder takes ownership) before
+ * the Term package. If there is no reserved area yet, it is created, with a
+ * Term package.
+ */
+void tim_builder_add_pkg(struct tim_builder *b, respkg_t *pkg)
+{
+	int i;
+
+	if (!b->reserved) {
+		respkg_t *term = xmalloc(SIZEOF_RESPKG_HDR);
+
+		term->id = htole32(PKG_Term);
+		term->size = htole32(SIZEOF_RESPKG_HDR);
+		tim_builder_insert_pkg(b, 0, term);
+		b->reserved = 1;
 	}
+
+	i = tim_builder_find_pkg(b, PKG_Term);
+	tim_builder_insert_pkg(b, i < 0 ? b->npkgs : i, pkg);
 }
 
-static respkg_t *tim_find_pkg(image_t *tim, u32 id)
+static void tim_builder_remove_pkg(struct tim_builder *b, int i)
 {
-	timhdr_t *timhdr;
+	if (b->owned[i])
+		free(b->pkgs[i]);
+
+	memmove(&b->pkgs[i], &b->pkgs[i + 1],
+		(b->npkgs - i - 1) * sizeof(respkg_t *));
+	memmove(&b->owned[i], &b->owned[i + 1], b->npkgs - i - 1);
+	--b->npkgs;
+}
+
+static void tim_builder_append_gpp_code(struct tim_builder *b, const char *name,
+					void *code, size_t codesize)
+{
+	respkg_t *pkg, *old;
+	u32 size;
+	int i;
+
+	if (codesize & 3)
+		die("GPP code length must be a multiple of 4!");
+
+	i = tim_builder_find_pkg(b, name2id(name));
+	if (i < 0)
+		die("Package %s not found!", name);
+
+	old = b->pkgs[i];
+	size = le32toh(old->size);
+
+	pkg = xmalloc(size + codesize);
+	memcpy(pkg, old, size);
+	memcpy((void *) pkg + size, code, codesize);
+	pkg->gpp.ninst = htole32(le32toh(pkg->gpp.ninst) +
+				 gpp_count(code, codesize / 4));
+	pkg->size = htole32(size + codesize);
+
+	if (b->owned[i])
+		free(old);
+	b->owned[i] = 1;
+	b->pkgs[i] = pkg;
+}
+
+/* make package i a private copy, so that it can be modified in place */
+static respkg_t *tim_builder_own_pkg(struct tim_builder *b, int i)
+{
+	u32 size = le32toh(b->pkgs[i]->size);
 	respkg_t *pkg;
 
-	timhdr = (void *)tim->data;
+	if (b->owned[i])
+		return b->pkgs[i];
 
-	for (pkg = firstpkg(timhdr); pkg; pkg = nextpkg(timhdr, pkg))
-		if (le32toh(pkg->id) == id)
-			break;
+	pkg = xmalloc(size);
+	memcpy(pkg, b->pkgs[i], size);
+	b->pkgs[i] = pkg;
+	b->owned[i] = 1;
 
 	return pkg;
 }
 
-static struct imap_map *tim_imap_pkg_find_map(image_t *tim, u32 id)
+void tim_builder_imap_set(struct tim_builder *b, u32 id, u32 flashentry,
+			  u32 partition)
+{
+	respkg_t *pkg;
+	u32 j;
+	int i;
+
+	i = tim_builder_find_pkg(b, PKG_IMAP);
+	if (i < 0)
+		die("Cannot find IMAP package");
+
+	pkg = tim_builder_own_pkg(b, i);
+	for (j = 0; j < le32toh(pkg->imap.nmaps); ++j) {
+		if (le32toh(pkg->imap.maps[j].id) != id)
+			continue;
+
+		pkg->imap.maps[j].flashentryaddr[0] = htole32(flashentry);
+		pkg->imap.maps[j].partitionnumber = htole32(partition);
+		return;
+	}
+
+	die("Cannot find requested map %s in IMAP package", id2name(id));
+}
+
+/*
+ * Serialize the builder into a new TIM buffer, replacing (and freeing) the data
+ * of tim. The size of the TIM in its own image info is updated.
+ */
+void tim_builder_finish(struct tim_builder *b, image_t *tim)
+{
+	u32 size, ressize;
+	void *data, *p;
+	int i;
+
+	ressize = 0;
+	if (b->reserved) {
+		ressize = sizeof(reshdr_t);
+		for (i = 0; i < b->npkgs; ++i)
+			ressize += le32toh(b->pkgs[i]->size);
+	}
+
+	size = sizeof(timhdr_t) + b->nimages * sizeof(imginfo_t) +
+	       b->nkeys * sizeof(keyinfo_t) + ressize;
+	if (b->hdr.trusted)
+		size += sizeof(platds_t);
+
+	b->hdr.numimages = htole32(b->nimages);
+	b->hdr.numkeys = htole32(b->nkeys);
+	b->hdr.sizeofreserved = htole32(ressize);
+
+	i = tim_builder_find_image(b, b->id);
+	if (i >= 0) {
+		b->images[i].size = htole32(size);
+		b->images[i].sizetohash = htole32(size);
+	}
+
+	data = p = xmalloc(size);
+
+	memcpy(p, &b->hdr, sizeof(timhdr_t));
+	p += sizeof(timhdr_t);
+	memcpy(p, b->images, b->nimages * sizeof(imginfo_t));
+	p += b->nimages * sizeof(imginfo_t);
+	memcpy(p, b->keys, b->nkeys * sizeof(keyinfo_t));
+	p += b->nkeys * sizeof(keyinfo_t);
+
+	if (b->reserved) {
+		reshdr_t *reshdr = p;
+
+		reshdr->id = htole32(RES_ID);
+		reshdr->pkgs = htole32(b->npkgs);
+		p += sizeof(reshdr_t);
+
+		for (i = 0; i < b->npkgs; ++i) {
+			memcpy(p, b->pkgs[i], le32toh(b->pkgs[i]->size));
+			p += le32toh(b->pkgs[i]->size);
+			if (b->owned[i])
+				free(b->pkgs[i]);
+		}
+	}
+
+	if (b->hdr.trusted)
+		memcpy(p, &b->platds, sizeof(platds_t));
+
+	free(tim->data);
+	tim->id = b->id;
+	tim->data = data;
+	tim->size = size;
+}
+
+static u32 getsizetohash(timhdr_t *timhdr)
+{
+	void *res;
+
+	res = (void *) timhdr + sizeof(timhdr_t) +
+	      le32toh(timhdr->numimages) * sizeof(imginfo_t) +
+	      le32toh(timhdr->sizeofreserved) +
+	      le32toh(timhdr->numkeys) * sizeof(keyinfo_t);
+
+	if (timhdr->trusted) {
+		platds_t *platds = res;
+
+		res += (void *) &platds->ECDSA.sig - res;
+	}
+
+	return res - (void *) timhdr;
+}
+
+void tim_image_set_loadaddr(image_t *tim, u32 id, u32 loadaddr)
+{
+	imginfo_t *img;
+	tim_view_t v;
+
+	tim_view(&v, tim);
+
+	img = tim_view_image(&v, id);
+	if (!img)
+		return;
+
+	img->loadaddr = htole32(loadaddr);
+}
+
+void tim_remove_image(image_t *tim, u32 id)
+{
+	struct tim_builder b;
+	int i;
+
+	tim_builder_load(&b, tim);
+
+	i = tim_builder_find_image(&b, id);
+	if (i < 0)
+		return;
+
+	tim_builder_remove_image(&b, i);
+	tim_builder_finish(&b, tim);
+}
+
+static struct imap_map *tim_view_imap_map(const tim_view_t *v, u32 id)
 {
 	respkg_t *pkg;
 	u32 i;
 
-	pkg = tim_find_pkg(tim, PKG_IMAP);
+	pkg = tim_view_pkg(v, PKG_IMAP);
 	if (!pkg)
 		return NULL;
 
@@ -197,9 +529,9 @@ static struct imap_map *tim_imap_pkg_find_map(image_t *tim, u32 id)
 	return NULL;
 }
 
-u32 tim_imap_pkg_addr(image_t *tim, u32 id)
+u32 tim_view_imap_addr(const tim_view_t *v, u32 id)
 {
-	struct imap_map *map = tim_imap_pkg_find_map(tim, id);
+	struct imap_map *map = tim_view_imap_map(v, id);
 
 	if (!map)
 		return -1U;
@@ -207,39 +539,28 @@ u32 tim_imap_pkg_addr(image_t *tim, u32 id)
 	return le32toh(map->flashentryaddr[0]);
 }
 
-void tim_imap_pkg_addr_set(image_t *tim, u32 id, u32 flashentry, u32 partition)
+u32 tim_imap_pkg_addr(image_t *tim, u32 id)
 {
-	struct imap_map *map = tim_imap_pkg_find_map(tim, id);
+	tim_view_t v;
 
-	if (!map)
-		die("Cannot find IMAP package or requested map %s", id2name(id));
+	tim_view(&v, tim);
 
-	map->flashentryaddr[0] = htole32(flashentry);
-	map->partitionnumber = htole32(partition);
+	return tim_view_imap_addr(&v, id);
 }
 
 static void __attribute__((unused)) tim_remove_pkg(image_t *tim, u32 id)
 {
-	timhdr_t *timhdr;
-	reshdr_t *reshdr;
-	respkg_t *pkg;
-	u32 pkgsize;
-	void *pkgend;
+	struct tim_builder b;
+	int i;
 
-	pkg = tim_find_pkg(tim, id);
+	tim_builder_load(&b, tim);
 
-	if (!pkg)
+	i = tim_builder_find_pkg(&b, id);
+	if (i < 0)
 		return;
 
-	pkgsize = le32toh(pkg->size);
-	pkgend = (void *) pkg + pkgsize;
-	memmove(pkg, pkgend, (void *) tim->data + tim->size - pkgend);
-
-	timhdr = (void *) tim->data;
-	reshdr = reserved_area(timhdr);
-	reshdr->pkgs = htole32(le32toh(reshdr->pkgs) - 1);
-	timhdr->sizeofreserved = htole32(le32toh(timhdr->sizeofreserved) - pkgsize);
-	tim->size -= pkgsize;
+	tim_builder_remove_pkg(&b, i);
+	tim_builder_finish(&b, tim);
 }
 
 char minimal_secure_tim[] =
@@ -301,60 +622,170 @@ const size_t minimal_tim_size = 200;
 #include "gpp/ddr.c"
 #include "gpp/ddr_uart.c"
 
-void tim_minimal_image(image_t *tim, int trusted, u32 id, int support_fastmode)
+/* load minimal TIM into the builder, with GPP packages unless trusted TIMH */
+void tim_builder_minimal(struct tim_builder *b, int trusted, u32 id,
+			 int support_fastmode)
 {
-	void *data, *from;
-	u32 size;
+	image_t minimal;
 
 	if (trusted) {
 		if (id == TIMN_ID) {
-			from = minimal_secure_timn;
-			size = minimal_secure_timn_size;
+			minimal.data = (u8 *) minimal_secure_timn;
+			minimal.size = minimal_secure_timn_size;
 		} else {
-			from = minimal_secure_tim;
-			size = minimal_secure_tim_size;
+			minimal.data = (u8 *) minimal_secure_tim;
+			minimal.size = minimal_secure_tim_size;
 		}
 	} else {
-		from = minimal_tim;
-		size = minimal_tim_size;
+		minimal.data = (u8 *) minimal_tim;
+		minimal.size = minimal_tim_size;
 	}
 
-	data = xmalloc(size);
-	memcpy(data, from, size);
-
-	if (tim->data)
-		free(tim->data);
-
-	tim->id = le32toh(*(u32 *) (from + 4));
-	tim->data = data;
-	tim->size = size;
+	minimal.id = le32toh(*(u32 *) (minimal.data + 4));
+	tim_builder_load(b, &minimal);
 
 	if (trusted && id != TIMN_ID)
 		return;
 
-	tim_add_cidp_pkg(tim, "TBRI", 3, "GPP1", "GPP2", "DDR3");
+	tim_builder_add_pkg(b, cidp_pkg("TBRI", 3, "GPP1", "GPP2", "DDR3"));
 
 	if (trusted)
-		tim_add_gpp_pkg(tim, "GPP1", GPP_gpp1_trusted,
-				GPP_gpp1_trusted_size, 0, 0, 0, 0, 0, 1, 0);
+		tim_builder_add_pkg(b, gpp_pkg("GPP1", GPP_gpp1_trusted,
+					       GPP_gpp1_trusted_size, 0, 0, 0,
+					       0, 0, 1, 0));
 	else
-		tim_add_gpp_pkg(tim, "GPP1", GPP_gpp1, GPP_gpp1_size,
-				0, 0, 0, 0, 0, 1, 0);
+		tim_builder_add_pkg(b, gpp_pkg("GPP1", GPP_gpp1,
+					       GPP_gpp1_size, 0, 0, 0, 0, 0,
+					       1, 0));
 
 	if (support_fastmode)
-		tim_add_gpp_pkg(tim, "GPP2", GPP_gpp2_uart_baudrate_change_back,
-				GPP_gpp2_uart_baudrate_change_back_size, 0, 0, 0,
-				0, 0, 1, 0);
+		tim_builder_add_pkg(b, gpp_pkg("GPP2",
+					       GPP_gpp2_uart_baudrate_change_back,
+					       GPP_gpp2_uart_baudrate_change_back_size,
+					       0, 0, 0, 0, 0, 1, 0));
 	else
-		tim_add_gpp_pkg(tim, "GPP2", GPP_gpp2, GPP_gpp2_size,
-				0, 0, 0, 0, 0, 1, 0);
+		tim_builder_add_pkg(b, gpp_pkg("GPP2", GPP_gpp2,
+					       GPP_gpp2_size, 0, 0, 0, 0, 0,
+					       1, 0));
 
 	if (support_fastmode)
-		tim_add_gpp_pkg(tim, "DDR3", GPP_ddr_uart, GPP_ddr_uart_size,
-				1, 0, 0, 0, 0, 0, 0);
+		tim_builder_add_pkg(b, gpp_pkg("DDR3", GPP_ddr_uart,
+					       GPP_ddr_uart_size, 1, 0, 0, 0,
+					       0, 0, 0));
 	else
-		tim_add_gpp_pkg(tim, "DDR3", GPP_ddr, GPP_ddr_size,
-				1, 0, 0, 0, 0, 0, 0);
+		tim_builder_add_pkg(b, gpp_pkg("DDR3", GPP_ddr, GPP_ddr_size,
+					       1, 0, 0, 0, 0, 0, 0));
+}
+
+static void key_hash(u32 alg, u32 *hash, const u32 *x, const u32 *y, int pad)
+{
+	u32 buf[129];
+
+	memset(buf, 0, sizeof(buf));
+	if (alg == HASH_SHA512)
+		buf[0] = htole32(SIG_SCHEME_ECDSA_P521_SHA512);
+	else
+		buf[0] = htole32(SIG_SCHEME_ECDSA_P521_SHA256);
+	memcpy(&buf[1], x, 68);
+	memcpy(&buf[18], y, 68);
+
+	image_hash(alg, buf, pad ? sizeof(buf) : 140, hash, -1U);
+}
+
+/* per thread, set when only the result of tim_parse() is of interest */
+static __thread int quiet;
+
+void tim_set_quiet(int q)
+{
+	quiet = q;
+}
+
+static __attribute__((format(printf, 1, 2))) void tim_info(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (quiet)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+/* check hashes of the keys in the TIM and the platform digital signature */
+static void tim_check_signature(image_t *tim, const tim_view_t *v)
+{
+	platds_t *platds = v->platds;
+	u32 hashalg, hash[16];
+	keyinfo_t *k;
+	int i, ret;
+
+	for (i = 0; i < v->nkeys; ++i) {
+		k = &v->keys[i];
+		hashalg = le32toh(k->hashalg);
+
+		if (le32toh(k->encryptalg) != DSALG_ECDSA_521)
+			die("Unsupported algorithm %s of key %s",
+			    dsalg2name(le32toh(k->encryptalg)),
+			    id2name(le32toh(k->id)));
+
+		key_hash(hashalg, hash, k->ECDSAcompx, k->ECDSAcompy, 0);
+		if (memcmp(hash, k->hash, hashalg))
+			die("Hash check failed for key %s",
+			    id2name(le32toh(k->id)));
+	}
+
+	if (le32toh(platds->dsalg) != DSALG_ECDSA_521)
+		die("Unsupported signature algorithm %s",
+		    dsalg2name(le32toh(platds->dsalg)));
+
+	hashalg = le32toh(platds->hashalg);
+	if (hashalg != HASH_SHA256 && hashalg != HASH_SHA512)
+		die("Unsupported signature hash %s", hash2name(hashalg));
+
+	image_hash(hashalg, tim->data, (u8 *) &platds->ECDSA.sig - tim->data,
+		   hash, -1U);
+
+	ret = key_verify(platds->ECDSA.pub.x, platds->ECDSA.pub.y, hash,
+			 hashalg, platds->ECDSA.sig.r, platds->ECDSA.sig.s);
+	if (ret < 0)
+		die("Invalid public key in %s signature", id2name(tim->id));
+	else if (!ret)
+		die("Signature check failed for %s", id2name(tim->id));
+
+	tim_info("Signature valid\n");
+}
+
+/* check that TIMN is signed by one of the keys listed in TIMH */
+void tim_check_key_chain(image_t *timh, image_t *timn)
+{
+	tim_view_t hv, nv;
+	u32 hashalg, hash[16];
+	platds_t *platds;
+	keyinfo_t *k;
+	int i;
+
+	tim_view(&nv, timn);
+	platds = nv.platds;
+	if (!platds)
+		die("TIMN is not signed");
+
+	tim_view(&hv, timh);
+	for (i = 0; i < hv.nkeys; ++i) {
+		k = &hv.keys[i];
+		hashalg = le32toh(k->hashalg);
+
+		key_hash(hashalg, hash, platds->ECDSA.pub.x,
+			 platds->ECDSA.pub.y, 0);
+		if (!memcmp(hash, k->hash, hashalg))
+			break;
+	}
+
+	if (i == hv.nkeys)
+		die("TIMN is not signed by any key from TIMH");
+
+	tim_info("TIMN signed by key %s from TIMH\n\n",
+		 id2name(le32toh(hv.keys[i].id)));
 }
 
 void tim_parse(image_t *tim, int *numimagesp, int disasm,
@@ -364,8 +795,9 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 	timhdr_t *timhdr;
 	imginfo_t *i, *start, *end;
 	respkg_t *pkg;
-	platds_t *platds;
-	u32 version, date, numimages, numkeys, bootfs, sizeofreserved;
+	tim_view_t v;
+	u32 version, date, numimages, numkeys, bootfs;
+	int n;
 
 	if (tim->size < sizeof(timhdr_t))
 		die("TIMH length too small (%u, should be at least %zu)",
@@ -381,20 +813,24 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 	numimages = le32toh(timhdr->numimages);
 	numkeys = le32toh(timhdr->numkeys);
 	bootfs = le32toh(timhdr->bootflashsign);
-	sizeofreserved = le32toh(timhdr->sizeofreserved);
 
-	printf("TIM version %u.%u.%02u, issue date %04x-%02x-%02x, %s, %u "
+	tim_info("TIM version %u.%u.%02u, issue date %04x-%02x-%02x, %s, %u "
 	       "images, %u keys, boot flash sign %s\n",
 	       version >> 16, (version >> 8) & 0xff, version & 0xff,
 	       date & 0xffff, (date >> 16) & 0xff, date >> 24,
 	       timhdr->trusted ? "trusted" : "non-trusted", numimages, numkeys,
 	       bootfs2name(bootfs));
 
-	printf("Reserved area packages:\n");
-	for (pkg = firstpkg(timhdr); pkg; pkg = nextpkg(timhdr, pkg)) {
-		u32 pkgid = le32toh(pkg->id);
+	tim_view(&v, tim);
+
+	tim_info("Reserved area packages:\n");
+	for (n = 0; n < v.npkgs; ++n) {
+		u32 pkgid;
 
-		printf("  %s (size %u)\n", id2name(pkgid), le32toh(pkg->size));
+		pkg = v.pkgs[n];
+		pkgid = le32toh(pkg->id);
+
+		tim_info("  %s (size %u)\n", id2name(pkgid), le32toh(pkg->size));
 		if (pkgid == PKG_IMAP) {
 			u32 i;
 
@@ -402,7 +838,7 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 				typeof(pkg->imap.maps[0]) *map;
 				map = &pkg->imap.maps[i];
 
-				printf("    Image map %i: %s, %s, entry "
+				tim_info("    Image map %i: %s, %s, entry "
 				       "address %08x, partition number %u\n", i,
 				       id2name(map->id),
 				       map->type ? "recovery" : "primary",
@@ -414,14 +850,14 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 			u32 i, j, n;
 
 			for (i = 0; i < le32toh(pkg->cidp.nconsumers); ++i) {
-				printf("    Consumer %s, packages:",
+				tim_info("    Consumer %s, packages:",
 					id2name(le32toh(cidp->id)));
 
 				n = le32toh(cidp->npkgs);
 				for (j = 0; j < n; ++j)
-					printf(" %s",
+					tim_info(" %s",
 					       id2name(le32toh(cidp->pkgs[j])));
-				printf("\n");
+				tim_info("\n");
 
 				cidp = (void *)cidp + sizeof(*cidp) +
 				       n * sizeof(cidp->pkgs[0]);
@@ -443,22 +879,22 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 				opval = le32toh(op->value);
 				switch (opid) {
 				case 0x01:
-					printf("    Initialize DDR memory: %u\n", opval);
+					tim_info("    Initialize DDR memory: %u\n", opval);
 					break;
 				case 0x02:
-					printf("    Enable memtest: %u\n", opval);
+					tim_info("    Enable memtest: %u\n", opval);
 					break;
 				case 0x03:
-					printf("    Memtest start: 0x%x\n", opval);
+					tim_info("    Memtest start: 0x%x\n", opval);
 					break;
 				case 0x04:
-					printf("    Memtest size: 0x%x\n", opval);
+					tim_info("    Memtest size: 0x%x\n", opval);
 					break;
 				case 0x05:
-					printf("    Init attempts: %u\n", opval);
+					tim_info("    Init attempts: %u\n", opval);
 					break;
 				case 0x06:
-					printf("    Ignore timeouts in instructions: %u\n", opval);
+					tim_info("    Ignore timeouts in instructions: %u\n", opval);
 					break;
 				}
 				++op;
@@ -472,11 +908,11 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 							    memmem(code, len, "UAtx", 4) &&
 							    memmem(code, len, "baud", 4);
 				if (*supports_baudrate_change)
-					printf("    Contains code for baudrate change\n");
+					tim_info("    Contains code for baudrate change\n");
 			}
 
 			if (disasm) {
-				printf("    Code (%u instructions):\n", ninst);
+				tim_info("    Code (%u instructions):\n", ninst);
 				disassemble("\t", code, len / 4);
 			}
 		}
@@ -489,15 +925,14 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 		die("Invalid TIM length (%u, expected %u)", tim->size,
 		    tim_size(timhdr));
 
-	platds = (void *) reserved_area(timhdr) + sizeofreserved;
-	if (timhdr->trusted)
-		printf("Platform digital signature algorithm %s, key size %u "
-		       "bits, hash %s\n", dsalg2name(le32toh(platds->dsalg)),
-		       le32toh(platds->keysize),
-		       hash2name(le32toh(platds->hashalg)));
+	if (v.platds)
+		tim_info("Platform digital signature algorithm %s, key size %u "
+		       "bits, hash %s\n", dsalg2name(le32toh(v.platds->dsalg)),
+		       le32toh(v.platds->keysize),
+		       hash2name(le32toh(v.platds->hashalg)));
 
-	start = (imginfo_t *) (timhdr + 1);
-	end = start + numimages;
+	start = v.images;
+	end = start + v.nimages;
 	for (i = start; i < end; ++i) {
 		u32 id, size, hashalg, sizetohash, hash[16];
 		image_t *img;
@@ -512,14 +947,14 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 		    (i + 1 == end || (i + 1)->id != i->nextid))
 			die("Next image ID check failed");
 
-		img = image_find(id);
+		img = id == tim->id ? tim : image_find(id);
 		if (img->size != size && sizetohash)
 			die("Wrong length of %s image (%u, expected %u)",
 			    id2name(id), img->size, size);
 
 		nohash = !memcmp(i->hash, zerohash, sizeof(zerohash));
 
-		printf("Found %s, hash %s%s, encryption %s, size %u, load 0x%08x, flash 0x%08x\n",
+		tim_info("Found %s, hash %s%s, encryption %s, size %u, load 0x%08x, flash 0x%08x\n",
 		       id2name(id), hash2name(hashalg),
 		       nohash ? " (hash zeroed)" : "",
 		       enc2name(le32toh(i->encalg)),
@@ -534,36 +969,39 @@ void tim_parse(image_t *tim, int *numimagesp, int disasm,
 		else if (sizetohash > size)
 			sizetohash = size;
 
-		image_hash(hashalg, img->data, sizetohash, hash,
-			   id == tim->id ? (u8 *) &i->hash[0] - tim->data : -1U);
+		/* digests of whole images are usually known from image_load() */
+		if (id != tim->id && sizetohash == img->size) {
+			image_precompute_hash(img, hashalg);
+			image_digest(img, hashalg, hash);
+		} else {
+			if (id != tim->id)
+				image_wait(img, sizetohash);
+			image_hash(hashalg, img->data, sizetohash, hash,
+				   id == tim->id ? (u8 *) &i->hash[0] - tim->data :
+						   -1U);
+		}
 
 		if (memcmp(hash, i->hash, sizeof(hash)))
 			die("Hash check failed for %s", id2name(id));
 	}
 
-	printf("\n");
+	if (v.platds)
+		tim_check_signature(tim, &v);
+
+	tim_info("\n");
 
 	if (numimagesp)
 		*numimagesp = numimages;
 }
 
-static void tim_grow(image_t *tim, u32 growby)
-{
-	image_t oldtim;
-
-	oldtim = *tim;
-	tim->data = xmalloc(oldtim.size + growby);
-	memcpy(tim->data, oldtim.data, oldtim.size);
-	tim->size += growby;
-
-	free(oldtim.data);
-}
-
 void tim_enable_hash(image_t *tim, u32 id, int enable)
 {
 	imginfo_t *img;
+	tim_view_t v;
 
-	img = tim_find_image(tim, id);
+	tim_view(&v, tim);
+
+	img = tim_view_image(&v, id);
 	if (img) {
 		if (enable) {
 			img->sizetohash = img->size ? img->size : 1;
@@ -609,16 +1047,19 @@ void tim_rehash(image_t *tim)
 	timhdr_t *timhdr;
 	int i;
 	imginfo_t *img;
+	tim_view_t v;
 	u32 sizetohash, id;
 
-	timhdr = (void *) tim->data;
+	tim_view(&v, tim);
+
+	timhdr = v.hdr;
 	sizetohash = getsizetohash(timhdr);
 	timhdr->issuedate = tim_issuedate_now();
 
-	for (i = 0; i < tim_nimages(timhdr); ++i) {
+	for (i = 0; i < v.nimages; ++i) {
 		image_t *image;
 
-		img = tim_image(timhdr, i);
+		img = &v.images[i];
 
 		id = le32toh(img->id);
 		if (id == tim->id)
@@ -630,12 +1071,11 @@ void tim_rehash(image_t *tim)
 			memset(img->hash, 0, sizeof(img->hash));
 		} else {
 			img->sizetohash = htole32(image->size);
-			image_hash(le32toh(img->hashalg), image->data,
-				   image->size, img->hash, -1U);
+			image_digest(image, le32toh(img->hashalg), img->hash);
 		}
 	}
 
-	img = tim_find_image(tim, tim->id);
+	img = tim_view_image(&v, tim->id);
 	if (img) {
 		img->size = htole32(tim->size);
 		img->sizetohash = htole32(sizetohash);
@@ -648,145 +1088,91 @@ void tim_rehash(image_t *tim)
 	}
 }
 
-void tim_set_boot(image_t *tim, u32 boot)
+static u32 image_unpadded_size(const image_t *image)
 {
-	timhdr_t *timhdr = (void *) tim->data;
+	u32 size = image->size;
+	u8 pad;
 
-	timhdr->bootflashsign = htole32(boot);
-	tim_rehash(tim);
-}
+	if (!size || !image->data)
+		return size;
 
-void tim_add_image(image_t *tim, image_t *image, u32 after, u32 loadaddr,
-		   u32 flashaddr, u32 partition, int hash)
-{
-	timhdr_t *timhdr;
-	imginfo_t *timinfo, *prev, *this, *next;
-	int i;
-	u32 oldtimsize;
+	pad = image->data[size - 1];
+	if (pad != 0x00 && pad != 0xff)
+		return size;
 
-	oldtimsize = tim->size;
-	tim_grow(tim, sizeof(imginfo_t));
+	while (size && image->data[size - 1] == pad)
+		--size;
 
-	timinfo = prev = NULL;
-
-	timhdr = (timhdr_t *) tim->data;
-	for (i = 0; i < tim_nimages(timhdr); ++i) {
-		imginfo_t *img;
-
-		img = tim_image(timhdr, i);
-
-		if (le32toh(img->id) == tim->id)
-			timinfo = img;
-
-		if (le32toh(img->id) == after)
-			prev = img;
-	}
+	/* keep the image size a non-zero multiple of 4 */
+	size = (size + 3) & ~3U;
+	if (!size)
+		size = 4;
 
-	if (!prev)
-		die("Cannot add imginfo if no imginfo exists!");
+	/*
+	 * Only consider the tail padding if it is long enough, so that images
+	 * which just happen to end with some zero bytes are left alone.
+	 */
+	if (size + 4096 > image->size)
+		return image->size;
 
-	this = prev + 1;
-	next = prev + 2;
-	memmove(next, this, oldtimsize - ((void *) this - (void *) timhdr));
-
-	memset(this, 0, sizeof(imginfo_t));
-	this->id = htole32(image->id);
-	this->nextid = prev->nextid;
-	prev->nextid = this->id;
-	this->size = htole32(image->size);
-	this->flashentryaddr = htole32(flashaddr);
-	this->partitionnumber = htole32(partition);
-	this->loadaddr = htole32(loadaddr);
-	this->hashalg = htole32(HASH_SHA512);
-	this->sizetohash = hash ? this->size : 0;
-
-	timhdr->numimages = htole32(tim_nimages(timhdr) + 1);
-
-	if (timinfo) {
-		timinfo->size = htole32(tim->size);
-		timinfo->sizetohash = timinfo->size;
-	}
+	return size;
 }
 
-static void tim_add_pkgs(image_t *tim, int npkgs, void *pkgs, size_t size)
+/*
+ * Drop trailing 0x00 / 0xff padding from images referenced by the TIM, so that
+ * it does not have to be sent over UART. The size and hash of the images in
+ * the TIM need to change, so images of trusted (signed) TIMs are left alone.
+ */
+void tim_strip_padding(image_t *tim)
 {
-	u32 sizeofreserved, toadd;
 	timhdr_t *timhdr;
-	reshdr_t *reshdr;
-	respkg_t *pkg;
-	void *oldend;
-
-	timhdr = (timhdr_t *) tim->data;
-	reshdr = reserved_area(timhdr);
-	sizeofreserved = le32toh(timhdr->sizeofreserved);
-
-	toadd = size;
-	if (!sizeofreserved)
-		toadd += sizeof(reshdr_t) + SIZEOF_RESPKG_HDR;
-
-	tim_grow(tim, toadd);
-	oldend = tim->data + tim->size - toadd;
-
-	timhdr = (timhdr_t *) tim->data;
-	reshdr = reserved_area(timhdr);
-
-	if (!sizeofreserved) {
-		/* add toadd bytes for reserved area */
-		memmove(((void *) reshdr) + toadd, reshdr,
-			oldend - (void *) reshdr);
+	imginfo_t *img;
+	int i, rehash = 0;
 
-		/* add reserved area header */
-		reshdr->id = htole32(RES_ID);
-		reshdr->pkgs = htole32(npkgs + 1);
+	timhdr = (void *) tim->data;
 
-		/* add packages */
-		memcpy(reshdr + 1, pkgs, size);
+	if (timhdr->trusted) {
+		printf("Not stripping padding from images of trusted %s\n",
+		       id2name(tim->id));
+		return;
+	}
 
-		/* add Term package */
-		pkg = ((void *) reshdr) + size;
-		pkg->id = htole32(PKG_Term);
-		pkg->size = htole32(SIZEOF_RESPKG_HDR);
-	} else {
-		respkg_t *lastpkg = NULL;
-		int has_term = 0;
-
-		/* find last package */
-		for (pkg = firstpkg(timhdr); pkg; pkg = nextpkg(timhdr, pkg)) {
-			lastpkg = pkg;
-			if (le32toh(pkg->id) == PKG_Term) {
-				has_term = 1;
-				break;
-			}
-		}
+	for (i = 0; i < tim_nimages(timhdr); ++i) {
+		image_t *image;
+		u32 id, size;
 
-		/* if last package was not found, use end of reserved area */
-		if (!lastpkg)
-			lastpkg = (void *) (reshdr + 1);
+		img = tim_image(timhdr, i);
+		id = le32toh(img->id);
 
-		/* add toadd bytes for reserved area */
-		memmove(((void *) lastpkg) + toadd, lastpkg,
-			oldend - (void *) lastpkg);
+		if (id == tim->id)
+			continue;
 
-		/* add packages */
-		memcpy(lastpkg, pkgs, size);
+		image = image_find(id);
+		size = image_unpadded_size(image);
+		if (size == image->size)
+			continue;
 
-		/* add Term package if it was there */
-		if (has_term) {
-			pkg = ((void *) lastpkg) + size;
-			pkg->id = htole32(PKG_Term);
-			pkg->size = htole32(SIZEOF_RESPKG_HDR);
-		}
+		printf("Stripping %u bytes of padding from %s image\n",
+		       image->size - size, id2name(id));
 
-		/* change reserved area header */
-		reshdr->pkgs = htole32(le32toh(reshdr->pkgs) + npkgs);
+		image->size = size;
+		img->size = htole32(size);
+		rehash = 1;
 	}
 
-	timhdr->sizeofreserved = htole32(sizeofreserved + toadd);
+	if (rehash)
+		tim_rehash(tim);
+}
 
+void tim_set_boot(image_t *tim, u32 boot)
+{
+	timhdr_t *timhdr = (void *) tim->data;
+
+	timhdr->bootflashsign = htole32(boot);
 	tim_rehash(tim);
 }
 
-static void tim_add_cidp_pkg(image_t *tim, const char *consumer, int npkgs, ...)
+static respkg_t *cidp_pkg(const char *consumer, int npkgs, ...)
 {
 	respkg_t *pkg;
 	u32 size = 4 * (5 + npkgs);
@@ -807,52 +1193,7 @@ static void tim_add_cidp_pkg(image_t *tim, const char *consumer, int npkgs, ...)
 	}
 	va_end(ap);
 
-	tim_add_pkgs(tim, 1, pkg, size);
-
-	free(pkg);
-}
-
-static void tim_append_gpp_code(image_t *tim, const char *name, void *code,
-				size_t codesize)
-{
-	void *oldend, *codeend;
-	timhdr_t *timhdr;
-	respkg_t *pkg;
-
-	if (codesize & 3)
-		die("GPP code length must be a multiple of 4!");
-
-	timhdr = (timhdr_t *) tim->data;
-
-	tim_grow(tim, codesize);
-	oldend = tim->data + tim->size - codesize;
-
-	timhdr = (timhdr_t *) tim->data;
-
-	/* find the package */
-	for (pkg = firstpkg(timhdr); pkg; pkg = nextpkg(timhdr, pkg))
-		if (pkg->id == htole32(name2id(name)))
-			break;
-
-	if (!pkg)
-		die("Package %s not found!", name);
-
-
-	/* make place at the end of the package for new code */
-	codeend = ((void *) pkg) + le32toh(pkg->size);
-	memmove(codeend + codesize, codeend, oldend - codeend);
-
-	/* append code */
-	memcpy(codeend, code, codesize);
-	pkg->gpp.ninst = htole32(le32toh(pkg->gpp.ninst) +
-				 disassemble(NULL, code, codesize / 4));
-
-	/* change size members and rehash */
-	pkg->size = htole32(le32toh(pkg->size) + codesize);
-	timhdr->sizeofreserved = htole32(le32toh(timhdr->sizeofreserved) +
-						 codesize);
-
-	tim_rehash(tim);
+	return pkg;
 }
 
 #include "gpp/uart_baudrate_change.c"
@@ -860,18 +1201,24 @@ static void tim_append_gpp_code(image_t *tim, const char *name, void *code,
 
 void tim_inject_baudrate_change_support(image_t *tim)
 {
+	struct tim_builder b;
+
 	printf("Injecting baudrate change code into GPP packages\n\n");
-	tim_append_gpp_code(tim, "DDR3", GPP_uart_baudrate_change,
-			    GPP_uart_baudrate_change_size);
-	tim_append_gpp_code(tim, "GPP2", GPP_uart_baudrate_change_back,
-			    GPP_uart_baudrate_change_back_size);
+
+	tim_builder_load(&b, tim);
+	tim_builder_append_gpp_code(&b, "DDR3", GPP_uart_baudrate_change,
+				    GPP_uart_baudrate_change_size);
+	tim_builder_append_gpp_code(&b, "GPP2", GPP_uart_baudrate_change_back,
+				    GPP_uart_baudrate_change_back_size);
+	tim_builder_finish(&b, tim);
+
+	tim_rehash(tim);
 }
 
-static void tim_add_gpp_pkg(image_t *tim, const char *name, void *code,
-			    size_t codesize, int init_ddr,
-			    int enable_memtest, u32 memtest_start,
-			    u32 memtest_size, int init_attempts,
-			    int ignore_timeouts_op, int ignore_timeouts_val)
+static respkg_t *gpp_pkg(const char *name, void *code, size_t codesize,
+			 int init_ddr, int enable_memtest, u32 memtest_start,
+			 u32 memtest_size, int init_attempts,
+			 int ignore_timeouts_op, int ignore_timeouts_val)
 {
 	respkg_t *pkg;
 	struct gpp_op *op;
@@ -896,7 +1243,7 @@ static void tim_add_gpp_pkg(image_t *tim, const char *name, void *code,
 	pkg->id = htole32(name2id(name));
 	pkg->size = htole32(size);
 	pkg->gpp.nops = htole32(nops);
-	pkg->gpp.ninst = htole32(disassemble(NULL, code, codesize / 4));
+	pkg->gpp.ninst = htole32(gpp_count(code, codesize / 4));
 
 	op = &pkg->gpp.ops[0];
 
@@ -932,54 +1279,7 @@ static void tim_add_gpp_pkg(image_t *tim, const char *name, void *code,
 
 	memcpy(op, code, codesize);
 
-	tim_add_pkgs(tim, 1, pkg, size);
-
-	free(pkg);
-}
-
-static void key_hash(u32 alg, u32 *hash, const u32 *x, const u32 *y, int pad)
-{
-	u32 buf[129];
-
-	memset(buf, 0, sizeof(buf));
-	if (alg == HASH_SHA512)
-		buf[0] = htole32(SIG_SCHEME_ECDSA_P521_SHA512);
-	else
-		buf[0] = htole32(SIG_SCHEME_ECDSA_P521_SHA256);
-	memcpy(&buf[1], x, 68);
-	memcpy(&buf[18], y, 68);
-
-	image_hash(alg, buf, pad ? sizeof(buf) : 140, hash, -1U);
-}
-
-void tim_add_key(image_t *tim, u32 id, EC_KEY *key)
-{
-	timhdr_t *timhdr;
-	keyinfo_t *keyinfo;
-	u32 oldtimsize;
-
-	oldtimsize = tim->size;
-	tim_grow(tim, sizeof(keyinfo_t));
-	timhdr = (timhdr_t *) tim->data;
-
-	keyinfo = ((void *) (timhdr + 1))
-		  + sizeof(imginfo_t) * tim_nimages(timhdr)
-		  + sizeof(keyinfo_t) * tim_nkeys(timhdr);
-
-	memmove(keyinfo + 1, keyinfo,
-		oldtimsize - ((void *) keyinfo - (void *) timhdr));
-
-	timhdr->numkeys = htole32(le32toh(timhdr->numkeys) + 1);
-
-	memset(keyinfo, 0, sizeof(keyinfo_t));
-	keyinfo->id = htole32(id);
-	keyinfo->hashalg = htole32(HASH_SHA256);
-	keyinfo->size = htole32(521);
-	keyinfo->publickeysize = htole32(521);
-	keyinfo->encryptalg = htole32(DSALG_ECDSA_521);
-	key_get_tim_coords(key, keyinfo->ECDSAcompx, keyinfo->ECDSAcompy);
-	key_hash(HASH_SHA256, keyinfo->hash, keyinfo->ECDSAcompx,
-		 keyinfo->ECDSAcompy, 0);
+	return pkg;
 }
 
 void tim_get_otp_hash(image_t *tim, u32 *hash)
@@ -999,17 +1299,21 @@ void tim_get_otp_hash(image_t *tim, u32 *hash)
 	memcpy(hash, tmp, 32);
 }
 
-void tim_sign(image_t *tim, EC_KEY *key)
+void tim_sign(image_t *tim, const signkey_t *key)
 {
-	const BIGNUM *sigr, *sigs;
-	ECDSA_SIG *sig;
 	timhdr_t *timhdr;
 	platds_t *platds;
 	u32 hash[16];
 
 	timhdr = (void *) tim->data;
-	if (!timhdr->trusted)
-		tim_grow(tim, sizeof(platds_t));
+	if (!timhdr->trusted) {
+		struct tim_builder b;
+
+		/* adds zeroed platform digital signature */
+		tim_builder_load(&b, tim);
+		b.hdr.trusted = htole32(1);
+		tim_builder_finish(&b, tim);
+	}
 
 	timhdr = (void *) tim->data;
 	platds = (void *) tim->data + tim->size - sizeof(platds_t);
@@ -1023,16 +1327,11 @@ void tim_sign(image_t *tim, EC_KEY *key)
 	platds->hashalg = htole32(HASH_SHA256);
 	platds->keysize = htole32(521);
 
-	key_get_tim_coords(key, platds->ECDSA.pub.x, platds->ECDSA.pub.y);
+	memcpy(platds->ECDSA.pub.x, key->x, sizeof(key->x));
+	memcpy(platds->ECDSA.pub.y, key->y, sizeof(key->y));
 
 	image_hash(HASH_SHA256, tim->data, (u8 *) &platds->ECDSA.sig - tim->data,
 		   hash, -1U);
 
-	sig = ECDSA_do_sign((void *) hash, 32, key);
-	if (!sig)
-		die("Could not sign");
-
-	ECDSA_SIG_get0(sig, &sigr, &sigs);
-	bn2tim(sigr, platds->ECDSA.sig.r, 17);
-	bn2tim(sigs, platds->ECDSA.sig.s, 17);
+	key_sign(key, hash, 32, platds->ECDSA.sig.r, platds->ECDSA.sig.s);
 }
@@ -10,6 +10,7 @@
 #include <openssl/ec.h>
 #include "utils.h"
 #include "images.h"
+#include "key.h"
 
 #define TIMH_ID name2id("TIMH")
 #define TIMN_ID name2id("TIMN")
@@ -163,6 +164,47 @@ typedef struct {
 	};
 } platds_t;
 
+#define TIM_MAX_IMAGES	16
+#define TIM_MAX_KEYS	8
+#define TIM_MAX_PKGS	32
+#define TIM_INDEX_BITS	6
+
+/*
+ * Read-only view of a TIM with pointers to all its parts, validated once.
+ * Images and reserved area packages are indexed by ID in small open addressing
+ * tables (slot holds array index + 1, 0 means empty).
+ */
+typedef struct {
+	timhdr_t *hdr;
+	imginfo_t *images;
+	keyinfo_t *keys;
+	reshdr_t *reshdr;
+	respkg_t *pkgs[TIM_MAX_PKGS];
+	u32 pkgids[TIM_MAX_PKGS];
+	platds_t *platds;
+	int nimages, nkeys, npkgs;
+	u8 imgidx[1 << TIM_INDEX_BITS];
+	u8 pkgidx[1 << TIM_INDEX_BITS];
+} tim_view_t;
+
+/*
+ * TIM builder: the TIM is taken apart into structured form, modified, and
+ * serialized once into a single new allocation by tim_builder_finish(), instead
+ * of growing the TIM buffer and moving its tail for every added part. Packages
+ * not marked as owned point into the TIM the builder was loaded from.
+ */
+struct tim_builder {
+	u32 id;
+	timhdr_t hdr;
+	imginfo_t images[TIM_MAX_IMAGES];
+	keyinfo_t keys[TIM_MAX_KEYS];
+	respkg_t *pkgs[TIM_MAX_PKGS];
+	u8 owned[TIM_MAX_PKGS];
+	platds_t platds;
+	int nimages, nkeys, npkgs;
+	int reserved;
+};
+
 static inline const char *hash2name(u32 hash)
 {
 	switch (hash) {
@@ -286,23 +328,38 @@ static inline int tim_is_trusted(const image_t *tim)
 	return !!timhdr->trusted;
 }
 
+extern void tim_view(tim_view_t *v, const image_t *tim);
+extern imginfo_t *tim_view_image(const tim_view_t *v, u32 id);
+extern respkg_t *tim_view_pkg(const tim_view_t *v, u32 id);
+extern u32 tim_view_imap_addr(const tim_view_t *v, u32 id);
+extern void tim_builder_load(struct tim_builder *b, const image_t *tim);
+extern void tim_builder_minimal(struct tim_builder *b, int trusted, u32 id,
+				int support_fastmode);
+extern void tim_builder_set_boot(struct tim_builder *b, u32 boot);
+extern void tim_builder_set_loadaddr(struct tim_builder *b, u32 id,
+				     u32 loadaddr);
+extern void tim_builder_imap_set(struct tim_builder *b, u32 id, u32 flashentry,
+				 u32 partition);
+extern void tim_builder_add_image(struct tim_builder *b, image_t *image,
+				  u32 after, u32 loadaddr, u32 flashaddr,
+				  u32 partition, int hash);
+extern void tim_builder_add_key(struct tim_builder *b, u32 id,
+				const signkey_t *key);
+extern void tim_builder_add_pkg(struct tim_builder *b, respkg_t *pkg);
+extern void tim_builder_finish(struct tim_builder *b, image_t *tim);
 extern void tim_image_set_loadaddr(image_t *tim, u32 id, u32 loadaddr);
 extern u32 tim_imap_pkg_addr(image_t *tim, u32 id);
-extern void tim_imap_pkg_addr_set(image_t *tim, u32 id, u32 flashentry,
-				  u32 partition);
+extern void tim_set_quiet(int quiet);
+extern void tim_check_key_chain(image_t *timh, image_t *timn);
 extern void tim_parse(image_t *tim, int *numimagesp, int disasm,
 		      int *supports_baudrate_change);
 extern void tim_enable_hash(image_t *tim, u32 id, int enable);
 extern void tim_rehash(image_t *tim);
+extern void tim_strip_padding(image_t *tim);
 extern void tim_inject_baudrate_change_support(image_t *tim);
 extern void tim_get_otp_hash(image_t *tim, u32 *hash);
-extern void tim_sign(image_t *tim, EC_KEY *key);
+extern void tim_sign(image_t *tim, const signkey_t *key);
 extern void tim_set_boot(image_t *tim, u32 boot);
 extern void tim_remove_image(image_t *tim, u32 id);
-extern void tim_add_image(image_t *tim, image_t *image, u32 after, u32 loadaddr,
-			  u32 flashaddr, u32 partition, int hash);
-extern void tim_add_key(image_t *tim, u32 id, EC_KEY *key);
-extern void tim_minimal_image(image_t *tim, int trusted, u32 id,
-			      int support_fastmode);
 
 #endif /* _TIM_H_ */
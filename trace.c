@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: Beerware
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "trace.h"
+#include "utils.h"
+
+/* CLOCK_MONOTONIC, as used for the condition variable deadlines */
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		die("Cannot get time: %m");
+
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Recording */
+
+struct recorder {
+	transport_t *inner;
+	const char *path;
+	FILE *fp;
+	u64 last;
+	pthread_mutex_t lock;
+};
+
+static void put_varint(FILE *fp, u64 val)
+{
+	while (val >= 0x80) {
+		fputc(val | 0x80, fp);
+		val >>= 7;
+	}
+	fputc(val, fp);
+}
+
+static void record(transport_t *t, enum trace_type type, const void *buf,
+		   size_t len)
+{
+	struct recorder *r = t->priv;
+	u64 ts;
+
+	pthread_mutex_lock(&r->lock);
+
+	ts = now_us();
+	fputc(type, r->fp);
+	put_varint(r->fp, ts - r->last);
+	put_varint(r->fp, len);
+	fwrite(buf, 1, len, r->fp);
+	r->last = ts;
+
+	if (ferror(r->fp))
+		die("Cannot write to %s: %m", r->path);
+
+	pthread_mutex_unlock(&r->lock);
+}
+
+static ssize_t rec_read(transport_t *t, void *buf, size_t len)
+{
+	struct recorder *r = t->priv;
+	ssize_t rd;
+
+	rd = r->inner->read(r->inner, buf, len);
+	if (rd > 0)
+		record(t, TRACE_RX, buf, rd);
+
+	return rd;
+}
+
+static ssize_t rec_write(transport_t *t, const void *buf, size_t len)
+{
+	struct recorder *r = t->priv;
+	ssize_t wr;
+
+	wr = r->inner->write(r->inner, buf, len);
+	if (wr > 0)
+		record(t, TRACE_TX, buf, wr);
+
+	return wr;
+}
+
+static void rec_drain(transport_t *t)
+{
+	struct recorder *r = t->priv;
+
+	r->inner->drain(r->inner);
+}
+
+static void rec_flush(transport_t *t, int queues)
+{
+	struct recorder *r = t->priv;
+
+	r->inner->flush(r->inner, queues);
+}
+
+static void rec_set_baudrate(transport_t *t, unsigned int baudrate)
+{
+	struct recorder *r = t->priv;
+	u32 val = htole32(baudrate);
+
+	r->inner->set_baudrate(r->inner, baudrate);
+	record(t, TRACE_BAUD, &val, sizeof(val));
+}
+
+static void rec_mark(transport_t *t, const char *phase)
+{
+	struct recorder *r = t->priv;
+
+	record(t, TRACE_PHASE, phase, strlen(phase));
+	if (r->inner->mark)
+		r->inner->mark(r->inner, phase);
+}
+
+static void rec_close(transport_t *t)
+{
+	struct recorder *r = t->priv;
+
+	r->inner->close(r->inner);
+
+	if (fclose(r->fp))
+		fprintf(stderr, "Cannot write to %s: %m\n", r->path);
+
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+	free(t);
+}
+
+/*
+ * Wrap transport t so that all traffic, baudrate changes and phase markers are
+ * recorded into trace file path.
+ */
+transport_t *trace_record(transport_t *t, const char *path)
+{
+	struct recorder *r;
+	transport_t *rt;
+	u32 hdr[2];
+
+	r = xmalloc(sizeof(*r));
+	r->inner = t;
+	r->path = path;
+	r->fp = fopen(path, "w");
+	if (!r->fp)
+		die("Cannot open %s for writing: %m", path);
+	pthread_mutex_init(&r->lock, NULL);
+
+	hdr[0] = htole32(TRACE_MAGIC);
+	hdr[1] = htole32(TRACE_VERSION);
+	if (fwrite(hdr, sizeof(hdr), 1, r->fp) != 1)
+		die("Cannot write to %s: %m", path);
+	r->last = now_us();
+
+	rt = xmalloc(sizeof(*rt));
+	*rt = *t;
+	rt->read = rec_read;
+	rt->write = rec_write;
+	rt->drain = rec_drain;
+	rt->flush = rec_flush;
+	rt->set_baudrate = t->set_baudrate ? rec_set_baudrate : NULL;
+	rt->mark = rec_mark;
+	/* sent data must go through rec_write to be recorded */
+	rt->sendfile = NULL;
+	rt->close = rec_close;
+	rt->priv = r;
+
+	return rt;
+}
+
+/* Replay */
+
+struct trace_rec {
+	u8 type;
+	u64 time;
+	u32 len;
+	const u8 *data;
+};
+
+struct replay {
+	u8 *file;
+	struct trace_rec *recs;
+	int nrecs;
+	int fast;
+	int wfd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* host side progress, protected by lock */
+	int closed;
+	int phase;
+	u64 tx;
+	u64 rx_read;
+	u64 rx_written;
+};
+
+static int get_varint(const u8 **p, const u8 *end, u64 *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		u8 c = *(*p)++;
+
+		*val |= (u64)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 0;
+	}
+
+	return -1;
+}
+
+static void trace_load(struct replay *r, const char *path)
+{
+	const u8 *p, *end;
+	size_t size, alloc;
+	u64 time, dt, len;
+	FILE *fp;
+	int n;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		die("Cannot open %s: %m", path);
+
+	size = 0;
+	alloc = 65536;
+	r->file = xmalloc(alloc);
+	while ((n = fread(r->file + size, 1, alloc - size, fp)) > 0) {
+		size += n;
+		if (size == alloc) {
+			alloc *= 2;
+			r->file = xrealloc(r->file, alloc);
+		}
+	}
+
+	if (ferror(fp))
+		die("Cannot read %s: %m", path);
+	fclose(fp);
+
+	if (size < 8 || le32toh(((u32 *)r->file)[0]) != TRACE_MAGIC)
+		die("%s is not a session trace", path);
+	if (le32toh(((u32 *)r->file)[1]) != TRACE_VERSION)
+		die("Unsupported session trace version %u",
+		    le32toh(((u32 *)r->file)[1]));
+
+	p = r->file + 8;
+	end = r->file + size;
+	time = 0;
+	alloc = 0;
+	r->recs = NULL;
+	r->nrecs = 0;
+
+	while (p < end) {
+		struct trace_rec *rec;
+		u8 type = *p++;
+
+		if (get_varint(&p, end, &dt) || get_varint(&p, end, &len) ||
+		    len > (u64)(end - p) || type < TRACE_RX ||
+		    type > TRACE_PHASE)
+			die("Corrupted session trace %s", path);
+
+		if (r->nrecs == (int)alloc) {
+			alloc = alloc ? 2 * alloc : 1024;
+			r->recs = xrealloc(r->recs, alloc * sizeof(*r->recs));
+		}
+
+		time += dt;
+		rec = &r->recs[r->nrecs++];
+		rec->type = type;
+		rec->time = time;
+		rec->len = len;
+		rec->data = p;
+		p += len;
+	}
+}
+
+/* wait on condition until absolute time deadline (in microseconds) */
+static void replay_wait_until(struct replay *r, u64 deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+
+	while (!r->closed &&
+	       pthread_cond_timedwait(&r->cond, &r->lock, &ts) != ETIMEDOUT);
+}
+
+/*
+ * Plays the board side of the trace. Data received from the board is sent to
+ * the host one record at a time, after the host consumed the previous record,
+ * so that the host sees the same read boundaries as in the recorded session.
+ * Data written by the host is only counted: each TX record is a
+ * synchronization point at which the host must have written at least as many
+ * bytes in the current phase as in the recorded session. Phase markers
+ * synchronize the host and the trace, and in timed mode, RX records are sent
+ * with the recorded delay since the last synchronization point.
+ */
+static void *replay_thread(void *arg)
+{
+	struct replay *r = arg;
+	u64 expected, anchor, anchor_trace;
+	int i, phase;
+	ssize_t ret;
+
+	expected = 0;
+	phase = 0;
+	anchor = now_us();
+	anchor_trace = 0;
+
+	pthread_mutex_lock(&r->lock);
+
+	for (i = 0; i < r->nrecs && !r->closed; ++i) {
+		struct trace_rec *rec = &r->recs[i];
+
+		switch (rec->type) {
+		case TRACE_PHASE:
+			++phase;
+			expected = 0;
+			while (!r->closed && r->phase < phase)
+				pthread_cond_wait(&r->cond, &r->lock);
+			anchor = now_us();
+			anchor_trace = rec->time;
+			break;
+
+		case TRACE_TX:
+			expected += rec->len;
+			while (!r->closed && r->phase == phase &&
+			       r->tx < expected)
+				pthread_cond_wait(&r->cond, &r->lock);
+			anchor = now_us();
+			anchor_trace = rec->time;
+			break;
+
+		case TRACE_RX:
+			while (!r->closed && r->rx_read < r->rx_written)
+				pthread_cond_wait(&r->cond, &r->lock);
+
+			if (!r->fast)
+				replay_wait_until(r, anchor + rec->time -
+						     anchor_trace);
+
+			if (r->closed)
+				break;
+
+			pthread_mutex_unlock(&r->lock);
+			ret = send(r->wfd, rec->data, rec->len, MSG_NOSIGNAL);
+			pthread_mutex_lock(&r->lock);
+
+			if (ret != (ssize_t)rec->len)
+				r->closed = 1;
+			r->rx_written += rec->len;
+			break;
+		}
+	}
+
+	/* let the host read the rest before signalling end of stream */
+	while (!r->closed && r->rx_read < r->rx_written)
+		pthread_cond_wait(&r->cond, &r->lock);
+
+	pthread_mutex_unlock(&r->lock);
+
+	shutdown(r->wfd, SHUT_WR);
+
+	return NULL;
+}
+
+static ssize_t replay_read(transport_t *t, void *buf, size_t len)
+{
+	struct replay *r = t->priv;
+	ssize_t rd;
+
+	rd = read(t->fd, buf, len);
+	if (rd > 0) {
+		pthread_mutex_lock(&r->lock);
+		r->rx_read += rd;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	return rd;
+}
+
+static ssize_t replay_write(transport_t *t, const void *buf, size_t len)
+{
+	struct replay *r = t->priv;
+
+	pthread_mutex_lock(&r->lock);
+	r->tx += len;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	return len;
+}
+
+static void replay_mark(transport_t *t, const char *phase)
+{
+	struct replay *r = t->priv;
+
+	pthread_mutex_lock(&r->lock);
+	r->phase++;
+	r->tx = 0;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * The data the host flushed during the recorded session was never read and
+ * so is not in the trace.
+ */
+static void replay_flush(transport_t *t, int queues)
+{
+}
+
+static void replay_drain(transport_t *t)
+{
+}
+
+static void replay_set_baudrate(transport_t *t, unsigned int baudrate)
+{
+}
+
+static void replay_close(transport_t *t)
+{
+	struct replay *r = t->priv;
+
+	pthread_mutex_lock(&r->lock);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	close(t->fd);
+	pthread_join(r->thread, NULL);
+	close(r->wfd);
+
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->recs);
+	free(r->file);
+	free(r);
+	free(t);
+}
+
+/*
+ * Open a replay transport given by spec:
+ *   replay:FILE       play the board side of a trace with recorded timing
+ *   replay-fast:FILE  play it as fast as the host consumes it
+ * Returns NULL if spec is not a replay specification.
+ */
+transport_t *transport_open_replay(const char *spec)
+{
+	pthread_condattr_t attr;
+	struct replay *r;
+	transport_t *t;
+	int fds[2], ret;
+
+	r = xmalloc(sizeof(*r));
+	memset(r, 0, sizeof(*r));
+
+	if (!strncmp(spec, "replay:", 7)) {
+		trace_load(r, spec + 7);
+	} else if (!strncmp(spec, "replay-fast:", 12)) {
+		trace_load(r, spec + 12);
+		r->fast = 1;
+	} else {
+		free(r);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		die("Cannot create socket pair: %m");
+	r->wfd = fds[1];
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	t->name = spec;
+	t->fd = fds[0];
+	t->is_serial = 1;
+	t->read = replay_read;
+	t->write = replay_write;
+	t->drain = replay_drain;
+	t->flush = replay_flush;
+	t->set_baudrate = replay_set_baudrate;
+	t->mark = replay_mark;
+	t->close = replay_close;
+	t->priv = r;
+
+	ret = pthread_create(&r->thread, NULL, replay_thread, r);
+	if (ret) {
+		errno = ret;
+		die("pthread_create failed: %m");
+	}
+
+	return t;
+}
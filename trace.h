@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "transport.h"
+#include "utils.h"
+
+/*
+ * Session trace file format:
+ *   u32 magic, u32 version (little endian)
+ *   records until end of file:
+ *     u8 type
+ *     varint microseconds since previous record (since start for first one)
+ *     varint payload length
+ *     payload
+ *
+ * Varints are unsigned LEB128. Payload of TRACE_RX / TRACE_TX records is the
+ * data read from / written to the board, of TRACE_BAUD a little endian u32
+ * baudrate and of TRACE_PHASE the phase name.
+ */
+#define TRACE_MAGIC	name2id("MOXT")
+#define TRACE_VERSION	1
+
+enum trace_type {
+	TRACE_RX = 1,
+	TRACE_TX,
+	TRACE_BAUD,
+	TRACE_PHASE,
+};
+
+extern transport_t *trace_record(transport_t *t, const char *path);
+extern transport_t *transport_open_replay(const char *spec);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: Beerware
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <endian.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include "transport.h"
+
+/* Telnet commands and options */
+#define IAC		255
+#define DONT		254
+#define DO		253
+#define WONT		252
+#define WILL		251
+#define SB		250
+#define SE		240
+#define OPT_BINARY	0
+#define OPT_SGA		3
+#define OPT_COM_PORT	44
+
+/* RFC 2217 client to server commands, server replies are +100 */
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_PURGE_DATA		12
+#define CPO_REPLY		100
+
+struct telnet {
+	enum {
+		TN_DATA,
+		TN_IAC,
+		TN_OPT,
+		TN_SB,
+		TN_SB_IAC,
+	} state;
+	u8 cmd;
+	u8 sb[16];
+	unsigned int sblen;
+	int baud_acked;
+	u32 baudrate;
+	pthread_mutex_t lock;
+};
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t wr;
+
+	while (len) {
+		wr = write(fd, buf, len);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		else if (wr < 0)
+			return -1;
+
+		buf += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+/* returns number of bytes sent, or -1 if nothing could be sent */
+ssize_t transport_sendfile(transport_t *t, int fd, off_t *offset, size_t len)
+{
+	ssize_t wr;
+	size_t done;
+
+	for (done = 0; done < len; done += wr) {
+		wr = sendfile(t->fd, fd, offset, len - done);
+		if (wr < 0 && errno == EINTR)
+			wr = 0;
+		else if (wr < 0)
+			return done ? (ssize_t)done : -1;
+		else if (!wr)
+			break;
+	}
+
+	return done;
+}
+
+static size_t telnet_input(transport_t *t, u8 *buf, size_t len);
+
+static ssize_t socket_read(transport_t *t, void *buf, size_t len)
+{
+	return read(t->fd, buf, len);
+}
+
+static ssize_t socket_write(transport_t *t, const void *buf, size_t len)
+{
+	if (write_full(t->fd, buf, len))
+		return -1;
+
+	return len;
+}
+
+/*
+ * We cannot know when the remote end transmitted the data on the serial
+ * line, the best we can do is wait until the peer received everything we sent.
+ */
+static void socket_drain(transport_t *t)
+{
+	int i, outq;
+
+	for (i = 0; i < 1000; ++i) {
+		if (ioctl(t->fd, SIOCOUTQ, &outq) < 0 || !outq)
+			break;
+		usleep(1000);
+	}
+}
+
+static void socket_discard_input(transport_t *t)
+{
+	u8 buf[4096];
+	ssize_t rd;
+
+	do {
+		rd = recv(t->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		/* keep track of telnet commands received meanwhile */
+		if (rd > 0 && t->priv)
+			telnet_input(t, buf, rd);
+	} while (rd > 0);
+}
+
+static void socket_flush(transport_t *t, int queues)
+{
+	if (queues & TRANSPORT_FLUSH_RX)
+		socket_discard_input(t);
+}
+
+static void socket_close(transport_t *t)
+{
+	close(t->fd);
+
+	if (t->priv) {
+		pthread_mutex_destroy(&((struct telnet *)t->priv)->lock);
+		free(t->priv);
+	}
+
+	free(t);
+}
+
+static void telnet_send(transport_t *t, const u8 *buf, size_t len)
+{
+	struct telnet *tn = t->priv;
+	int ret;
+
+	pthread_mutex_lock(&tn->lock);
+	ret = write_full(t->fd, buf, len);
+	pthread_mutex_unlock(&tn->lock);
+
+	if (ret)
+		die("Cannot write to %s: %m", t->name);
+}
+
+static void telnet_option(transport_t *t, u8 cmd, u8 opt)
+{
+	u8 reply[3] = { IAC, 0, opt };
+
+	/* refuse everything we did not ask for ourselves */
+	if (cmd == DO && opt != OPT_BINARY && opt != OPT_SGA &&
+	    opt != OPT_COM_PORT)
+		reply[1] = WONT;
+	else if (cmd == WILL && opt != OPT_BINARY && opt != OPT_SGA)
+		reply[1] = DONT;
+	else if (cmd == DONT && opt == OPT_COM_PORT)
+		die("%s does not support RFC 2217", t->name);
+	else
+		return;
+
+	telnet_send(t, reply, sizeof(reply));
+}
+
+static void telnet_subneg(transport_t *t)
+{
+	struct telnet *tn = t->priv;
+
+	if (tn->sblen < 6 || tn->sb[0] != OPT_COM_PORT ||
+	    tn->sb[1] != CPO_REPLY + CPO_SET_BAUDRATE)
+		return;
+
+	tn->baudrate = (tn->sb[2] << 24) | (tn->sb[3] << 16) |
+		       (tn->sb[4] << 8) | tn->sb[5];
+	tn->baud_acked = 1;
+}
+
+/* Strip telnet commands from received data in place, return data length */
+static size_t telnet_input(transport_t *t, u8 *buf, size_t len)
+{
+	struct telnet *tn = t->priv;
+	size_t i, out = 0;
+
+	for (i = 0; i < len; ++i) {
+		u8 c = buf[i];
+
+		switch (tn->state) {
+		case TN_DATA:
+			if (c == IAC)
+				tn->state = TN_IAC;
+			else
+				buf[out++] = c;
+			break;
+
+		case TN_IAC:
+			tn->state = TN_DATA;
+			if (c == IAC) {
+				buf[out++] = c;
+			} else if (c >= WILL) {
+				tn->cmd = c;
+				tn->state = TN_OPT;
+			} else if (c == SB) {
+				tn->sblen = 0;
+				tn->state = TN_SB;
+			}
+			break;
+
+		case TN_OPT:
+			telnet_option(t, tn->cmd, c);
+			tn->state = TN_DATA;
+			break;
+
+		case TN_SB:
+			if (c == IAC)
+				tn->state = TN_SB_IAC;
+			else if (tn->sblen < sizeof(tn->sb))
+				tn->sb[tn->sblen++] = c;
+			break;
+
+		case TN_SB_IAC:
+			if (c == SE) {
+				telnet_subneg(t);
+				tn->state = TN_DATA;
+				break;
+			}
+
+			if (c == IAC && tn->sblen < sizeof(tn->sb))
+				tn->sb[tn->sblen++] = c;
+			tn->state = TN_SB;
+			break;
+		}
+	}
+
+	return out;
+}
+
+static ssize_t rfc2217_read(transport_t *t, void *buf, size_t len)
+{
+	ssize_t rd;
+
+	rd = read(t->fd, buf, len);
+	if (rd <= 0)
+		return rd;
+
+	rd = telnet_input(t, buf, rd);
+	if (!rd) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return rd;
+}
+
+static ssize_t rfc2217_write(transport_t *t, const void *buf, size_t len)
+{
+	struct telnet *tn = t->priv;
+	const u8 *p = buf;
+	u8 *esc;
+	size_t i, elen;
+	int ret;
+
+	esc = xmalloc(2 * len);
+	for (i = 0, elen = 0; i < len; ++i) {
+		esc[elen++] = p[i];
+		if (p[i] == IAC)
+			esc[elen++] = IAC;
+	}
+
+	pthread_mutex_lock(&tn->lock);
+	ret = write_full(t->fd, esc, elen);
+	pthread_mutex_unlock(&tn->lock);
+
+	free(esc);
+
+	return ret ? -1 : (ssize_t)len;
+}
+
+static void rfc2217_command(transport_t *t, u8 cmd, const u8 *val, int len)
+{
+	u8 buf[4 + 2 * 4 + 2];
+	int i, n = 0;
+
+	buf[n++] = IAC;
+	buf[n++] = SB;
+	buf[n++] = OPT_COM_PORT;
+	buf[n++] = cmd;
+	for (i = 0; i < len; ++i) {
+		buf[n++] = val[i];
+		if (val[i] == IAC)
+			buf[n++] = IAC;
+	}
+	buf[n++] = IAC;
+	buf[n++] = SE;
+
+	telnet_send(t, buf, n);
+}
+
+static void rfc2217_flush(transport_t *t, int queues)
+{
+	u8 val = queues & (TRANSPORT_FLUSH_RX | TRANSPORT_FLUSH_TX);
+
+	if (!val)
+		return;
+
+	rfc2217_command(t, CPO_PURGE_DATA, &val, 1);
+	socket_flush(t, queues);
+}
+
+static void rfc2217_set_baudrate(transport_t *t, unsigned int baudrate)
+{
+	struct telnet *tn = t->priv;
+	struct pollfd pfd;
+	u8 val[4], buf[4096];
+	ssize_t rd;
+	int ret;
+
+	*(u32 *)val = htobe32(baudrate);
+	tn->baud_acked = 0;
+	rfc2217_command(t, CPO_SET_BAUDRATE, val, sizeof(val));
+
+	/* data received while waiting for the reply is garbage anyway */
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+
+	while (!tn->baud_acked) {
+		ret = poll(&pfd, 1, 5000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0)
+			die("Cannot poll: %m");
+		else if (!ret)
+			die("%s did not acknowledge baudrate change", t->name);
+
+		rd = rfc2217_read(t, buf, sizeof(buf));
+		if (!rd)
+			die("Connection to %s closed", t->name);
+		else if (rd < 0 && errno != EAGAIN && errno != EINTR)
+			die("Cannot read from %s: %m", t->name);
+	}
+
+	if (tn->baudrate != baudrate)
+		die("Baudrate %u not supported by %s", baudrate, t->name);
+}
+
+static void rfc2217_init(transport_t *t)
+{
+	const u8 nego[] = {
+		IAC, WILL, OPT_BINARY, IAC, DO, OPT_BINARY,
+		IAC, WILL, OPT_SGA, IAC, DO, OPT_SGA,
+		IAC, WILL, OPT_COM_PORT,
+	};
+	u8 val[4];
+
+	t->priv = xmalloc(sizeof(struct telnet));
+	memset(t->priv, 0, sizeof(struct telnet));
+	pthread_mutex_init(&((struct telnet *)t->priv)->lock, NULL);
+
+	t->read = rfc2217_read;
+	t->write = rfc2217_write;
+	t->flush = rfc2217_flush;
+	t->sendfile = NULL;
+	t->set_baudrate = rfc2217_set_baudrate;
+
+	telnet_send(t, nego, sizeof(nego));
+
+	/* 115200 8N1, no flow control; replies are parsed away on read */
+	*(u32 *)val = htobe32(115200);
+	rfc2217_command(t, CPO_SET_BAUDRATE, val, 4);
+	val[0] = 8;
+	rfc2217_command(t, CPO_SET_DATASIZE, val, 1);
+	val[0] = 1;
+	rfc2217_command(t, CPO_SET_PARITY, val, 1);
+	rfc2217_command(t, CPO_SET_STOPSIZE, val, 1);
+	rfc2217_command(t, CPO_SET_CONTROL, val, 1);
+}
+
+static int connect_tcp(const char *spec, const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host, *port;
+	int fd, ret, one = 1;
+
+	host = xstrdup(addr);
+	port = strrchr(host, ':');
+	if (!port || port == host || !port[1])
+		die("Expected HOST:PORT in %s", spec);
+	*port++ = '\0';
+
+	/* [IPv6]:PORT */
+	if (host[0] == '[' && port[-2] == ']') {
+		port[-2] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret)
+		die("Cannot resolve %s: %s", spec, gai_strerror(ret));
+
+	fd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0)
+		die("Cannot connect to %s: %m", spec);
+
+	/* the escape sequence and WTP commands are small and latency bound */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	freeaddrinfo(res);
+	free(host);
+
+	return fd;
+}
+
+static int connect_unix(const char *spec, const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		die("Socket path %s too long", path);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		die("Cannot create socket: %m");
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		die("Cannot connect to %s: %m", spec);
+
+	return fd;
+}
+
+/*
+ * Open a socket transport given by spec:
+ *   tcp:HOST:PORT      raw TCP (ser2net raw mode, socat), fixed baudrate
+ *   unix:PATH          raw Unix socket, fixed baudrate
+ *   rfc2217:HOST:PORT  telnet with RFC 2217 serial port control
+ * Returns NULL if spec is not a socket specification.
+ */
+transport_t *transport_open_socket(const char *spec)
+{
+	transport_t *t;
+	int fd;
+
+	if (!strncmp(spec, "tcp:", 4))
+		fd = connect_tcp(spec, spec + 4);
+	else if (!strncmp(spec, "rfc2217:", 8))
+		fd = connect_tcp(spec, spec + 8);
+	else if (!strncmp(spec, "unix:", 5))
+		fd = connect_unix(spec, spec + 5);
+	else
+		return NULL;
+
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+
+	t->name = spec;
+	t->fd = fd;
+	t->is_serial = 1;
+	t->read = socket_read;
+	t->write = socket_write;
+	t->drain = socket_drain;
+	t->flush = socket_flush;
+	t->close = socket_close;
+	t->sendfile = transport_sendfile;
+
+	if (!strncmp(spec, "rfc2217:", 8))
+		rfc2217_init(t);
+
+	return t;
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/types.h>
+#include "utils.h"
+
+/* queues for the flush operation, values as in RFC 2217 PURGE-DATA */
+#define TRANSPORT_FLUSH_RX	1
+#define TRANSPORT_FLUSH_TX	2
+
+/*
+ * Byte stream to the UART of the board. fd is always pollable for input, but
+ * read may fail with EAGAIN if only out-of-band data was received.
+ *
+ * is_tty means fd is a local tty with termios; is_serial means the other end
+ * of the stream is a serial line (local or remote), so that the escape
+ * sequence can be sent. set_baudrate is NULL if the baudrate cannot be
+ * changed. mark, if not NULL, is told when a new protocol phase starts.
+ * sendfile, if not NULL, writes len bytes of file fd from *offset without
+ * copying them through user space (the data are sent unmodified).
+ */
+typedef struct transport transport_t;
+
+struct transport {
+	const char *name;
+	int fd;
+	int is_tty;
+	int is_serial;
+
+	ssize_t (*read)(transport_t *t, void *buf, size_t len);
+	ssize_t (*write)(transport_t *t, const void *buf, size_t len);
+	void (*drain)(transport_t *t);
+	void (*flush)(transport_t *t, int queues);
+	void (*set_baudrate)(transport_t *t, unsigned int baudrate);
+	void (*mark)(transport_t *t, const char *phase);
+	ssize_t (*sendfile)(transport_t *t, int fd, off_t *offset, size_t len);
+	void (*close)(transport_t *t);
+
+	void *priv;
+};
+
+extern transport_t *transport_open_socket(const char *spec);
+extern ssize_t transport_sendfile(transport_t *t, int fd, off_t *offset,
+				  size_t len);
+
+#endif /* _TRANSPORT_H_ */
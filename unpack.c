@@ -0,0 +1,495 @@
+// SPDX-License-Identifier: Beerware
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <openssl/evp.h>
+#include "tim.h"
+#include "unpack.h"
+
+/* address space reserved for decompressed data, firmware is much smaller */
+#define UNPACK_MAX	(256 << 20)
+#define UNPACK_CHUNK	65536
+
+/* digest of a part of the data computed by the producer while reading */
+struct unpack_digest {
+	size_t offset, size, pos;
+	u32 alg;
+	EVP_MD_CTX *ctx;
+	u32 hash[16];
+	int done;
+};
+
+struct unpack {
+	char *path;
+	const char *format;
+	u8 *data;
+	size_t hint;
+	pid_t pid;
+	int pipe;
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t avail;
+	/* eof: no more data, finished: decompressor exited, digests final */
+	int eof, finished;
+	char err[128];
+
+	struct unpack_digest digests[32];
+	int ndigests;
+};
+
+static const struct {
+	const char *format;
+	const char *magic;
+	size_t len;
+} formats[] = {
+	{ "xz",		"\xfd" "7zXZ\0",	6 },
+	{ "zstd",	"\x28\xb5\x2f\xfd",	4 },
+	{ "gzip",	"\x1f\x8b",		2 },
+	{ "bzip2",	"BZh",			3 },
+};
+
+/* name of the decompressor for the file, NULL if not compressed */
+const char *unpack_format(int fd)
+{
+	u8 magic[6];
+	ssize_t rd;
+	int i;
+
+	rd = pread(fd, magic, sizeof(magic), 0);
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+		if (rd >= (ssize_t) formats[i].len &&
+		    !memcmp(magic, formats[i].magic, formats[i].len))
+			return formats[i].format;
+
+	return NULL;
+}
+
+static int get_varint(const u8 *buf, size_t len, size_t *pos, u64 *val)
+{
+	int shift;
+
+	*val = 0;
+	for (shift = 0; shift < 63 && *pos < len; shift += 7) {
+		u8 b = buf[(*pos)++];
+
+		*val |= (u64) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Uncompressed size from the index of a single xz stream, 0 if the file is
+ * something else (more streams, padding).
+ */
+static size_t xz_size(int fd, off_t fsize)
+{
+	size_t isize, pos, size = 0, blocks = 0;
+	u64 n, unpadded, uncompressed;
+	u8 footer[12], *index;
+
+	if (fsize < 24 || pread(fd, footer, 12, fsize - 12) != 12 ||
+	    memcmp(footer + 10, "YZ", 2))
+		return 0;
+
+	isize = ((size_t) le32toh(*(u32 *) (footer + 4)) + 1) * 4;
+	if (isize > fsize - 24)
+		return 0;
+
+	index = xmalloc(isize);
+	if (pread(fd, index, isize, fsize - 12 - isize) != isize || index[0])
+		goto out;
+
+	pos = 1;
+	if (!get_varint(index, isize, &pos, &n))
+		goto out;
+
+	while (n--) {
+		if (!get_varint(index, isize, &pos, &unpadded) ||
+		    !get_varint(index, isize, &pos, &uncompressed)) {
+			size = 0;
+			goto out;
+		}
+
+		blocks += (unpadded + 3) & ~3ULL;
+		size += uncompressed;
+	}
+
+	if (12 + blocks + isize + 12 != fsize)
+		size = 0;
+out:
+	free(index);
+
+	return size;
+}
+
+/*
+ * Sum of content sizes of all zstd frames, 0 if any frame does not declare it.
+ * Only frame and block headers are read.
+ */
+static size_t zstd_size(int fd, off_t fsize)
+{
+	static const u8 did_len[4] = { 0, 1, 2, 4 };
+	size_t size = 0;
+	off_t pos = 0;
+	u8 hdr[18];
+
+	while (pos < fsize) {
+		u32 magic, bh;
+		int single, fcs_len, hlen, last;
+		u64 fcs = 0;
+		ssize_t rd;
+		u8 fhd;
+
+		rd = pread(fd, hdr, sizeof(hdr), pos);
+		if (rd < 8)
+			return 0;
+
+		magic = le32toh(*(u32 *) hdr);
+		if ((magic & 0xfffffff0) == 0x184d2a50) {
+			/* skippable frame */
+			pos += 8 + le32toh(*(u32 *) (hdr + 4));
+			continue;
+		} else if (magic != 0xfd2fb528) {
+			return 0;
+		}
+
+		fhd = hdr[4];
+		single = (fhd >> 5) & 1;
+		fcs_len = (fhd >> 6) ? 1 << (fhd >> 6) : single;
+		if (!fcs_len)
+			return 0;
+
+		hlen = 5 + !single + did_len[fhd & 3];
+		if (rd < hlen + fcs_len)
+			return 0;
+
+		memcpy(&fcs, hdr + hlen, fcs_len);
+		fcs = le64toh(fcs);
+		if (fcs_len == 2)
+			fcs += 256;
+
+		size += fcs;
+		pos += hlen + fcs_len;
+
+		do {
+			u8 b[3];
+
+			if (pread(fd, b, 3, pos) != 3)
+				return 0;
+
+			bh = b[0] | (b[1] << 8) | (b[2] << 16);
+			last = bh & 1;
+			if (((bh >> 1) & 3) == 3)
+				return 0;
+
+			/* RLE block has one byte of data */
+			pos += 3 + (((bh >> 1) & 3) == 1 ? 1 : bh >> 3);
+		} while (!last);
+
+		if (fhd & 4)
+			pos += 4;
+	}
+
+	return pos == fsize ? size : 0;
+}
+
+static void hash_digests(unpack_t *u, size_t avail)
+{
+	int i, n;
+
+	pthread_mutex_lock(&u->lock);
+	n = u->ndigests;
+	pthread_mutex_unlock(&u->lock);
+
+	for (i = 0; i < n; ++i) {
+		struct unpack_digest *d = &u->digests[i];
+		size_t end = d->offset + d->size;
+
+		if (d->done)
+			continue;
+
+		if (end > avail)
+			end = avail;
+
+		if (d->pos < end) {
+			EVP_DigestUpdate(d->ctx, u->data + d->pos,
+					 end - d->pos);
+			d->pos = end;
+		}
+
+		if (d->pos == d->offset + d->size) {
+			EVP_DigestFinal_ex(d->ctx, (void *) d->hash, NULL);
+
+			pthread_mutex_lock(&u->lock);
+			d->done = 1;
+			pthread_cond_broadcast(&u->cond);
+			pthread_mutex_unlock(&u->lock);
+		}
+	}
+}
+
+static void *unpack_thread(void *arg)
+{
+	unpack_t *u = arg;
+	size_t avail = 0, len;
+	char err[128] = "";
+	ssize_t rd;
+	int status;
+
+	while (1) {
+		if (avail == UNPACK_MAX) {
+			snprintf(err, sizeof(err), "too big");
+			break;
+		}
+
+		len = UNPACK_MAX - avail;
+		if (len > UNPACK_CHUNK)
+			len = UNPACK_CHUNK;
+
+		rd = read(u->pipe, u->data + avail, len);
+		if (rd < 0 && errno == EINTR) {
+			continue;
+		} else if (rd < 0) {
+			snprintf(err, sizeof(err), "%m");
+			break;
+		} else if (!rd) {
+			break;
+		}
+
+		avail += rd;
+		hash_digests(u, avail);
+
+		pthread_mutex_lock(&u->lock);
+		u->avail = avail;
+		pthread_cond_broadcast(&u->cond);
+		pthread_mutex_unlock(&u->lock);
+	}
+
+	close(u->pipe);
+	if (err[0])
+		kill(u->pid, SIGTERM);
+
+	while (waitpid(u->pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	if (!err[0] && (!WIFEXITED(status) || WEXITSTATUS(status)))
+		snprintf(err, sizeof(err), "%s failed", u->format);
+
+	/* no more digests can be added after this */
+	pthread_mutex_lock(&u->lock);
+	u->eof = 1;
+	pthread_mutex_unlock(&u->lock);
+
+	hash_digests(u, avail);
+
+	pthread_mutex_lock(&u->lock);
+	strcpy(u->err, err);
+	u->finished = 1;
+	pthread_cond_broadcast(&u->cond);
+	pthread_mutex_unlock(&u->lock);
+
+	return NULL;
+}
+
+unpack_t *unpack_start(int fd, const char *path, const char *format)
+{
+	struct stat st;
+	int pfd[2];
+	unpack_t *u;
+
+	u = xmalloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	u->path = xstrdup(path);
+	u->format = format;
+
+	if (!fstat(fd, &st)) {
+		if (!strcmp(format, "xz"))
+			u->hint = xz_size(fd, st.st_size);
+		else if (!strcmp(format, "zstd"))
+			u->hint = zstd_size(fd, st.st_size);
+	}
+
+	u->data = mmap(NULL, UNPACK_MAX, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (u->data == MAP_FAILED)
+		die("Cannot allocate memory for decompressing %s: %m", path);
+
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+		die("Cannot create pipe: %m");
+
+	u->pid = fork();
+	if (u->pid < 0)
+		die("Cannot fork: %m");
+
+	if (!u->pid) {
+		if (dup2(fd, STDIN_FILENO) < 0 ||
+		    dup2(pfd[1], STDOUT_FILENO) < 0)
+			_exit(127);
+
+		execlp(format, format, "-dc", NULL);
+		_exit(127);
+	}
+
+	close(pfd[1]);
+	u->pipe = pfd[0];
+
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->cond, NULL);
+
+	errno = pthread_create(&u->thread, NULL, unpack_thread, u);
+	if (errno)
+		die("Cannot create thread: %m");
+
+	return u;
+}
+
+void *unpack_data(unpack_t *u)
+{
+	return u->data;
+}
+
+/* uncompressed size declared by the file, 0 if unknown */
+size_t unpack_size_hint(unpack_t *u)
+{
+	return u->hint;
+}
+
+static void check_finished(unpack_t *u)
+{
+	if (u->err[0])
+		die("Cannot decompress %s: %s", u->path, u->err);
+
+	if (u->hint && u->avail != u->hint)
+		die("Decompressed %s has %zu bytes, expected %zu", u->path,
+		    u->avail, u->hint);
+}
+
+/*
+ * Wait till the first end bytes are decompressed. The end of the data is only
+ * given out after the decompressor exited successfully.
+ */
+size_t unpack_wait(unpack_t *u, size_t end)
+{
+	size_t avail;
+
+	pthread_mutex_lock(&u->lock);
+	while (!u->finished &&
+	       (u->avail < end || (u->hint && end >= u->hint)))
+		pthread_cond_wait(&u->cond, &u->lock);
+	avail = u->avail;
+	pthread_mutex_unlock(&u->lock);
+
+	if (u->finished)
+		check_finished(u);
+
+	if (avail < end)
+		die("Unexpected end of decompressed %s", u->path);
+
+	return avail;
+}
+
+size_t unpack_finish(unpack_t *u)
+{
+	pthread_mutex_lock(&u->lock);
+	while (!u->finished)
+		pthread_cond_wait(&u->cond, &u->lock);
+	pthread_mutex_unlock(&u->lock);
+
+	check_finished(u);
+
+	return u->avail;
+}
+
+/* start computing digest of the given part while it is decompressed */
+void unpack_digest(unpack_t *u, size_t offset, size_t size, u32 alg)
+{
+	struct unpack_digest *d;
+
+	pthread_mutex_lock(&u->lock);
+
+	if (u->eof || u->ndigests == 32)
+		goto out;
+
+	d = &u->digests[u->ndigests];
+	memset(d, 0, sizeof(*d));
+	d->offset = d->pos = offset;
+	d->size = size;
+	d->alg = alg;
+	d->ctx = EVP_MD_CTX_new();
+	if (!d->ctx ||
+	    !EVP_DigestInit_ex(d->ctx, alg == HASH_SHA256 ? EVP_sha256() :
+							    EVP_sha512(),
+			       NULL))
+		die("Cannot initialize hash");
+
+	u->ndigests++;
+out:
+	pthread_mutex_unlock(&u->lock);
+}
+
+/* wait for digest of the given part, if it is being computed */
+int unpack_get_digest(unpack_t *u, size_t offset, size_t size, u32 alg,
+		      u32 *out)
+{
+	struct unpack_digest *d = NULL;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&u->lock);
+
+	for (i = 0; i < u->ndigests; ++i)
+		if (u->digests[i].offset == offset &&
+		    u->digests[i].size == size && u->digests[i].alg == alg)
+			d = &u->digests[i];
+
+	if (d) {
+		while (!d->done && !u->finished)
+			pthread_cond_wait(&u->cond, &u->lock);
+
+		if (d->done) {
+			memset(out, 0, 64);
+			memcpy(out, d->hash, alg == HASH_SHA256 ? 32 : 64);
+			ret = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+void unpack_free(unpack_t *u)
+{
+	int i;
+
+	pthread_mutex_lock(&u->lock);
+	if (!u->finished)
+		kill(u->pid, SIGTERM);
+	pthread_mutex_unlock(&u->lock);
+
+	pthread_join(u->thread, NULL);
+
+	for (i = 0; i < u->ndigests; ++i)
+		EVP_MD_CTX_free(u->digests[i].ctx);
+
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->cond);
+	munmap(u->data, UNPACK_MAX);
+	free(u->path);
+	free(u);
+}
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _UNPACK_H_
+#define _UNPACK_H_
+
+#include "utils.h"
+
+/*
+ * Compressed input file (xz, zstd, gzip, bzip2), decompressed by the external
+ * tool into memory by a producer thread, so that the beginning of the data can
+ * be used (e.g. sent to the board) while the rest is still being decompressed.
+ */
+typedef struct unpack unpack_t;
+
+extern const char *unpack_format(int fd);
+extern unpack_t *unpack_start(int fd, const char *path, const char *format);
+extern void *unpack_data(unpack_t *u);
+extern size_t unpack_size_hint(unpack_t *u);
+extern size_t unpack_wait(unpack_t *u, size_t end);
+extern size_t unpack_finish(unpack_t *u);
+extern void unpack_digest(unpack_t *u, size_t offset, size_t size, u32 alg);
+extern int unpack_get_digest(unpack_t *u, size_t offset, size_t size, u32 alg,
+			     u32 *out);
+extern void unpack_free(unpack_t *u);
+
+#endif /* _UNPACK_H_ */
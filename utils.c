@@ -18,10 +18,20 @@ int terminal_on_exit = 0;
 #pragma weak uart_terminal
 void uart_terminal(void) {}
 
+__thread jmp_buf *die_jmp;
+__thread char die_msg[256];
+
 __attribute__((noreturn)) void die(const char *fmt, ...)
 {
 	va_list ap;
 
+	if (die_jmp) {
+		va_start(ap, fmt);
+		vsnprintf(die_msg, sizeof(die_msg), fmt, ap);
+		va_end(ap);
+		longjmp(*die_jmp, 1);
+	}
+
 #ifndef GPP_COMPILER
 	closewtp();
 #endif
@@ -7,12 +7,20 @@
 #define _UTILS_H_
 
 #include <endian.h>
+#include <setjmp.h>
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
 
+/*
+ * If die_jmp is set, die() stores the message into die_msg and jumps there
+ * instead of exiting. Both are per thread.
+ */
+extern __thread jmp_buf *die_jmp;
+extern __thread char die_msg[256];
+
 extern __attribute__((noreturn)) void die(const char *fmt, ...);
 extern double now(void);
 extern void *xmalloc(size_t sz);
@@ -27,7 +35,7 @@ static inline u32 name2id(const char *name)
 
 static inline const char *id2name(u32 type)
 {
-	static unsigned char name[5];
+	static __thread unsigned char name[5];
 
 	*(u32 *) name = be32toh(type);
 	name[4] = 0;
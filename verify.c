@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: Beerware
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "verify.h"
+#include "images.h"
+#include "tim.h"
+#include "utils.h"
+
+#define VERIFY_MAX_FILES	32
+
+/* file in a scanned directory which can supply image id for TIMs there */
+struct verify_file {
+	char *path;
+	u32 id;
+};
+
+struct verify_dir {
+	struct verify_file *files;
+	int nfiles;
+};
+
+/*
+ * Image set: a file with TIMH, and if found in a directory, the directory,
+ * whose other files are used for images not contained in the TIMH file.
+ */
+struct verify_set {
+	char *path;
+	struct verify_dir *dir;
+	char *error;
+
+	/* result, written by the worker */
+	const char *files[VERIFY_MAX_FILES];
+	int nfiles;
+	u32 ids[2 * TIM_MAX_IMAGES];
+	int nids;
+	int trusted;
+	int has_otp_hash;
+	u32 otp_hash[8];
+	int ok;
+	int done;
+};
+
+static struct verify_set *sets;
+static int nsets, sets_alloc;
+static struct verify_dir **dirs;
+static int ndirs;
+
+static int next_set;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct verify_set *add_set(const char *path, struct verify_dir *dir)
+{
+	struct verify_set *set;
+
+	if (nsets == sets_alloc) {
+		sets_alloc = sets_alloc ? 2 * sets_alloc : 16;
+		sets = xrealloc(sets, sets_alloc * sizeof(*sets));
+	}
+
+	set = &sets[nsets++];
+	memset(set, 0, sizeof(*set));
+	set->path = xstrdup(path);
+	set->dir = dir;
+
+	return set;
+}
+
+/*
+ * Read the start of the file: returns 1 for TIMH files, 0 with id for files
+ * which may supply an image (TIMN or image prefixed with its id) and -1
+ * otherwise.
+ */
+static int sniff(const char *path, u32 *id)
+{
+	u32 hdr[2];
+	ssize_t rd;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	rd = read(fd, hdr, sizeof(hdr));
+	close(fd);
+
+	if (rd != sizeof(hdr))
+		return -1;
+
+	if (le32toh(hdr[1]) == TIMH_ID)
+		return 1;
+
+	if (le32toh(hdr[1]) == TIMN_ID) {
+		*id = TIMN_ID;
+		return 0;
+	}
+
+	if (is_id_valid(le32toh(hdr[0]))) {
+		*id = le32toh(hdr[0]);
+		return 0;
+	}
+
+	return -1;
+}
+
+static int not_hidden(const struct dirent *de)
+{
+	return de->d_name[0] != '.';
+}
+
+static void scan_dir(const char *path)
+{
+	struct dirent **names;
+	struct verify_dir *dir;
+	char **subdirs;
+	int i, n, nsubdirs;
+
+	n = scandir(path, &names, not_hidden, alphasort);
+	if (n < 0) {
+		add_set(path, NULL)->error = xstrdup("Cannot read directory");
+		return;
+	}
+
+	dir = xmalloc(sizeof(*dir));
+	dir->files = xmalloc((n ? : 1) * sizeof(*dir->files));
+	dir->nfiles = 0;
+	dirs = xrealloc(dirs, (ndirs + 1) * sizeof(*dirs));
+	dirs[ndirs++] = dir;
+
+	subdirs = xmalloc((n ? : 1) * sizeof(*subdirs));
+	nsubdirs = 0;
+
+	for (i = 0; i < n; ++i) {
+		struct stat st;
+		char *file;
+		u32 id;
+
+		file = xmalloc(strlen(path) + strlen(names[i]->d_name) + 2);
+		sprintf(file, "%s/%s", path, names[i]->d_name);
+		free(names[i]);
+
+		if (stat(file, &st) < 0 || (!S_ISDIR(st.st_mode) &&
+					    !S_ISREG(st.st_mode))) {
+			free(file);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			subdirs[nsubdirs++] = file;
+			continue;
+		}
+
+		switch (sniff(file, &id)) {
+		case 1:
+			add_set(file, dir);
+			free(file);
+			break;
+		case 0:
+			dir->files[dir->nfiles].path = file;
+			dir->files[dir->nfiles].id = id;
+			dir->nfiles++;
+			break;
+		default:
+			free(file);
+		}
+	}
+
+	free(names);
+
+	for (i = 0; i < nsubdirs; ++i) {
+		scan_dir(subdirs[i]);
+		free(subdirs[i]);
+	}
+
+	free(subdirs);
+}
+
+static void add_path(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		add_set(path, NULL)->error = xstrdup("Cannot stat file");
+	else if (S_ISDIR(st.st_mode))
+		scan_dir(path);
+	else
+		add_set(path, NULL);
+}
+
+static const char *dir_find(struct verify_dir *dir, u32 id)
+{
+	int i;
+
+	if (!dir)
+		return NULL;
+
+	for (i = 0; i < dir->nfiles; ++i)
+		if (dir->files[i].id == id)
+			return dir->files[i].path;
+
+	return NULL;
+}
+
+/* returns address of the CSKT (TIMN) image, or -1U */
+static u32 add_ids(struct verify_set *set, image_t *tim)
+{
+	tim_view_t v;
+	int i;
+
+	tim_view(&v, tim);
+	for (i = 0; i < v.nimages; ++i)
+		set->ids[set->nids++] = le32toh(v.images[i].id);
+
+	return tim_view_imap_addr(&v, name2id("CSKT"));
+}
+
+static void load_file(struct verify_set *set, const char *path)
+{
+	if (set->nfiles == VERIFY_MAX_FILES)
+		die("Too many image files");
+
+	set->files[set->nfiles++] = path;
+	image_load(path);
+}
+
+/* the same checks as done by --get-otp-hash / before sending images */
+static void verify_set(struct verify_set *set)
+{
+	struct image_table *table;
+	image_t *timh, *timn;
+	const char *path;
+	jmp_buf jmp;
+	u32 id, cskt;
+
+	table = image_table_new();
+	image_table_use(table);
+	tim_set_quiet(1);
+
+	die_jmp = &jmp;
+	if (!setjmp(jmp)) {
+		load_file(set, set->path);
+		while ((id = image_waiting()) && (path = dir_find(set->dir, id)))
+			load_file(set, path);
+
+		/*
+		 * as with --get-otp-hash, the OTP hash only depends on the
+		 * TIMH, so it is reported even if other images are missing
+		 */
+		timh = image_find(TIMH_ID);
+		tim_parse(timh, NULL, 0, NULL);
+		set->trusted = ((timhdr_t *) timh->data)->trusted;
+		if (set->trusted) {
+			tim_get_otp_hash(timh, set->otp_hash);
+			set->has_otp_hash = 1;
+		}
+
+		if (id)
+			die("Missing image %s", id2name(id));
+
+		cskt = add_ids(set, timh);
+		if (cskt != -1U) {
+			timn = image_find(TIMN_ID);
+			tim_parse(timn, NULL, 0, NULL);
+			tim_check_key_chain(timh, timn);
+			add_ids(set, timn);
+		}
+
+		set->ok = 1;
+	}
+	die_jmp = NULL;
+
+	if (!set->ok)
+		set->error = xstrdup(die_msg);
+
+	tim_set_quiet(0);
+	image_table_use(NULL);
+	image_table_free(table);
+}
+
+static void *verify_worker(void *arg)
+{
+	while (1) {
+		int i = __atomic_fetch_add(&next_set, 1, __ATOMIC_RELAXED);
+
+		if (i >= nsets)
+			break;
+
+		if (!sets[i].error)
+			verify_set(&sets[i]);
+
+		pthread_mutex_lock(&done_lock);
+		sets[i].done = 1;
+		pthread_cond_broadcast(&done_cond);
+		pthread_mutex_unlock(&done_lock);
+	}
+
+	return NULL;
+}
+
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((u8) *s < 0x20)
+			printf("\\u%04x", (u8) *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void print_set(const struct verify_set *set)
+{
+	int i;
+
+	printf("{\"path\":");
+	json_string(set->path);
+
+	printf(",\"files\":[");
+	for (i = 0; i < set->nfiles; ++i) {
+		if (i)
+			putchar(',');
+		json_string(set->files[i]);
+	}
+	printf("],\"ok\":%s", set->ok ? "true" : "false");
+
+	if (!set->ok) {
+		printf(",\"error\":");
+		json_string(set->error);
+	} else {
+		printf(",\"trusted\":%s,\"images\":[",
+		       set->trusted ? "true" : "false");
+		for (i = 0; i < set->nids; ++i)
+			printf("%s\"%s\"", i ? "," : "", id2name(set->ids[i]));
+		printf("]");
+	}
+
+	/* known from the TIMH even if the set is incomplete */
+	if (!set->ok && !set->has_otp_hash) {
+		printf("}\n");
+		return;
+	}
+
+	printf(",\"otp_hash\":");
+	if (set->has_otp_hash) {
+		putchar('"');
+		for (i = 0; i < 8; ++i)
+			printf("%08x", set->otp_hash[i]);
+		putchar('"');
+	} else {
+		printf("null");
+	}
+	printf("}\n");
+}
+
+int verify_images(char **paths, int npaths, int nthreads)
+{
+	pthread_t *threads;
+	int i, j, ret, failed;
+
+	for (i = 0; i < npaths; ++i)
+		add_path(paths[i]);
+
+	if (nthreads > nsets)
+		nthreads = nsets;
+
+	threads = xmalloc((nthreads ? : 1) * sizeof(*threads));
+	for (i = 0; i < nthreads; ++i) {
+		ret = pthread_create(&threads[i], NULL, verify_worker, NULL);
+		if (ret) {
+			errno = ret;
+			die("pthread_create failed: %m");
+		}
+	}
+
+	/* print records in the order the sets were found, as they finish */
+	failed = 0;
+	for (i = 0; i < nsets; ++i) {
+		pthread_mutex_lock(&done_lock);
+		while (!sets[i].done)
+			pthread_cond_wait(&done_cond, &done_lock);
+		pthread_mutex_unlock(&done_lock);
+
+		print_set(&sets[i]);
+		fflush(stdout);
+		if (!sets[i].ok)
+			++failed;
+	}
+
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < nsets; ++i) {
+		free(sets[i].path);
+		free(sets[i].error);
+	}
+	free(sets);
+
+	for (i = 0; i < ndirs; ++i) {
+		for (j = 0; j < dirs[i]->nfiles; ++j)
+			free(dirs[i]->files[j].path);
+		free(dirs[i]->files);
+		free(dirs[i]);
+	}
+	free(dirs);
+
+	fprintf(stderr, "Verified %d image sets, %d failed\n", nsets, failed);
+
+	return failed;
+}
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+/*
+ * Check image sets found in the given files and directories with nthreads
+ * workers and print one JSON record per set to stdout. Returns the number of
+ * sets which failed.
+ */
+extern int verify_images(char **paths, int npaths, int nthreads);
+
+#endif /* _VERIFY_H_ */
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: Beerware */
+
+#ifndef _WTPTP_INTERNAL_H_
+#define _WTPTP_INTERNAL_H_
+
+/* internals of wtptp.c, exported only for the microbenchmarks in bench.c */
+
+#include <stddef.h>
+#include "transport.h"
+#include "utils.h"
+
+/*
+ * Terminal input state: the keyboard sequences recognized in input, and the
+ * bytes from the end of the previous read which form a proper prefix of one of
+ * these sequences and so cannot be sent yet.
+ */
+struct terminal_input {
+	const char *quit;
+	size_t quitlen;
+	const char *kbs;
+	size_t kbslen;
+	char pending[16];
+	size_t npending;
+	int quitted;
+};
+
+extern void wtp_set_transport(transport_t *t);
+extern int compute_best_uart_params(u32 clk, u32 desired_baud, u32 *div,
+				    u32 *m);
+extern void eccread(void *buf, size_t size);
+extern size_t terminal_input_process(struct terminal_input *ti, const char *in,
+				     size_t len, char *out);
+
+#endif /* _WTPTP_INTERNAL_H_ */
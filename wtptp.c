@@ -3,9 +3,11 @@
  * 2018 by Marek Behun <marek.behun@nic.cz>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <asm/termbits.h>
@@ -14,11 +16,17 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <math.h>
 #include <endian.h>
-#include <pthread.h>
+#include <linux/serial.h>
+#include "realtime.h"
+#include "trace.h"
+#include "transport.h"
 #include "utils.h"
 #include "wtptp.h"
+#include "wtptp-internal.h"
 
 /* Some architectures don't have termios2 */
 #ifndef TCGETS2
@@ -29,7 +37,206 @@
 #define termios2 termios
 #endif
 
-static int wtpfd = -1;
+static transport_t *wtp;
+static int wtp_low_latency;
+static unsigned int wtp_baudrate = 115200;
+
+void wtp_set_transport(transport_t *t)
+{
+	wtp = t;
+}
+
+/*
+ * Time the board may spend processing a command before replying, by protocol
+ * phase (image phases are "image XXXX"). The BootROM runs GPP code of the TIM
+ * (e.g. DDR training) before replying to the preamble of the next image or to
+ * the baudrate change request, and
+ * the OTP and deploy code of the WTMI image reads / generates data slowly.
+ */
+static struct {
+	const char *phase;
+	int ms;
+} phase_timeouts[] = {
+	{ "wtp",	200 },
+	{ "probe",	100 },
+	{ "select",	5000 },
+	{ "image",	1000 },
+	{ "baudrate",	5000 },
+	{ "otp-read",	10000 },
+	{ "deploy",	10000 },
+};
+
+#define NPHASES		(sizeof(phase_timeouts) / sizeof(phase_timeouts[0]))
+#define DEFAULT_TIMEOUT	10000
+
+static char cur_phase[16];
+static int cur_timeout = DEFAULT_TIMEOUT;
+
+/* largest delay of replies seen so far, above the time spent on the line */
+static double reply_latency = 0.02;
+
+/* absolute time until which the reply being read must arrive, or 0 */
+static double reply_deadline;
+
+/*
+ * Line error counters of the tty (TIOCGICOUNT), accumulated by protocol phase
+ * in which they occurred, to find degrading cables and adapters before uploads
+ * start failing. Errors are expected when the board powers up while the
+ * escape sequence is sent and while the baudrate is being changed. The last
+ * slot is "other", collecting phases which do not fit.
+ */
+#define LINK_PHASES	16
+
+static struct link_phase {
+	char name[16];
+	u32 rx, tx, frame, overrun, parity, brk, buf_overrun;
+} link_phases[LINK_PHASES];
+
+static int link_nphases, link_cur = -1;
+static struct serial_icounter_struct link_last;
+
+static int link_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < link_nphases; ++i)
+		if (!strcmp(link_phases[i].name, name))
+			return i;
+
+	return -1;
+}
+
+/* add counters since the last sample to the current phase and start next */
+static void link_sample(const char *next)
+{
+	struct serial_icounter_struct ic;
+	struct link_phase *p;
+	int i;
+
+	if (!wtp->is_tty || ioctl(wtp->fd, TIOCGICOUNT, &ic) < 0)
+		return;
+
+	if (link_cur >= 0) {
+		p = &link_phases[link_cur];
+		p->rx += ic.rx - link_last.rx;
+		p->tx += ic.tx - link_last.tx;
+		p->frame += ic.frame - link_last.frame;
+		p->overrun += ic.overrun - link_last.overrun;
+		p->parity += ic.parity - link_last.parity;
+		p->brk += ic.brk - link_last.brk;
+		p->buf_overrun += ic.buf_overrun - link_last.buf_overrun;
+	}
+
+	link_last = ic;
+	link_cur = -1;
+
+	if (!next)
+		return;
+
+	i = link_find(next);
+	if (i < 0 && link_nphases == LINK_PHASES - 1) {
+		next = "other";
+		i = link_find(next);
+	}
+
+	if (i < 0) {
+		i = link_nphases++;
+		snprintf(link_phases[i].name, sizeof(link_phases[i].name),
+			 "%s", next);
+	}
+
+	link_cur = i;
+}
+
+static int link_errors_expected(const struct link_phase *p)
+{
+	return !strcmp(p->name, "escape") || !strcmp(p->name, "baudrate");
+}
+
+static u32 link_phase_errors(const struct link_phase *p)
+{
+	return p->frame + p->overrun + p->parity + p->brk + p->buf_overrun;
+}
+
+static void wtp_phase(const char *phase)
+{
+	size_t i, len = strcspn(phase, " ");
+
+	link_sample(phase);
+
+	snprintf(cur_phase, sizeof(cur_phase), "%s", phase);
+	cur_timeout = DEFAULT_TIMEOUT;
+	for (i = 0; i < NPHASES; ++i)
+		if (strlen(phase_timeouts[i].phase) == len &&
+		    !strncmp(phase_timeouts[i].phase, phase, len))
+			cur_timeout = phase_timeouts[i].ms;
+
+	if (wtp->mark)
+		wtp->mark(wtp, phase);
+}
+
+/* spec is a comma separated list of PHASE=MS */
+void wtp_set_timeouts(const char *spec)
+{
+	char *list, *opt, *saveptr, *val, *end;
+	size_t i;
+	long ms;
+
+	list = xstrdup(spec);
+	for (opt = strtok_r(list, ",", &saveptr); opt;
+	     opt = strtok_r(NULL, ",", &saveptr)) {
+		val = strchr(opt, '=');
+		if (!val)
+			die("Invalid timeout \"%s\", expected PHASE=MS", opt);
+		*val++ = '\0';
+
+		ms = strtol(val, &end, 10);
+		if (*end || end == val || ms <= 0 || ms > 3600000)
+			die("Invalid timeout \"%s\" for phase %s", val, opt);
+
+		for (i = 0; i < NPHASES; ++i)
+			if (!strcmp(phase_timeouts[i].phase, opt))
+				break;
+		if (i == NPHASES)
+			die("Unknown phase \"%s\"", opt);
+
+		phase_timeouts[i].ms = ms;
+	}
+	free(list);
+}
+
+static double wire_time(size_t bytes)
+{
+	return bytes * 10.0 / wtp_baudrate;
+}
+
+/* bytes written but not yet sent to the line (or to a serial server) */
+static size_t tx_pending(void)
+{
+	int queued;
+
+	if (ioctl(wtp->fd, TIOCOUTQ, &queued) < 0 || queued < 0)
+		return 0;
+
+	return queued;
+}
+
+/*
+ * A reply of up to in bytes to a command of out bytes written at time start is
+ * expected before both are transferred on the line at the current baudrate,
+ * plus the measured reply latency, plus the processing time of the phase.
+ */
+static void expect_reply(double start, size_t out, size_t in)
+{
+	reply_deadline = start + wire_time(out + in) + reply_latency +
+			 cur_timeout / 1000.0;
+}
+
+/* the reply is complete, later reads get the default timeout again */
+static void reply_done(void)
+{
+	reply_deadline = 0;
+}
 
 static inline void xtcdrain(int fd)
 {
@@ -70,24 +277,33 @@ static void xread(void *buf, size_t size)
 	ssize_t res;
 	size_t rd;
 	struct pollfd pfd;
+	int timeout;
 
-	pfd.fd = wtpfd;
+	pfd.fd = wtp->fd;
 	pfd.events = POLLIN;
 
 	rd = 0;
 	while (rd < size) {
+		if (reply_deadline)
+			timeout = lrint((reply_deadline - now()) * 1000);
+		else
+			timeout = DEFAULT_TIMEOUT;
+
 		pfd.revents = 0;
-		res = poll(&pfd, 1, 10 * 1000);
+		res = poll(&pfd, 1, timeout > 0 ? timeout : 0);
 		if (res == 0)
-			die("Timeout while waiting for data!");
+			die("Timeout while waiting for data (phase %s, %i ms "
+			    "allowed for processing)!", cur_phase, cur_timeout);
 		else if (res < 0)
 			die("Cannot poll: %m");
 
 		if (pfd.revents & POLLERR)
 			die("File descriptor error!");
 
-		res = read(wtpfd, buf + rd, size - rd);
-		if (res <= 0)
+		res = wtp->read(wtp, buf + rd, size - rd);
+		if (res < 0 && errno == EAGAIN)
+			continue;
+		else if (res <= 0)
 			die("Cannot read %zu bytes: %m", size);
 
 		rd += res;
@@ -98,98 +314,355 @@ static void xwrite(const void *buf, size_t size)
 {
 	ssize_t res;
 
-	res = write(wtpfd, buf, size);
+	res = wtp->write(wtp, buf, size);
 	if (res < 0)
 		die("Cannot write %zu bytes: %m", size);
 	else if ((size_t)res < size)
 		die("Cannot write %zu bytes: written only %zi", size, res);
 }
 
-static enum escape_state {
+static int is_all_zeros(const u8 *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+enum escape_state {
 	STATE_ESCAPE,
 	STATE_SEQ_ESCAPE,
 	STATE_WRITE_CLEAR,
 	STATE_WRITE_WTP,
-} state;
-#define state_store(i) __atomic_store_n(&state, (i), __ATOMIC_RELEASE)
-#define state_load() __atomic_load_n(&state, __ATOMIC_ACQUIRE)
+};
+
+static const u8 esc_seq[] = { 0xbb, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 };
+static const u8 clr_seq[] = { 0x0d, 0x0d, 0x0d, 0x0d };
+static const u8 wtp_seq[] = { 0x03, 'w', 't', 'p', '\r' };
+
+/* times at 115200 baud, in us */
+#define SYNC_CYCLE		(1000 * 1000 * 10 / 115200)
+#define SYNC_ESC_TIME		(sizeof(esc_seq) * SYNC_CYCLE)
+/* escape sequence is sent in bursts, keeping ~20 ms of it in output queue */
+#define SYNC_BURST_PERIOD	10000
+#define SYNC_BURST_QUEUE	(2 * SYNC_BURST_PERIOD / SYNC_CYCLE)
+
+/*
+ * Escape sequence / sync state of one port. Ports are driven by a single
+ * epoll loop: replies are processed as they come and the sequences are sent
+ * paced by a timer.
+ */
+struct wtp_sync {
+	transport_t *t;
+	int epfd, timer, idx;
+	enum escape_state state;
+	/* sequence to send when the timer expires next */
+	const u8 *pending;
+	size_t pending_len;
+	int reading, done;
+	int ack_count;
+	int len;
+	u8 buf[8192];
+};
 
-static void seq_write(const void *seq, size_t len)
+static void sync_arm(struct wtp_sync *s, long us, int periodic)
 {
-	const useconds_t one_cycle = 1000 * 1000 * 10 / 115200;
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = us % 1000000 * 1000;
+	if (periodic)
+		its.it_interval = its.it_value;
 
-	usleep(one_cycle);
-	xwrite(seq, len);
-	xtcdrain(wtpfd);
+	if (timerfd_settime(s->timer, 0, &its, NULL) < 0)
+		die("Cannot set timer: %m");
 }
 
-static void *seq_write_handler(void *ptr __attribute__((unused)))
+static void sync_reading(struct wtp_sync *s, int enable)
 {
-	const u8 esc_seq[] = { 0xbb, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 };
-	const u8 clr_seq[] = { 0x0d, 0x0d, 0x0d, 0x0d };
-	const u8 wtp_seq[] = { 0x03, 'w', 't', 'p', '\r' };
-	enum escape_state prev_state = state_load();
+	struct epoll_event ev;
 
-	while (1) {
-		enum escape_state new_state = state_load();
+	if (s->reading == enable)
+		return;
 
-		if (new_state != STATE_ESCAPE && prev_state == STATE_ESCAPE) {
-			xtcflush(wtpfd, TCOFLUSH);
-			xtcdrain(wtpfd);
-		}
+	ev.events = enable ? EPOLLIN : 0;
+	ev.data.u64 = 2 * s->idx;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, s->t->fd, &ev) < 0)
+		die("Cannot modify epoll: %m");
 
-		switch (new_state) {
-		case STATE_ESCAPE:
-			xwrite(esc_seq, sizeof(esc_seq));
-			break;
-		case STATE_SEQ_ESCAPE:
-			seq_write(esc_seq, sizeof(esc_seq));
-			break;
-		case STATE_WRITE_CLEAR:
-			seq_write(clr_seq, sizeof(clr_seq));
-			return NULL;
-		case STATE_WRITE_WTP:
-			seq_write(wtp_seq, sizeof(wtp_seq));
-			return NULL;
-		default:
-			__builtin_unreachable();
-		}
+	s->reading = enable;
+}
+
+static void sync_write(struct wtp_sync *s, const void *seq, size_t len)
+{
+	ssize_t res;
+
+	res = s->t->write(s->t, seq, len);
+	if (res < 0)
+		die("Cannot write %zu bytes: %m", len);
+	else if ((size_t)res < len)
+		die("Cannot write %zu bytes: written only %zi", len, res);
+}
+
+/* send seq one cycle after the previous one */
+static void sync_send_after_cycle(struct wtp_sync *s, const u8 *seq,
+				  size_t len)
+{
+	s->pending = seq;
+	s->pending_len = len;
+	sync_arm(s, SYNC_CYCLE, 0);
+}
+
+static void sync_set_state(struct wtp_sync *s, enum escape_state state)
+{
+	if (state != STATE_ESCAPE && s->state == STATE_ESCAPE) {
+		s->t->flush(s->t, TRANSPORT_FLUSH_TX);
+		s->t->drain(s->t);
+	}
 
-		prev_state = new_state;
+	s->state = state;
+	s->pending = NULL;
+
+	switch (state) {
+	case STATE_ESCAPE:
+		sync_arm(s, 1, 0);
+		break;
+	case STATE_SEQ_ESCAPE:
+		/* sent after the previous one is transmitted, plus one cycle */
+		sync_arm(s, SYNC_ESC_TIME + SYNC_CYCLE, 1);
+		break;
+	case STATE_WRITE_CLEAR:
+		s->ack_count = 0;
+		sync_send_after_cycle(s, clr_seq, sizeof(clr_seq));
+		break;
+	case STATE_WRITE_WTP:
+		s->len = 0;
+		sync_reading(s, 0);
+		sync_send_after_cycle(s, wtp_seq, sizeof(wtp_seq));
+		break;
 	}
 }
 
-static void seq_write_thread_start(pthread_t *write_thread)
+/* keep the output queue filled with escape sequences */
+static void sync_escape_burst(struct wtp_sync *s)
 {
-	int ret;
+	u8 burst[SYNC_BURST_QUEUE / sizeof(esc_seq) * sizeof(esc_seq)];
+	int queued, n, i;
+
+	if (ioctl(s->t->fd, TIOCOUTQ, &queued) < 0)
+		queued = 0;
+
+	n = (SYNC_BURST_QUEUE - queued) / sizeof(esc_seq);
+	if (n <= 0)
+		return;
 
-	ret = pthread_create(write_thread, NULL, seq_write_handler, NULL);
-	if (ret) {
-		errno = ret;
-		die("pthread_create failed: %m");
+	for (i = 0; i < n; ++i)
+		memcpy(burst + i * sizeof(esc_seq), esc_seq, sizeof(esc_seq));
+
+	sync_write(s, burst, n * sizeof(esc_seq));
+}
+
+static void sync_timer(struct wtp_sync *s)
+{
+	u64 expirations;
+
+	if (read(s->timer, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		die("Cannot read timer: %m");
+
+	switch (s->state) {
+	case STATE_ESCAPE:
+		sync_escape_burst(s);
+		sync_arm(s, SYNC_BURST_PERIOD, 0);
+		break;
+	case STATE_SEQ_ESCAPE:
+		sync_write(s, esc_seq, sizeof(esc_seq));
+		break;
+	case STATE_WRITE_CLEAR:
+		if (s->pending) {
+			sync_write(s, s->pending, s->pending_len);
+			s->pending = NULL;
+			sync_arm(s, 300000, 0);
+		} else {
+			/* no more ack replies for 300 ms */
+			s->done = 1;
+		}
+		break;
+	case STATE_WRITE_WTP:
+		if (s->pending) {
+			sync_write(s, s->pending, s->pending_len);
+			s->pending = NULL;
+			/* it is required to wait at least 0.5s */
+			sync_arm(s, 500000, 0);
+		} else {
+			sync_reading(s, 1);
+		}
+		break;
 	}
 }
 
-static void seq_write_thread_join(pthread_t write_thread)
+static void sync_read(struct wtp_sync *s)
 {
-	int ret;
+	const u8 bootrom_prompt_reply[] = {
+		'>', '>', 0x22, 0x33, 0x44, 0x55, 0x66, 0x77
+	};
+	u8 *buf = s->buf;
+	int ret, i;
+
+	ret = s->t->read(s->t, buf + s->len, sizeof(s->buf) - s->len);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+	else if (ret <= 0)
+		die("read failed: %m");
+
+	s->len += ret;
+
+	switch (s->state) {
+	case STATE_ESCAPE:
+		if (buf[s->len - 1] == 0x3e) {
+			sync_set_state(s, STATE_SEQ_ESCAPE);
+			printf("\e[0KReceived sync reply\n");
+			printf("Sending escape sequence with delay\n");
+		}
+		__attribute__((__fallthrough__));
 
-	ret = pthread_join(write_thread, NULL);
-	if (ret) {
-		errno = ret;
-		die("pthread_join failed: %m");
+	case STATE_SEQ_ESCAPE:
+		for (i = 8; i > 0; i--)
+			if (s->len >= i && !memcmp(buf + s->len - i, bootrom_prompt_reply, i))
+				break;
+
+		if (i > 0) {
+			if (i == 8 || (s->len - i >= 8 && !memcmp(buf + s->len - i - 8, bootrom_prompt_reply, 8))) {
+				sync_set_state(s, STATE_WRITE_WTP);
+				printf("\e[0KDetected BootROM command prompt\n");
+				printf("Sending wtp sequence\n");
+			} else {
+				memmove(buf, buf + s->len - i, i);
+				s->len = i;
+			}
+		} else if (s->len >= 16) {
+			if (is_all_zeros(buf + s->len - 16, 16)) {
+				sync_set_state(s, STATE_WRITE_CLEAR);
+				printf("\e[0KReceived ack reply\n");
+				printf("Sending clearbuf sequence\n");
+			} else if (buf[s->len - 1] != 0x3e) {
+				sync_set_state(s, STATE_ESCAPE);
+				printf("\e[0KInvalid reply 0x%02x, try restarting again\r", buf[s->len - 1]);
+				fflush(stdout);
+			}
+			s->len = 0;
+		}
+		break;
+
+	case STATE_WRITE_CLEAR:
+		if (is_all_zeros(buf, s->len)) {
+			/*
+			 * if we received too much ack replies after first read
+			 * (ack_count is non-zero), send clearbuf sequence again
+			 */
+			if (s->ack_count && s->ack_count + s->len > 1000) {
+				sync_send_after_cycle(s, clr_seq, sizeof(clr_seq));
+				s->ack_count = 0;
+			} else {
+				s->ack_count += s->len;
+				if (!s->pending)
+					sync_arm(s, 300000, 0);
+			}
+			s->len = 0;
+		} else {
+			sync_set_state(s, STATE_ESCAPE);
+			printf("\e[0KInvalid reply, try restarting again\r");
+			fflush(stdout);
+		}
+		break;
+
+	case STATE_WRITE_WTP:
+		/* 4095 bytes is size of kernel tty buffer, drop data from beginning of buffer and read remaining data */
+		if (s->len >= 4095) {
+			memmove(buf, buf + s->len - 7, 7);
+			s->len = 7;
+		} else if (s->len >= 8) {
+			if (!memcmp(buf + s->len - 8, "!\r\nwtp\r\n", 8)) {
+				s->done = 1;
+			} else {
+				sync_set_state(s, STATE_ESCAPE);
+				printf("\e[0KInvalid reply 0x%02x, try restarting again\r", buf[s->len - 1]);
+				fflush(stdout);
+			}
+		}
+		break;
 	}
 }
 
-static int is_all_zeros(const u8 *buf, int len)
+/*
+ * Sync all given ports with one thread. Events are tagged with 2 * port index,
+ * plus 1 for the timer of the port.
+ */
+static void sync_ports(struct wtp_sync **ports, int n)
 {
-	int i;
+	struct epoll_event ev, evs[16];
+	int epfd, i, nev, remaining;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		die("Cannot create epoll: %m");
+
+	for (i = 0; i < n; ++i) {
+		struct wtp_sync *s = ports[i];
+
+		s->idx = i;
+		s->epfd = epfd;
+		s->timer = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (s->timer < 0)
+			die("Cannot create timer: %m");
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = 2 * i;
+		s->reading = 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->t->fd, &ev) < 0)
+			die("Cannot add to epoll: %m");
+
+		ev.data.u64 = 2 * i + 1;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->timer, &ev) < 0)
+			die("Cannot add to epoll: %m");
+
+		s->state = STATE_ESCAPE;
+		sync_set_state(s, STATE_ESCAPE);
+	}
 
-	for (i = 0; i < len; ++i)
-		if (buf[i])
-			return 0;
+	remaining = n;
+	while (remaining) {
+		nev = epoll_wait(epfd, evs, 16, -1);
+		if (nev < 0 && errno == EINTR)
+			continue;
+		else if (nev < 0)
+			die("epoll_wait failed: %m");
 
-	return 1;
+		for (i = 0; i < nev; ++i) {
+			struct wtp_sync *s = ports[evs[i].data.u64 / 2];
+
+			if (s->done)
+				continue;
+
+			if (evs[i].data.u64 & 1)
+				sync_timer(s);
+			else
+				sync_read(s);
+
+			if (s->done) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, s->t->fd, NULL);
+				close(s->timer);
+				--remaining;
+			}
+		}
+	}
+
+	close(epfd);
 }
 
 /*
@@ -198,172 +671,179 @@ static int is_all_zeros(const u8 *buf, int len)
  */
 void initwtp(int escape_seq)
 {
-	const u8 bootrom_prompt_reply[] = {
-		'>', '>', 0x22, 0x33, 0x44, 0x55, 0x66, 0x77
-	};
-	pthread_t write_thread;
+	struct wtp_sync *sync;
 	struct termios2 opts;
-	struct pollfd pfd;
-	tcflag_t iflag;
-	int ack_count;
-	u8 buf[8192];
-	int len, i;
-	int done;
-	int ret;
+	tcflag_t iflag = 0;
+	u8 buf[8];
+
+	wtp_phase(escape_seq ? "escape" : "wtp");
 
 	if (!escape_seq) {
 		/* only send wtp command */
+		expect_reply(now(), 5, 8);
 		xwrite("\x03wtp\r", 5);
 		xread(buf, 8);
+		reply_done();
 		if (memcmp(buf, "!\r\nwtp\r\n", 8))
 			die("Invalid reply for command wtp, try again");
 		printf("Initialized WTP download mode\n\n");
 		return;
 	}
 
-	if (!isatty(wtpfd))
-		die("Cannot send escape sequence on non-tty file descriptor");
+	if (!wtp->is_serial)
+		die("Cannot send escape sequence on non-serial file descriptor");
 
 	/* set PARMRK to distinguish between zero byte and break condition */
-	xtcgetattr2(wtpfd, &opts);
-	iflag = opts.c_iflag;
-	opts.c_iflag |= PARMRK;
-	xtcsetattr2(wtpfd, &opts);
+	if (wtp->is_tty) {
+		xtcgetattr2(wtp->fd, &opts);
+		iflag = opts.c_iflag;
+		opts.c_iflag |= PARMRK;
+		xtcsetattr2(wtp->fd, &opts);
+	}
 
 	printf("Sending escape sequence, please power up the device\n");
-	seq_write_thread_start(&write_thread);
 
-	pfd.fd = wtpfd;
-	pfd.events = POLLIN;
+	sync = xmalloc(sizeof(*sync));
+	memset(sync, 0, sizeof(*sync));
+	sync->t = wtp;
+	sync_ports(&sync, 1);
+	free(sync);
 
-	len = 0;
-	ack_count = 0;
-	done = 0;
-
-	while (!done) {
-		if (state == STATE_WRITE_CLEAR || state == STATE_WRITE_WTP) {
-			pfd.revents = 0;
-			ret = poll(&pfd, 1, 300);
-			if (ret < 0)
-				die("poll failed: %m");
-			else if (!ret && state == STATE_WRITE_CLEAR)
-				break;
-		}
+	printf("\e[0KInitialized UART download mode\n\n");
 
-		ret = read(wtpfd, buf + len, sizeof(buf) - len);
-		if (ret <= 0)
-			die("read failed: %m");
+	/* restore previous iflag */
+	if (wtp->is_tty) {
+		xtcgetattr2(wtp->fd, &opts);
+		opts.c_iflag = iflag;
+		xtcsetattr2(wtp->fd, &opts);
+	}
+}
 
-		len += ret;
+static ssize_t tty_read(transport_t *t, void *buf, size_t len)
+{
+	return read(t->fd, buf, len);
+}
 
-		switch (state) {
-		case STATE_ESCAPE:
-			if (buf[len - 1] == 0x3e) {
-				state_store(STATE_SEQ_ESCAPE);
-				printf("\e[0KReceived sync reply\n");
-				printf("Sending escape sequence with delay\n");
-			}
-			__attribute__((__fallthrough__));
-
-		case STATE_SEQ_ESCAPE:
-			for (i = 8; i > 0; i--)
-				if (len >= i && !memcmp(buf + len - i, bootrom_prompt_reply, i))
-					break;
-
-			if (i > 0) {
-				if (i == 8 || (len - i >= 8 && !memcmp(buf + len - i - 8, bootrom_prompt_reply, 8))) {
-					state_store(STATE_WRITE_WTP);
-					printf("\e[0KDetected BootROM command prompt\n");
-					printf("Sending wtp sequence\n");
-					seq_write_thread_join(write_thread);
-					len = 0;
-					/* it is required to wait at least 0.5s */
-					usleep(500000);
-				} else {
-					memmove(buf, buf + len - i, i);
-					len = i;
-				}
-			} else {
-				if (len >= 16) {
-					if (is_all_zeros(buf + len - 16, 16)) {
-						state_store(STATE_WRITE_CLEAR);
-						printf("\e[0KReceived ack reply\n");
-						printf("Sending clearbuf sequence\n");
-						seq_write_thread_join(write_thread);
-						ack_count = 0;
-					} else if (buf[len - 1] != 0x3e) {
-						state_store(STATE_ESCAPE);
-						printf("\e[0KInvalid reply 0x%02x, try restarting again\r", buf[len - 1]);
-						fflush(stdout);
-					}
-					len = 0;
-				}
-			}
-			break;
+static ssize_t tty_write(transport_t *t, const void *buf, size_t len)
+{
+	ssize_t wr;
+	size_t done;
+
+	for (done = 0; done < len; done += wr) {
+		wr = write(t->fd, buf + done, len - done);
+		if (wr < 0 && errno == EINTR)
+			wr = 0;
+		else if (wr < 0)
+			return done ? (ssize_t)done : -1;
+	}
 
-		case STATE_WRITE_CLEAR:
-			if (is_all_zeros(buf, len)) {
-				/*
-				 * if we received too much ack replies after
-				 * first read (ack_count is non-zero), send
-				 * clearbuf sequence again
-				 */
-				if (ack_count && ack_count + len > 1000) {
-					seq_write_thread_start(&write_thread);
-					seq_write_thread_join(write_thread);
-					ack_count = 0;
-				} else {
-					ack_count += len;
-				}
-				len = 0;
-			} else {
-				state_store(STATE_ESCAPE);
-				seq_write_thread_start(&write_thread);
-				printf("\e[0KInvalid reply, try restarting again\r");
-				fflush(stdout);
-			}
-			break;
+	return done;
+}
 
-		case STATE_WRITE_WTP:
-			/* 4095 bytes is size of kernel tty buffer, drop data from beginning of buffer and read remaining data */
-			if (len >= 4095) {
-				memmove(buf, buf + len - 7, 7);
-				len = 7;
-			} else if (len >= 8) {
-				if (!memcmp(buf + len - 8, "!\r\nwtp\r\n", 8)) {
-					done = 1;
-				} else {
-					state_store(STATE_ESCAPE);
-					seq_write_thread_start(&write_thread);
-					printf("\e[0KInvalid reply 0x%02x, try restarting again\r", buf[len - 1]);
-					fflush(stdout);
-				}
-			}
-			break;
+static void tty_drain(transport_t *t)
+{
+	if (t->is_tty)
+		xtcdrain(t->fd);
+}
 
-		default:
-			__builtin_unreachable();
-		}
+static void tty_flush(transport_t *t, int queues)
+{
+	if (!t->is_tty)
+		return;
+
+	if (queues == (TRANSPORT_FLUSH_RX | TRANSPORT_FLUSH_TX))
+		xtcflush(t->fd, TCIOFLUSH);
+	else if (queues == TRANSPORT_FLUSH_RX)
+		xtcflush(t->fd, TCIFLUSH);
+	else if (queues == TRANSPORT_FLUSH_TX)
+		xtcflush(t->fd, TCOFLUSH);
+}
+
+static void tty_set_baudrate(transport_t *t, unsigned int baudrate);
+
+/*
+ * USB serial adapters deliver received data to the host in batches, after the
+ * adapter's latency timer expires (16 ms by default for FTDI chips). Each
+ * WTP command waits for a short reply, so this would be paid on every command.
+ * ASYNC_LOW_LATENCY makes drivers supporting it (ftdi_sio, 8250, ...) shorten
+ * the timer / push received data immediately. Old flags are restored on close.
+ */
+struct tty_priv {
+	int serial_flags;
+	int restore;
+};
+
+static int tty_low_latency(transport_t *t)
+{
+	struct tty_priv *priv = t->priv;
+	struct serial_struct ss;
+
+	if (ioctl(t->fd, TIOCGSERIAL, &ss) < 0)
+		return 0;
+
+	if (ss.flags & ASYNC_LOW_LATENCY)
+		return 1;
+
+	priv->serial_flags = ss.flags;
+	ss.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(t->fd, TIOCSSERIAL, &ss) < 0)
+		return 0;
+
+	priv->restore = 1;
+
+	return 1;
+}
+
+static void tty_close(transport_t *t)
+{
+	struct tty_priv *priv = t->priv;
+	struct serial_struct ss;
+
+	if (priv->restore && !ioctl(t->fd, TIOCGSERIAL, &ss)) {
+		ss.flags = priv->serial_flags;
+		ioctl(t->fd, TIOCSSERIAL, &ss);
 	}
 
-	printf("\e[0KInitialized UART download mode\n\n");
+	close(t->fd);
+	free(priv);
+	free(t);
+}
 
-	/* restore previous iflag */
-	xtcgetattr2(wtpfd, &opts);
-	opts.c_iflag = iflag;
-	xtcsetattr2(wtpfd, &opts);
+static transport_t *tty_transport(const char *name, int fd)
+{
+	transport_t *t;
+
+	t = xmalloc(sizeof(*t));
+	memset(t, 0, sizeof(*t));
+
+	t->name = name;
+	t->fd = fd;
+	t->is_tty = isatty(fd);
+	t->is_serial = t->is_tty;
+	t->read = tty_read;
+	t->write = tty_write;
+	t->drain = tty_drain;
+	t->flush = tty_flush;
+	t->set_baudrate = t->is_tty ? tty_set_baudrate : NULL;
+	t->sendfile = transport_sendfile;
+	t->close = tty_close;
+
+	t->priv = xmalloc(sizeof(struct tty_priv));
+	memset(t->priv, 0, sizeof(struct tty_priv));
+
+	return t;
 }
 
 void setwtpfd(const char *fdstr)
 {
 	char *end;
-	int flags;
+	int fd, flags;
 
-	wtpfd = strtol(fdstr, &end, 10);
-	if (*end || wtpfd < 0)
+	fd = strtol(fdstr, &end, 10);
+	if (*end || fd < 0)
 		die("Wrong file descriptor %s", fdstr);
 
-	flags = fcntl(wtpfd, F_GETFL);
+	flags = fcntl(fd, F_GETFL);
 	if (flags < 0 && errno == EBADF)
 		die("Wrong file descriptor %s", fdstr);
 
@@ -372,24 +852,30 @@ void setwtpfd(const char *fdstr)
 
 	if (flags & O_NONBLOCK) {
 		/* set to blocking mode */
-		if (fcntl(wtpfd, F_SETFL, flags & ~O_NONBLOCK))
+		if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK))
 			die("Unsetting O_NONBLOCK failed: %m");
 	}
+
+	wtp = tty_transport(fdstr, fd);
 }
 
 void openwtp(const char *path)
 {
 	struct termios2 opts;
-	int flags;
+	int fd, flags;
+
+	wtp = transport_open_socket(path) ? : transport_open_replay(path);
+	if (wtp)
+		return;
 
 	/* O_NONBLOCK is required to avoid hangs when CLOCAL is not set */
-	wtpfd = open(path, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	fd = open(path, O_RDWR | O_NONBLOCK | O_NOCTTY);
 
-	if (wtpfd < 0)
+	if (fd < 0)
 		die("Cannot open %s: %m", path);
 
 	memset(&opts, 0, sizeof(opts));
-	xtcgetattr2(wtpfd, &opts);
+	xtcgetattr2(fd, &opts);
 
 	cfmakeraw2(&opts);
 	opts.c_cflag |= CREAD | CLOCAL;
@@ -400,12 +886,17 @@ void openwtp(const char *path)
 	opts.c_cflag &= ~(CBAUD << IBSHIFT);
 	opts.c_cflag |= B0 << IBSHIFT;
 #endif
+	/*
+	 * Reads are preceded by poll(), so read() should return as soon as
+	 * anything was received, without waiting for more bytes or for the
+	 * inter-byte timer.
+	 */
 	opts.c_cc[VMIN] = 1;
 	opts.c_cc[VTIME] = 0;
 
-	xtcsetattr2(wtpfd, &opts);
+	xtcsetattr2(fd, &opts);
 
-	xtcgetattr2(wtpfd, &opts);
+	xtcgetattr2(fd, &opts);
 	if ((opts.c_cflag & CBAUD) != B115200)
 		die("Baudrate 115200 not supported");
 #ifdef IBSHIFT
@@ -413,22 +904,30 @@ void openwtp(const char *path)
 		die("Baudrate 115200 not supported");
 #endif
 
-	xtcflush(wtpfd, TCIFLUSH);
+	xtcflush(fd, TCIFLUSH);
 
-	flags = fcntl(wtpfd, F_GETFL);
+	flags = fcntl(fd, F_GETFL);
 	if (flags < 0)
 		die("Failure getting file descriptor flags: %m");
 
 	/* unset O_NONBLOCK */
-	if (fcntl(wtpfd, F_SETFL, flags & ~O_NONBLOCK))
+	if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK))
 		die("Unsetting O_NONBLOCK failed: %m");
+
+	wtp = tty_transport(path, fd);
+	wtp_low_latency = tty_low_latency(wtp);
+}
+
+void recordwtp(const char *path)
+{
+	wtp = trace_record(wtp, path);
 }
 
 void closewtp(void)
 {
-	if (wtpfd != -1)
-		close(wtpfd);
-	wtpfd = -1;
+	if (wtp)
+		wtp->close(wtp);
+	wtp = NULL;
 }
 
 /*
@@ -497,7 +996,7 @@ static int compute_tbg_freq(int xtal, int fbdiv, int refdiv, int vcodiv_sel)
 	return 1000000 * (u64)xtal * (fbdiv << 2) / (refdiv * (1 << vcodiv_sel));
 }
 
-static int compute_best_uart_params(u32 clk, u32 desired_baud, u32 *div, u32 *m)
+int compute_best_uart_params(u32 clk, u32 desired_baud, u32 *div, u32 *m)
 {
 	u8 m1, m2, m3, m4, best_m1, best_m2, best_m3, best_m4;
 	u64 ticks, ratio, err, best_err = -1ULL;
@@ -614,12 +1113,12 @@ is_within_tolerance(unsigned int value, unsigned int reference,
 	       100 * value <= reference * (100 + tolerance);
 }
 
-void change_baudrate(unsigned int baudrate)
+static void tty_set_baudrate(transport_t *t, unsigned int baudrate)
 {
 	struct termios2 opts = {};
 	tcflag_t cflag_speed = baudrate_to_cflag(baudrate);
 
-	xtcgetattr2(wtpfd, &opts);
+	xtcgetattr2(t->fd, &opts);
 	opts.c_cflag &= ~CBAUD;
 	opts.c_cflag |= cflag_speed;
 #ifdef IBSHIFT
@@ -629,8 +1128,8 @@ void change_baudrate(unsigned int baudrate)
 #ifdef BOTHER
 	opts.c_ispeed = opts.c_ospeed = baudrate;
 #endif
-	xtcsetattr2(wtpfd, &opts);
-	xtcgetattr2(wtpfd, &opts);
+	xtcsetattr2(t->fd, &opts);
+	xtcgetattr2(t->fd, &opts);
 #ifndef BOTHER
 	if ((opts.c_cflag & CBAUD) != cflag_speed)
 		die("Baudrate %u not supported", baudrate);
@@ -644,8 +1143,29 @@ void change_baudrate(unsigned int baudrate)
 	    !is_within_tolerance(opts.c_ispeed, baudrate, 3))
 		die("Baudrate %u not supported", baudrate);
 #endif
+}
+
+void change_baudrate(unsigned int baudrate)
+{
+	char prev[sizeof(link_phases[0].name)] = "";
+
+	if (!wtp->set_baudrate)
+		die("%s does not support baudrate change", wtp->name);
+
+	/*
+	 * line errors while switching are expected, count them separately (the
+	 * protocol phase is not changed, so no marker is put into traces)
+	 */
+	if (link_cur >= 0)
+		memcpy(prev, link_phases[link_cur].name, sizeof(prev));
+	link_sample("baudrate");
+
+	wtp->set_baudrate(wtp, baudrate);
+	wtp_baudrate = baudrate;
 	usleep(10000);
-	xtcflush(wtpfd, TCIFLUSH);
+	wtp->flush(wtp, TRANSPORT_FLUSH_RX);
+
+	link_sample(prev[0] ? prev : NULL);
 }
 
 void try_change_baudrate(unsigned int baudrate)
@@ -656,8 +1176,10 @@ void try_change_baudrate(unsigned int baudrate)
 
 	printf("Requesting baudrate change to %u baud\n", baudrate);
 
-	if (!isatty(wtpfd))
-		die("File descriptor is not tty and does not support baudrate change");
+	if (!wtp->set_baudrate)
+		die("%s does not support baudrate change", wtp->name);
+
+	wtp_phase("baudrate");
 
 	/*
 	 * Wait 100ms to make sure we send the "baud" command only after BootROM
@@ -665,12 +1187,14 @@ void try_change_baudrate(unsigned int baudrate)
 	 */
 	usleep(100000);
 
+	expect_reply(now(), 4, 256 + 4 + 5);
 	xwrite(buf, 4);
 
 	if (!read_until(buf, 4, 256))
 		die("Did not receive \"baud\" command reply!");
 
 	xread(buf, 5);
+	reply_done();
 
 	tbg_freq = compute_tbg_freq(buf[0], buf[1],
 				    ((buf[3] & 1) << 8) | buf[2], buf[4]);
@@ -706,13 +1230,70 @@ static void readresp(u8 cmd, u8 seq, u8 cid, resp_t *resp)
 		xread(((void *) resp) + 6, resp->len);
 }
 
-static void _sendcmd(u8 cmd, u8 seq, u8 cid, u8 flags, u32 len,
-		     const void *data, resp_t *resp)
+/* round trip times of commands (from sending to full reply), by command code */
+struct rtt_stat {
+	unsigned int count;
+	double min, max, sum;
+};
+
+static struct rtt_stat rtt_stats[256];
+
+static void rtt_add(u8 cmd, double rtt)
 {
-	u8 *buf;
+	struct rtt_stat *st = &rtt_stats[cmd];
+
+	if (!st->count || rtt < st->min)
+		st->min = rtt;
+	if (rtt > st->max)
+		st->max = rtt;
+	st->sum += rtt;
+	++st->count;
+}
 
-	buf = xmalloc(8 + len);
-	buf[0] = cmd;
+static const char *cmd_name(u8 cmd)
+{
+	switch (cmd) {
+	case 0x20: return "GetVersion";
+	case 0x22: return "Data";
+	case 0x26: return "SelectImage";
+	case 0x27: return "VerifyImage";
+	case 0x2a: return "DataHeader";
+	case 0x2b: return "Message";
+	case 0x30: return "Done";
+	default:   return "Unknown";
+	}
+}
+
+void wtp_print_rtt(void)
+{
+	const struct rtt_stat *st;
+	int cmd, printed = 0;
+
+	for (cmd = 0; cmd < 256; ++cmd) {
+		st = &rtt_stats[cmd];
+		if (!st->count)
+			continue;
+
+		if (!printed++)
+			printf("Command round trip times:\n");
+
+		printf("  %-12s %6u x  min %7.2f ms  avg %7.2f ms  max %7.2f ms\n",
+		       cmd_name(cmd), st->count, st->min * 1000,
+		       st->sum * 1000 / st->count, st->max * 1000);
+	}
+
+	if (printed && !wtp_low_latency && wtp->is_tty)
+		printf("  (low latency mode not supported by %s)\n", wtp->name);
+}
+
+static void _sendcmd(u8 cmd, u8 seq, u8 cid, u8 flags, u32 len,
+		     const void *data, resp_t *resp)
+{
+	double start;
+	u8 *buf;
+
+	buf = xmalloc(8 + len);
+	buf[0] = cmd;
 	buf[1] = seq;
 	buf[2] = cid;
 	buf[3] = flags;
@@ -721,11 +1302,26 @@ static void _sendcmd(u8 cmd, u8 seq, u8 cid, u8 flags, u32 len,
 	if (len)
 		memcpy(buf + 8, data, len);
 
+	/* up to 256 bytes of other output, header and up to 255 data bytes */
+	start = now();
+	expect_reply(start, 8 + len, 256 + 6 + 255);
 	xwrite(buf, 8 + len);
 	free(buf);
 
-	if (resp)
+	if (resp) {
+		double rtt;
+
 		readresp(cmd, seq, cid, resp);
+		rtt = now() - start;
+		rtt_add(cmd, rtt);
+
+		/* learn latency from commands answered without processing */
+		rtt -= wire_time(8 + len + 6 + resp->len);
+		if ((cmd == 0x20 || cmd == 0x2a) && rtt > reply_latency)
+			reply_latency = rtt;
+	}
+
+	reply_done();
 }
 
 static void checkresp(resp_t *resp)
@@ -764,10 +1360,13 @@ static void preamble(void)
 {
 	static const u8 chk[4] = { 0x00, 0xd3, 0x02, 0x2b };
 
+	expect_reply(now(), 4, 256 + 4);
 	xwrite("\x00\xd3\x02\x2b", 4);
 
 	if (!read_until(chk, sizeof(chk), 256))
 		die("Wrong reply to preamble");
+
+	reply_done();
 }
 
 static void getversion(void)
@@ -795,10 +1394,62 @@ static void getversion(void)
 	}
 }
 
+static int cmp_rtt(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Measure the round trip of count GetVersion commands. The command and its
+ * reply take 26 bytes on the line (2.26 ms at 115200 baud), anything above is
+ * added by the adapter, its driver and the BootROM.
+ */
+void wtp_probe_latency(int count)
+{
+	const double wire = wire_time(26);
+	double *rtt, start, median;
+	resp_t resp;
+	int i;
+
+	wtp_phase("probe");
+	preamble();
+
+	rtt = xmalloc(count * sizeof(*rtt));
+	for (i = 0; i < count; ++i) {
+		start = now();
+		sendcmd(0x20, 0, 0, 0, 0, NULL, &resp);
+		rtt[i] = now() - start;
+	}
+
+	qsort(rtt, count, sizeof(*rtt), cmp_rtt);
+	median = rtt[count / 2];
+
+	printf("Round trip latency over %i commands: min %.2f ms, median %.2f ms, "
+	       "99%% %.2f ms, max %.2f ms\n", count, rtt[0] * 1000,
+	       median * 1000, rtt[count * 99 / 100] * 1000,
+	       rtt[count - 1] * 1000);
+	printf("Latency added to each command: %.2f ms%s\n",
+	       median > wire ? (median - wire) * 1000 : 0,
+	       wtp->is_tty && !wtp_low_latency ?
+			" (low latency mode not supported)" : "");
+
+	if (median - wire > 0.004)
+		printf("Warning: %s is slow to deliver replies, uploads will "
+		       "take long\n", wtp->name);
+
+	free(rtt);
+
+	/* command statistics are reported for the upload only */
+	memset(rtt_stats, 0, sizeof(rtt_stats));
+}
+
 u32 selectimage(void)
 {
 	resp_t resp;
 
+	wtp_phase("select");
 	preamble();
 	getversion();
 
@@ -810,6 +1461,105 @@ u32 selectimage(void)
 	return *(u32 *) resp.data;
 }
 
+/* fast mode data are sent in chunks of this size, for progress reporting */
+#define FAST_CHUNK	65536
+
+/*
+ * In real-time mode the tty TX queue is checked after each chunk of fast mode
+ * data. If more time passed since the previous chunk than the line needed to
+ * send the bytes that left the queue, the queue ran empty and the line was
+ * idle (up to the FIFO of the adapter): the chunk missed its deadline.
+ */
+#define DEADLINE_SLACK	0.001
+
+static struct {
+	int enabled;
+	double last;
+	int queued;
+	unsigned int chunks, missed;
+	double idle, worst;
+} deadlines;
+
+static void deadline_start(void)
+{
+	memset(&deadlines, 0, sizeof(deadlines));
+
+	if (!realtime_enabled() || !wtp->is_tty ||
+	    ioctl(wtp->fd, TIOCOUTQ, &deadlines.queued) < 0)
+		return;
+
+	deadlines.enabled = 1;
+	deadlines.last = now();
+}
+
+static void deadline_check(u32 len)
+{
+	double t, idle;
+	int queued;
+
+	if (!deadlines.enabled)
+		return;
+
+	t = now();
+	if (ioctl(wtp->fd, TIOCOUTQ, &queued) < 0)
+		die("Cannot get tty output queue size: %m");
+
+	idle = t - deadlines.last -
+	       wire_time(deadlines.queued + len - queued);
+	if (idle > DEADLINE_SLACK) {
+		++deadlines.missed;
+		deadlines.idle += idle;
+		if (idle > deadlines.worst)
+			deadlines.worst = idle;
+	}
+
+	++deadlines.chunks;
+	deadlines.last = t;
+	deadlines.queued = queued;
+}
+
+static void deadline_report(void)
+{
+	if (!deadlines.enabled)
+		return;
+
+	printf("Missed deadlines: %u of %u chunks, line idle %.1f ms "
+	       "(worst %.1f ms)\n", deadlines.missed, deadlines.chunks,
+	       deadlines.idle * 1000, deadlines.worst * 1000);
+}
+
+/*
+ * Send data of image in fast mode. Images mapped from files are sent with
+ * sendfile(), so that the upload does not stall on page faults of the mapping,
+ * unless the transport does not support it (e.g. when recording).
+ */
+static void sendfast(const image_t *img, u32 offset, u32 len)
+{
+	static int no_sendfile;
+	ssize_t res;
+	off_t off;
+	int fd;
+
+	fd = wtp->sendfile && !no_sendfile ? image_file(img, &off) : -1;
+	if (fd >= 0) {
+		off += offset;
+		res = wtp->sendfile(wtp, fd, &off, len);
+		if (res == len)
+			return;
+
+		if (res > 0)
+			die("Cannot send %u bytes: sent only %zi", len, res);
+
+		/* not supported for this fd pair, use write() from now on */
+		if (res < 0 && errno != EINVAL && errno != ENOSYS)
+			die("Cannot send %u bytes: %m", len);
+
+		no_sendfile = 1;
+	}
+
+	xwrite(img->data + offset, len);
+}
+
 void sendimage(image_t *img, int fast)
 {
 	static int seq = 1;
@@ -819,6 +1569,10 @@ void sendimage(image_t *img, int fast)
 	double start;
 	int diff;
 	int istty = isatty(STDOUT_FILENO);
+	char phase[16];
+
+	snprintf(phase, sizeof(phase), "image %s", id2name(img->id));
+	wtp_phase(phase);
 
 	buf[0] = 0;
 	sendcmd(0x27, 0, 0, 0, 1, buf, &resp);
@@ -845,11 +1599,21 @@ void sendimage(image_t *img, int fast)
 		if (img->size - sent < tosend)
 			tosend = img->size - sent;
 
-		if (fast)
-			xwrite(img->data + sent, tosend);
-		else
+		if (fast && tosend > FAST_CHUNK)
+			tosend = FAST_CHUNK;
+
+		/* the image may still be being decompressed */
+		image_wait(img, sent + tosend);
+
+		if (fast) {
+			if (!sent)
+				deadline_start();
+			sendfast(img, sent, tosend);
+			deadline_check(tosend);
+		} else {
 			sendcmd(0x22, seq, 0, 0, tosend, img->data + sent,
 				&resp);
+		}
 
 		sent += tosend;
 
@@ -879,57 +1643,165 @@ void sendimage(image_t *img, int fast)
 		printf("\n");
 	}
 
+	if (fast)
+		deadline_report();
+
 	if (fast) {
+		/* the BootROM replies after receiving all data, still queued */
+		expect_reply(now(), tx_pending(), 256 + 6);
 		readresp(0x22, seq, 0, &resp);
+		reply_done();
 		checkresp(&resp);
 	}
 
 	sendcmd(0x30, 0, 0, 0, 0, NULL, &resp);
 }
 
-static void eccread(void *_buf, size_t size)
+/* bits received in ECC encoded replies, and how many of them were corrected */
+static u64 ecc_bits, ecc_corrected;
+
+void wtp_ecc_stats(u64 *bits, u64 *corrected)
 {
-	static const u8 ecc[128] = {
-		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
-		0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1,
-		0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1,
-		0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
-		0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1,
-		0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
-		0, 0, 0, 1, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1,
-		0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
-	};
-	size_t i;
-	int j;
-	u8 eccbuf[8], *buf, c;
+	*bits = ecc_bits;
+	*corrected = ecc_corrected;
+}
+
+/*
+ * Decode one byte from 8 bytes of ECC encoded reply. Every bit is sent as a
+ * whole byte, with the lower 7 bits set to the value of the bit, so the bit is
+ * their majority. All 8 bytes are handled at once in a 64-bit word: popcount
+ * of every byte, then bit 3 of popcount + 4 is the majority.
+ */
+static inline u8 ecc_decode(const u8 *in, u64 *corrected)
+{
+	u64 x, maj;
+
+	memcpy(&x, in, 8);
+	x = le64toh(x) & 0x7f7f7f7f7f7f7f7fULL;
+
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+
+	maj = ((x + 0x0404040404040404ULL) >> 3) & 0x0101010101010101ULL;
+
+	/* bits differing from the majority, 7 - popcount = popcount ^ 7 */
+	if (x != maj * 7) {
+		x ^= maj * 7;
+		*corrected += (x * 0x0101010101010101ULL) >> 56;
+	}
+
+	/* gather bit 0 of byte j to bit j */
+	return (maj * 0x0102040810204080ULL) >> 56;
+}
 
-	buf = _buf;
+void eccread(void *_buf, size_t size)
+{
+	u8 eccbuf[8 * 256], *buf = _buf;
+	size_t i, n;
+
+	expect_reply(now(), 0, 8 * size);
+
+	/* replies are short, usually read with one call */
+	while (size) {
+		n = size < 256 ? size : 256;
 
-	for (i = 0; i < size; ++i) {
-		xread(eccbuf, 8);
+		xread(eccbuf, 8 * n);
 
-		c = 0;
-		for (j = 0; j < 8; ++j)
-			c |= ecc[eccbuf[j] & 0x7f] << j;
+		for (i = 0; i < n; ++i)
+			buf[i] = ecc_decode(&eccbuf[8 * i], &ecc_corrected);
 
-		buf[i] = c;
+		ecc_bits += 8 * n;
+		buf += n;
+		size -= n;
 	}
+
+	reply_done();
+}
+
+static void print_ecc_stats(void)
+{
+	if (ecc_corrected)
+		printf("Corrected %llu of %llu received bits\n", ecc_corrected,
+		       ecc_bits);
+}
+
+/*
+ * Number of line errors and bits corrected by ECC so far, outside of phases
+ * where errors are expected. Non-zero means the link is degrading (a lower
+ * baudrate, another cable or adapter should be used).
+ */
+u64 wtp_link_errors(void)
+{
+	u64 errors = ecc_corrected;
+	int i;
+
+	/* count the current phase up to now */
+	link_sample(link_cur >= 0 ? link_phases[link_cur].name : NULL);
+
+	for (i = 0; i < link_nphases; ++i)
+		if (!link_errors_expected(&link_phases[i]))
+			errors += link_phase_errors(&link_phases[i]);
+
+	return errors;
+}
+
+void wtp_print_link_health(void)
+{
+	const struct link_phase *p;
+	u32 rx = 0, tx = 0;
+	u64 errors;
+	int i;
+
+	errors = wtp_link_errors();
+	if (!link_nphases && !ecc_bits)
+		return;
+
+	for (i = 0; i < link_nphases; ++i) {
+		rx += link_phases[i].rx;
+		tx += link_phases[i].tx;
+	}
+
+	printf("Link health of %s: %s", wtp->name,
+	       errors ? "degraded" : "good");
+	if (link_nphases)
+		printf(" (%u bytes received, %u sent)", rx, tx);
+	printf("\n");
+
+	for (i = 0; i < link_nphases; ++i) {
+		p = &link_phases[i];
+		if (!link_phase_errors(p))
+			continue;
+
+		printf("  %-12s frame %u, overrun %u, parity %u, break %u, "
+		       "buffer overrun %u%s\n", p->name, p->frame, p->overrun,
+		       p->parity, p->brk, p->buf_overrun,
+		       link_errors_expected(p) ? " (expected)" : "");
+	}
+
+	if (ecc_corrected)
+		printf("  ECC          corrected %llu of %llu received bits\n",
+		       ecc_corrected, ecc_bits);
 }
 
 void uart_otp_read(void)
 {
-	u8 buf[19];
+	u8 rows[44][19], *buf;
 	int i;
 
-	eccread(buf, 4);
-	if (memcmp(buf, "OTP\n", 4))
-		die("Wrong reply: \"%.*s\"", 4, buf);
+	wtp_phase("otp-read");
+	eccread(rows[0], 4);
+	if (memcmp(rows[0], "OTP\n", 4))
+		die("Wrong reply: \"%.*s\"", 4, rows[0]);
+
+	/* all rows are sent at once */
+	eccread(rows, sizeof(rows));
 
 	for (i = 0; i < 44; ++i) {
 		u64 val;
 		char *end;
 
-		eccread(buf, 19);
+		buf = rows[i];
 
 		val = strtoull((char *)buf + 2, &end, 16);
 
@@ -941,6 +1813,7 @@ void uart_otp_read(void)
 		       buf[0] == '1' ? "locked" : "not locked");
 	}
 
+	print_ecc_stats();
 	printf("All done.\n");
 }
 
@@ -949,6 +1822,7 @@ void uart_deploy(void)
 	u8 buf[134];
 	int ram;
 
+	wtp_phase("deploy");
 	eccread(buf, 4);
 	if (memcmp(buf, "RAM", 3) || buf[3] < '0' || buf[3] > '3')
 		goto wrong;
@@ -1002,6 +1876,7 @@ void uart_deploy(void)
 
 	printf("ECDSA Public Key: %.*s\n", 134, buf);
 
+	print_ecc_stats();
 	printf("All done.\n");
 
 	return;
@@ -1013,140 +1888,468 @@ wrong:
 	printf("FAIL%.*s\n", 13, buf);
 }
 
-static int uart_terminal_pipe(int in, int out, const char *quit, int *s,
-			      const char *kbs, int *k)
+/*
+ * The log is flushed at most once per second, and when the board stops
+ * sending (in the terminal), instead of costing a write() for every read.
+ */
+#define UART_LOG_FLUSH_INTERVAL	1.0
+
+static FILE *uart_log_fp;
+static double uart_log_flushed;
+static int uart_log_dirty;
+static double uart_log_start;
+static int uart_log_bol = 1;
+
+void uart_log_open(const char *path)
 {
-	char buf[128];
-	ssize_t nin, nout, noff;
+	uart_log_fp = fopen(path, "a");
+	if (!uart_log_fp)
+		die("Cannot open log file %s: %m", path);
 
-	nin = read(in, buf, sizeof(buf));
-	if (nin <= 0)
-		return -1;
+	setvbuf(uart_log_fp, NULL, _IOFBF, 65536);
+	uart_log_start = uart_log_flushed = now();
+}
 
-	noff = 0;
+static void uart_log_flush(void)
+{
+	if (!uart_log_dirty)
+		return;
 
-	if (quit || kbs) {
-		int i;
+	fflush(uart_log_fp);
+	uart_log_flushed = now();
+	uart_log_dirty = 0;
+}
 
-		for (i = 0; i < nin; i++) {
-			if ((quit || kbs) && (!quit || buf[i] != quit[*s]) &&
-			    (!kbs || buf[i] != kbs[*k])) {
-				const char *prefix;
-				ssize_t poff;
-				int plen;
+/*
+ * Write data received from the board to the log, prefixing every line with
+ * the monotonic time (in seconds since the log was opened) at which the first
+ * byte of the line was received.
+ */
+static void uart_log(const char *buf, size_t len)
+{
+	const char *nl;
+	size_t n;
 
-				if (quit && kbs) {
-					prefix = (*s >= *k) ? quit : kbs;
-					plen = (*s >= *k) ? *s : *k;
-				} else if (quit) {
-					prefix = quit;
-					plen = *s;
-				} else {
-					prefix = kbs;
-					plen = *k;
-				}
+	if (!uart_log_fp)
+		return;
 
-				if (plen > i) {
-					/*
-					 * Write prefix of the quit/backspace
-					 * sequence from the end of buffer of
-					 * the previous read() call.
-					 */
-					poff = 0;
-					while (plen - i > poff) {
-						nout = write(out, prefix + poff,
-							     plen - i - poff);
-						if (nout < 0 && errno == EINTR)
-							continue;
-						if (nout <= 0)
-							return -1;
-						poff += nout;
-					}
-				}
-			}
+	while (len) {
+		if (uart_log_bol)
+			fprintf(uart_log_fp, "[%12.6f] ", now() - uart_log_start);
 
-			if (quit && buf[i] == quit[*s]) {
-				(*s)++;
-				if (!quit[*s]) {
-					nin = i - *s;
-					break;
-				}
-			} else if (quit) {
-				*s = 0;
-			}
+		nl = memchr(buf, '\n', len);
+		n = nl ? nl - buf + 1 : len;
+		fwrite(buf, 1, n, uart_log_fp);
+		uart_log_bol = !!nl;
 
-			if (kbs && buf[i] == kbs[*k]) {
-				(*k)++;
-				if (!kbs[*k]) {
-					/*
-					 * Write everything before the backspace
-					 * sequence.
-					 */
-					while (i - *k > noff) {
-						nout = write(out, buf + noff,
-							     i - *k - noff);
-						if (nout < 0 && errno == EINTR)
-							continue;
-						if (nout <= 0)
-							return -1;
-						noff += nout;
-					}
+		buf += n;
+		len -= n;
+	}
 
-					/*
-					 * Replace backspace key by '\b' (0x08)
-					 * byte which is the only recognized
-					 * backspace byte by Marvell BootROM.
-					 */
-					if (write(out, "\x08", 1) < 0)
-						return -1;
-					noff = i + 1;
-					*k = 0;
-				}
-			} else if (kbs) {
-				*k = 0;
-			}
+	uart_log_dirty = 1;
+	if (now() - uart_log_flushed >= UART_LOG_FLUSH_INTERVAL)
+		uart_log_flush();
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t wr;
+
+	while (len) {
+		wr = write(fd, buf, len);
+		if (wr < 0 && errno == EINTR)
+			continue;
+		if (wr <= 0)
+			return -1;
+
+		buf += wr;
+		len -= wr;
+	}
+
+	return 0;
+}
+
+/*
+ * Scripted console, run after images are uploaded. The script file consists of
+ * lines of the form
+ *
+ *   expect PATTERN [send STRING] [exit CODE] [timeout SECONDS]
+ *   fail PATTERN [exit CODE]
+ *   timeout SECONDS
+ *
+ * where PATTERN and STRING are either bare words or double quoted strings with
+ * C-like escapes (\n, \r, \t, \e, \\, \", \xHH). The expect rules are waited
+ * for one after another, each for at most its timeout (the last global timeout
+ * by default); when the pattern is received, STRING is sent and, if given, the
+ * program exits with CODE. A fail rule is active for the whole script and
+ * makes the program exit as soon as its pattern is received. Lines starting
+ * with # are comments.
+ */
+struct expect_rule {
+	int fail;
+	char *pattern;
+	size_t patlen;
+	char *send;
+	size_t sendlen;
+	int exit_code;
+	int timeout;
+};
+
+static char *expect_parse_string(char **pp, size_t *lenp, const char *path,
+				 int line)
+{
+	char *p = *pp, *res, *out;
+
+	p += strspn(p, " \t");
+	if (!*p || *p == '\n')
+		die("Missing argument (%s:%i)", path, line);
+
+	res = out = xmalloc(strlen(p) + 1);
+
+	if (*p != '"') {
+		size_t len = strcspn(p, " \t\n");
+
+		memcpy(res, p, len);
+		*pp = p + len;
+		*lenp = len;
+		return res;
+	}
+
+	for (++p; *p != '"'; ++p) {
+		if (!*p || *p == '\n')
+			die("Unterminated string (%s:%i)", path, line);
+
+		if (*p != '\\') {
+			*out++ = *p;
+			continue;
 		}
 
-		/*
-		 * Drop prefix of the quit/backspace sequence from the end of
-		 * the buffer. If quit/backspace sequence is not later detected
-		 * then dropped prefix will be inserted.
-		 */
-		if (i == nin) {
-			i = 0;
-			if (quit && i < *s)
-				i = *s;
-			if (kbs && i < *k)
-				i = *k;
-			nin -= i;
+		switch (*++p) {
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'e':
+			*out++ = '\e';
+			break;
+		case 'x':
+			if (!isxdigit(p[1]) || !isxdigit(p[2]))
+				die("Invalid \\x escape (%s:%i)", path, line);
+			*out++ = strtoul((char []){ p[1], p[2], 0 }, NULL, 16);
+			p += 2;
+			break;
+		case '\\':
+		case '"':
+			*out++ = *p;
+			break;
+		default:
+			die("Invalid escape sequence \\%c (%s:%i)", *p, path,
+			    line);
 		}
 	}
 
-	while (nin > noff) {
-		nout = write(out, buf + noff, nin - noff);
-		if (nout < 0 && errno == EINTR)
+	*pp = p + 1;
+	*lenp = out - res;
+
+	return res;
+}
+
+static int expect_parse_number(char **pp, int scale, const char *path, int line)
+{
+	char *p = *pp, *end;
+	double val;
+
+	val = strtod(p, &end);
+	if (end == p || val < 0 || val * scale > 0x7fffffff)
+		die("Invalid number (%s:%i)", path, line);
+
+	*pp = end;
+
+	return lrint(val * scale);
+}
+
+static int expect_parse(const char *path, struct expect_rule **rulesp)
+{
+	struct expect_rule *rules = NULL, *rule;
+	int nrules = 0, timeout = 10000, linenum = 0;
+	char *line = NULL, *p;
+	size_t n = 0, len;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		die("Cannot open expect script %s: %m", path);
+
+	while (getline(&line, &n, fp) != -1) {
+		++linenum;
+
+		p = line + strspn(line, " \t");
+		if (!*p || *p == '\n' || *p == '#')
 			continue;
-		if (nout <= 0)
-			return -1;
-		noff += nout;
+
+		if (!strncmp(p, "timeout", 7) && isspace(p[7])) {
+			p += 7;
+			timeout = expect_parse_number(&p, 1000, path, linenum);
+			continue;
+		} else if (!(!strncmp(p, "expect", 6) && isspace(p[6])) &&
+			   !(!strncmp(p, "fail", 4) && isspace(p[4]))) {
+			die("Unknown command (%s:%i)", path, linenum);
+		}
+
+		rules = xrealloc(rules, (nrules + 1) * sizeof(*rules));
+		rule = &rules[nrules++];
+		memset(rule, 0, sizeof(*rule));
+		rule->fail = *p == 'f';
+		rule->exit_code = rule->fail ? EXIT_FAILURE : -1;
+		rule->timeout = timeout;
+
+		p += rule->fail ? 4 : 6;
+		rule->pattern = expect_parse_string(&p, &rule->patlen, path,
+						    linenum);
+		if (!rule->patlen)
+			die("Empty pattern (%s:%i)", path, linenum);
+
+		while (1) {
+			p += strspn(p, " \t");
+			if (!*p || *p == '\n' || *p == '#')
+				break;
+
+			len = strcspn(p, " \t\n");
+			if (len == 4 && !strncmp(p, "send", 4) && !rule->fail) {
+				p += 4;
+				rule->send = expect_parse_string(&p,
+								 &rule->sendlen,
+								 path, linenum);
+			} else if (len == 4 && !strncmp(p, "exit", 4)) {
+				p += 4;
+				rule->exit_code = expect_parse_number(&p, 1, path,
+								      linenum);
+			} else if (len == 7 && !strncmp(p, "timeout", 7) &&
+				   !rule->fail) {
+				p += 7;
+				rule->timeout = expect_parse_number(&p, 1000,
+								    path,
+								    linenum);
+			} else {
+				die("Unknown argument \"%.*s\" (%s:%i)",
+				    (int)len, p, path, linenum);
+			}
+		}
 	}
 
-	return 0;
+	free(line);
+	fclose(fp);
+
+	*rulesp = rules;
+
+	return nrules;
+}
+
+static void expect_exit(int code)
+{
+	wtp_print_link_health();
+	fflush(stdout);
+	closewtp();
+	exit(code);
+}
+
+void uart_expect(const char *path)
+{
+	struct expect_rule *rules, *step;
+	size_t maxlen = 0, len = 0, size;
+	int nrules, i, cur;
+	double deadline;
+	char *buf;
+
+	nrules = expect_parse(path, &rules);
+	wtp_phase("expect");
+
+	for (i = 0; i < nrules; ++i)
+		if (rules[i].patlen > maxlen)
+			maxlen = rules[i].patlen;
+
+	size = maxlen + 4096;
+	buf = xmalloc(size);
+
+	for (cur = 0; cur < nrules && rules[cur].fail; ++cur);
+	step = cur < nrules ? &rules[cur] : NULL;
+	deadline = step ? now() + step->timeout / 1000.0 : 0;
+
+	while (step) {
+		struct pollfd pfd;
+		char *match;
+		ssize_t rd;
+		int ret;
+
+		pfd.fd = wtp->fd;
+		pfd.events = POLLIN;
+		ret = poll(&pfd, 1, lrint(fmax(deadline - now(), 0) * 1000));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		else if (ret < 0)
+			die("Cannot poll: %m");
+
+		if (!ret) {
+			printf("\n\nTimeout while waiting for \"%.*s\"\n",
+			       (int)step->patlen, step->pattern);
+			expect_exit(EXIT_FAILURE);
+		}
+
+		rd = wtp->read(wtp, buf + len, size - len);
+		if (rd < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		else if (rd <= 0)
+			die("Cannot read: %m");
+
+		fwrite(buf + len, 1, rd, stdout);
+		fflush(stdout);
+		uart_log(buf + len, rd);
+		len += rd;
+
+		for (i = 0; i < nrules; ++i) {
+			if (!rules[i].fail ||
+			    !memmem(buf, len, rules[i].pattern, rules[i].patlen))
+				continue;
+
+			printf("\n\nReceived \"%.*s\", failing\n",
+			       (int)rules[i].patlen, rules[i].pattern);
+			expect_exit(rules[i].exit_code);
+		}
+
+		while (step &&
+		       (match = memmem(buf, len, step->pattern, step->patlen))) {
+			if (step->sendlen)
+				xwrite(step->send, step->sendlen);
+
+			if (step->exit_code >= 0)
+				expect_exit(step->exit_code);
+
+			/* the next pattern is searched only after this match */
+			match += step->patlen;
+			len -= match - buf;
+			memmove(buf, match, len);
+
+			for (++cur; cur < nrules && rules[cur].fail; ++cur);
+			step = cur < nrules ? &rules[cur] : NULL;
+			if (step)
+				deadline = now() + step->timeout / 1000.0;
+		}
+
+		/* keep only what can still be a part of a pattern */
+		if (len >= maxlen) {
+			memmove(buf, buf + len - (maxlen - 1), maxlen - 1);
+			len = maxlen - 1;
+		}
+	}
+
+	for (i = 0; i < nrules; ++i) {
+		free(rules[i].pattern);
+		free(rules[i].send);
+	}
+	free(rules);
+	free(buf);
+}
+
+/* find first occurence of first byte of quit or backspace sequence */
+static const char *find_seq_start(const struct terminal_input *ti,
+				  const char *p, const char *end)
+{
+	const char *q, *k;
+
+	q = memchr(p, ti->quit[0], end - p);
+	if (!ti->kbslen || ti->kbs[0] == ti->quit[0])
+		return q;
+
+	k = memchr(p, ti->kbs[0], (q ? q : end) - p);
+
+	return k ? k : q;
+}
+
+/*
+ * Process keyboard input: replace every occurence of the backspace sequence by
+ * '\b' (0x08), which is the only recognized backspace byte by Marvell BootROM,
+ * and stop at the quit sequence. Input is scanned with memchr() for the first
+ * bytes of these sequences, so ordinary input is just copied.
+ */
+size_t terminal_input_process(struct terminal_input *ti, const char *in,
+			      size_t len, char *out)
+{
+	char buf[sizeof(ti->pending) + 4096];
+	const char *p, *end, *seq;
+	size_t n, rem, olen = 0;
+
+	memcpy(buf, ti->pending, ti->npending);
+	memcpy(buf + ti->npending, in, len);
+	p = buf;
+	end = buf + ti->npending + len;
+	ti->npending = 0;
+
+	while (p < end) {
+		seq = find_seq_start(ti, p, end);
+		if (!seq)
+			seq = end;
+
+		n = seq - p;
+		memcpy(out + olen, p, n);
+		olen += n;
+		p = seq;
+
+		if (p == end)
+			break;
+
+		rem = end - p;
+
+		if (rem >= ti->quitlen && !memcmp(p, ti->quit, ti->quitlen)) {
+			ti->quitted = 1;
+			return olen;
+		} else if (ti->kbslen && rem >= ti->kbslen &&
+			   !memcmp(p, ti->kbs, ti->kbslen)) {
+			out[olen++] = '\b';
+			p += ti->kbslen;
+		} else if ((rem < ti->quitlen && !memcmp(p, ti->quit, rem)) ||
+			   (rem < ti->kbslen && !memcmp(p, ti->kbs, rem))) {
+			/* possible start of a sequence, wait for more input */
+			memcpy(ti->pending, p, rem);
+			ti->npending = rem;
+			break;
+		} else {
+			out[olen++] = *p++;
+		}
+	}
+
+	return olen;
 }
 
 const char *uart_terminal_kbs = NULL;
 
 void uart_terminal(void) {
 	const char *quit = "\34c";
-	const char *kbs = uart_terminal_kbs;
+	struct terminal_input ti = {};
 	struct termios2 otio, tio;
-	int in, s, k;
+	struct pollfd pfd[2];
+	char *buf, *out;
+	int in, nfds;
+	ssize_t rd;
 
-	if (wtpfd < 0)
+	if (!wtp)
 		return;
 
+	wtp_phase("terminal");
+
 	in = isatty(STDIN_FILENO) ? STDIN_FILENO : -1;
 
+	ti.quit = quit;
+	ti.quitlen = strlen(quit);
+	ti.kbs = uart_terminal_kbs;
+	ti.kbslen = ti.kbs ? strlen(ti.kbs) : 0;
+	if (ti.kbslen >= sizeof(ti.pending))
+		ti.kbslen = 0;
+
 	if (in >= 0) {
 		memset(&otio, 0, sizeof(otio));
 		xtcgetattr2(in, &otio);
@@ -1157,37 +2360,59 @@ void uart_terminal(void) {
 		       quit[0] | 0100, quit[1]);
 	}
 
-	s = 0;
-	k = 0;
+	fflush(stdout);
 
-	do {
-		fd_set rfds;
-		int nfds = 0;
+	buf = xmalloc(65536);
+	out = xmalloc(sizeof(ti.pending) + 4096);
 
-		FD_ZERO(&rfds);
-		FD_SET(wtpfd, &rfds);
-		nfds = nfds < wtpfd ? wtpfd : nfds;
+	pfd[0].fd = wtp->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = in;
+	pfd[1].events = POLLIN;
+	nfds = in >= 0 ? 2 : 1;
 
-		if (in >= 0) {
-			FD_SET(in, &rfds);
-			nfds = nfds < in ? in : nfds;
-		}
+	while (!ti.quitted) {
+		int ret;
 
-		nfds = select(nfds + 1, &rfds, NULL, NULL, NULL);
-		if (nfds < 0)
+		ret = poll(pfd, nfds, uart_log_dirty ?
+			   lrint(UART_LOG_FLUSH_INTERVAL * 1000) : -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
+		} else if (!ret) {
+			uart_log_flush();
+			continue;
+		}
 
-		if (FD_ISSET(wtpfd, &rfds)) {
-			if (uart_terminal_pipe(wtpfd, STDOUT_FILENO,
-					       NULL, NULL, NULL, NULL))
+		if (pfd[0].revents) {
+			rd = wtp->read(wtp, buf, 65536);
+			if (rd < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (rd <= 0 || write_all(STDOUT_FILENO, buf, rd))
 				break;
+
+			uart_log(buf, rd);
 		}
 
-		if (in >= 0 && FD_ISSET(in, &rfds)) {
-			if (uart_terminal_pipe(in, wtpfd, quit, &s, kbs, &k))
+		if (nfds > 1 && pfd[1].revents) {
+			size_t olen;
+
+			rd = read(in, buf, 4096);
+			if (rd < 0 && errno == EINTR)
+				continue;
+			if (rd <= 0)
+				break;
+
+			olen = terminal_input_process(&ti, buf, rd, out);
+			if (olen && wtp->write(wtp, out, olen) < 0)
 				break;
 		}
-	} while (quit[s] != 0);
+	}
+
+	uart_log_flush();
+	free(buf);
+	free(out);
 
 	if (in >= 0)
 		xtcsetattr2(in, &otio);
@@ -21,14 +21,23 @@ typedef struct {
 
 extern void setwtpfd(const char *fdstr);
 extern void openwtp(const char *path);
+extern void recordwtp(const char *path);
 extern void initwtp(int escape_seq);
 extern void closewtp(void);
+extern void wtp_set_timeouts(const char *spec);
 extern void change_baudrate(unsigned int baudrate);
 extern void try_change_baudrate(unsigned int baudrate);
 extern u32 selectimage(void);
 extern void sendimage(image_t *img, int fast);
+extern void wtp_probe_latency(int count);
+extern void wtp_print_rtt(void);
 extern void uart_otp_read(void);
 extern void uart_deploy(void);
+extern void wtp_ecc_stats(u64 *bits, u64 *corrected);
+extern u64 wtp_link_errors(void);
+extern void wtp_print_link_health(void);
+extern void uart_log_open(const char *path);
+extern void uart_expect(const char *path);
 extern void uart_terminal(void);
 
 extern const char *uart_terminal_kbs;